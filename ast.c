@@ -1,10 +1,12 @@
-struct Ast;
+// The AST of a file is kept flat.  A node is a 32-bit index, its type
+// and the index of its payload in the array for that type are kept in
+// arrays of their own, and the statements of a block are a range in
+// `children`.  Nodes are added in post-order, so the children of a
+// node always come before it and all nodes of a subtree are next to
+// each other.
+typedef uint32_t AstRef;
 
-struct AstList {
-    struct Ast* first;
-    struct Ast* last;
-};
-typedef struct AstList AstList;
+#define AST_NONE UINT32_MAX
 
 enum AstType {
     AST_ROOT,
@@ -21,357 +23,326 @@ enum AstType {
     AST_CALL,
 };
 
+struct AstNum {
+    bool sign;
+    union {
+        uint64_t u;
+        int64_t i;
+    };
+};
+
+struct AstOper {
+    AstRef l;
+    AstRef r;
+    enum oper oper;
+};
+
+// AST_LABEL and AST_CALL.
+struct AstName {
+    Sym name;
+    Binding* binding;  // For calls, filled in when the files are merged.
+};
+
+// AST_ROOT, AST_FN, AST_IF and AST_WHILE.
 struct AstBlock {
-    struct Ast* parent;
-    AstList children;
+    AstRef first;         // The first node of the subtree.
+    AstRef head;          // The condition of AST_IF and AST_WHILE.
+    uint32_t children;    // The statements are children[children..][..n].
+    uint32_t n_children;
+    Binding* name;        // AST_FN.
 };
 
-struct Ast {
-    enum AstType type;
-    struct Ast* next;  // When in a list.
-    union {
-        struct AstRoot {
-            AstList children;
-        } root;
-        struct AstNum {
-            bool sign;
-            union {
-                uint64_t u;
-                int64_t i;
-            };
-        } num;
-        struct AstOper {
-            enum oper oper;
-            struct Ast* l;
-            struct Ast* r;
-        } oper;
-        struct AstFn {
-            struct AstBlock block;
-            Binding* name;
-        } fn_block;
-        struct AstIf {
-            struct AstBlock block;
-            struct Ast* head;
-        } if_block;
-        struct AstWhile {
-            struct AstBlock block;
-            struct Ast* head;
-        } while_block;
-        struct AstExit {
-            struct Ast* val;
-        } exit;
-        struct AstRet {
-            struct Ast* val;
-        } ret;
-        struct AstLabel {
-            Str name;
-        } label;
-        struct AstAssign {
-            Binding* binding;
-            struct Ast* val;
-        } assign;
-        struct AstVar {
-            struct Ast* value;
-            Binding* binding;
-        } var;
-        struct AstCall {
-            Binding* binding;
-        } call;
-    };
+// AST_VAR and AST_ASSIGN.
+struct AstVar {
+    AstRef val;
+    Binding* binding;
+};
+
+struct AstTree {
+    uint8_t* types;   // enum AstType
+    // The index in the array for the type.  For AST_EXIT and AST_RET
+    // it is the value.
+    uint32_t* data;
+    uint32_t n_nodes;
+    uint32_t cap;     // Of every array.
+
+    struct AstNum* nums;
+    uint32_t n_nums;
+    struct AstOper* opers;
+    uint32_t n_opers;
+    struct AstName* names;
+    uint32_t n_names;
+    struct AstBlock* blocks;
+    uint32_t n_blocks;
+    struct AstVar* vars;
+    uint32_t n_vars;
+    AstRef* children;
+    uint32_t n_children;
+
+    AstRef root;
 };
-typedef struct Ast Ast;
+typedef struct AstTree AstTree;
 
-static Mem ast_mem;
+// Each thread that parses has its own arena.
+static _Thread_local Mem ast_mem;
 
+// `cap` is the most nodes the tree will get.  The arrays are allocated
+// once with room for that many, and only the pages that are written
+// to take any memory.
 static void
-ast_list_add(AstList* list, Ast* a) {
-    if (list->last) {
-        list->last->next = a;
-    }
-    list->last = a;
-    if (list->first == NULL) {
-        list->first = a;
-    }
+ast_tree_init(AstTree* t, size_t cap) {
+    *t = (AstTree){
+        .types = mem_alloc_array(&ast_mem, uint8_t, cap),
+        .data = mem_alloc_array(&ast_mem, uint32_t, cap),
+        .cap = cap,
+        .nums = mem_alloc_array(&ast_mem, struct AstNum, cap),
+        .opers = mem_alloc_array(&ast_mem, struct AstOper, cap),
+        .names = mem_alloc_array(&ast_mem, struct AstName, cap),
+        .blocks = mem_alloc_array(&ast_mem, struct AstBlock, cap),
+        .vars = mem_alloc_array(&ast_mem, struct AstVar, cap),
+        .children = mem_alloc_array(&ast_mem, AstRef, cap),
+        .root = AST_NONE,
+    };
 }
 
-// The `next` and `parent` fields in `a` does not need to be filled in.
-static Ast*
-ast_add(Ast* block, Ast* a) {
-    a->next = NULL;
-    switch (block->type) {
-    case AST_IF:
-        ast_list_add(&block->if_block.block.children, a);
-        break;
-    case AST_WHILE:
-        ast_list_add(&block->while_block.block.children, a);
-        break;
-    case AST_ROOT:
-        ast_list_add(&block->root.children, a);
-        break;
-    case AST_FN:
-        ast_list_add(&block->fn_block.block.children, a);
-        break;
-    default:
-        abort();
-        break;
-    }
-    switch (a->type) {
-    case AST_IF:
-        a->if_block.block.parent = block;
-        break;
-    case AST_WHILE:
-        a->while_block.block.parent = block;
-        break;
-    case AST_FN:
-        a->fn_block.block.parent = block;
-        break;
-    default:
-        break;
-    }
-    return a;
+static inline enum AstType
+ast_type(const AstTree* t, AstRef a) {
+    return t->types[a];
 }
 
-static Ast*
-ast_new_exit(Ast* val) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_EXIT,
-        .exit = {
-            .val = val,
-        },
-    };
-    return a;
+static inline struct AstNum*
+ast_num(const AstTree* t, AstRef a) {
+    assert(t->types[a] == AST_NUM);
+    return &t->nums[t->data[a]];
 }
 
-static Ast*
-ast_new_ret(Ast* val) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_RET,
-        .ret = {
-            .val = val,
-        },
-    };
-    return a;
+static inline struct AstOper*
+ast_oper(const AstTree* t, AstRef a) {
+    assert(t->types[a] == AST_OPER);
+    return &t->opers[t->data[a]];
 }
 
-static Ast*
-ast_new_fn(Binding* binding) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_FN,
-        .fn_block = {
-            .name = binding,
-        },
-    };
-    return a;
+static inline struct AstName*
+ast_name(const AstTree* t, AstRef a) {
+    assert(t->types[a] == AST_LABEL || t->types[a] == AST_CALL);
+    return &t->names[t->data[a]];
 }
 
-static Ast*
-ast_new_if(Ast* head) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_IF,
-        .if_block = {
-            .head = head,
-        },
-    };
-    return a;
+static inline struct AstBlock*
+ast_block(const AstTree* t, AstRef a) {
+    assert(t->types[a] == AST_ROOT || t->types[a] == AST_FN
+           || t->types[a] == AST_IF || t->types[a] == AST_WHILE);
+    return &t->blocks[t->data[a]];
 }
 
-static Ast*
-ast_new_while(Ast* head) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_WHILE,
-        .while_block = {
-            .head = head,
-        },
-    };
-    return a;
+static inline struct AstVar*
+ast_var(const AstTree* t, AstRef a) {
+    assert(t->types[a] == AST_VAR || t->types[a] == AST_ASSIGN);
+    return &t->vars[t->data[a]];
+}
+
+// The value of AST_EXIT and AST_RET.
+static inline AstRef
+ast_val(const AstTree* t, AstRef a) {
+    assert(t->types[a] == AST_EXIT || t->types[a] == AST_RET);
+    return t->data[a];
+}
+
+#define ast_for_children(a, t, blk) \
+    for (AstRef* a##_it = &(t)->children[(blk)->children], \
+                * a##_end = a##_it + (blk)->n_children, a; \
+         a##_it < a##_end && (a = *a##_it, true); a##_it++)
+
+static AstRef
+ast_add_node(AstTree* t, enum AstType type, uint32_t data) {
+    assert(t->n_nodes < t->cap);
+    t->types[t->n_nodes] = type;
+    t->data[t->n_nodes] = data;
+    t->n_nodes++;
+    return t->n_nodes - 1;
 }
 
-static Ast*
-ast_new_oper(Ast* l, enum oper oper, Ast* r) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_OPER,
-        .oper = {
-            .oper = oper,
-            .l = l,
-            .r = r,
-        },
+static AstRef
+ast_new_exit(AstTree* t, AstRef val) {
+    return ast_add_node(t, AST_EXIT, val);
+}
+
+static AstRef
+ast_new_ret(AstTree* t, AstRef val) {
+    return ast_add_node(t, AST_RET, val);
+}
+
+// The statements are the last n_children in `stmts`.  The nodes from
+// `first` on are the subtree of the block.
+static AstRef
+ast_new_block(AstTree* t, enum AstType type, AstRef first, AstRef head,
+              Binding* name, const AstRef* stmts, uint32_t n_children) {
+    memcpy(&t->children[t->n_children], stmts, n_children * sizeof *stmts);
+    t->blocks[t->n_blocks] = (struct AstBlock){
+        .first = first,
+        .head = head,
+        .children = t->n_children,
+        .n_children = n_children,
+        .name = name,
     };
-    return a;
+    t->n_children += n_children;
+    t->n_blocks++;
+    return ast_add_node(t, type, t->n_blocks - 1);
 }
 
-static Ast*
-ast_new_num_signed(int64_t n) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_NUM,
-        .num = {
-            .sign = true,
-            .i = n,
-        },
+static AstRef
+ast_new_oper(AstTree* t, AstRef l, enum oper oper, AstRef r) {
+    t->opers[t->n_opers] = (struct AstOper){
+        .l = l,
+        .r = r,
+        .oper = oper,
     };
-    return a;
+    t->n_opers++;
+    return ast_add_node(t, AST_OPER, t->n_opers - 1);
 }
 
-static Ast*
-ast_new_label(Str label) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_LABEL,
-        .label = {
-            .name = label,
-        },
+static AstRef
+ast_new_num_signed(AstTree* t, int64_t n) {
+    t->nums[t->n_nums] = (struct AstNum){
+        .sign = true,
+        .i = n,
     };
-    return a;
+    t->n_nums++;
+    return ast_add_node(t, AST_NUM, t->n_nums - 1);
 }
 
-static Ast*
-ast_new_assign(Binding* b, Ast* val) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_ASSIGN,
-        .assign = {
-            .binding = b,
-            .val = val,
-        },
+static AstRef
+ast_new_label(AstTree* t, Sym label, Binding* binding) {
+    t->names[t->n_names] = (struct AstName){
+        .name = label,
+        .binding = binding,
     };
-    return a;
+    t->n_names++;
+    return ast_add_node(t, AST_LABEL, t->n_names - 1);
 }
 
-static Ast*
-ast_new_var(Ast* val, Binding* b) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_VAR,
-        .var = {
-            .value = val,
-            .binding = b,
-        },
+static AstRef
+ast_new_call(AstTree* t, Sym name) {
+    t->names[t->n_names] = (struct AstName){
+        .name = name,
     };
-    return a;
+    t->n_names++;
+    return ast_add_node(t, AST_CALL, t->n_names - 1);
 }
 
-static Ast*
-ast_new_call(Binding* b) {
-    Ast* a = mem_alloc(&ast_mem, Ast);
-    *a = (Ast) {
-        .type = AST_CALL,
-        .call = {
-            .binding = b,
-        },
+static AstRef
+ast_new_assign(AstTree* t, Binding* b, AstRef val) {
+    t->vars[t->n_vars] = (struct AstVar){
+        .val = val,
+        .binding = b,
     };
-    return a;
+    t->n_vars++;
+    return ast_add_node(t, AST_ASSIGN, t->n_vars - 1);
 }
 
-static uint64_t
-ast_calc_static_value(Ast* ast) {
-    switch (ast->type) {
-    case AST_NUM: {
-        return ast->num.u;
-    } break;
-    case AST_OPER: {
-        uint64_t l = ast_calc_static_value(ast->oper.l);
-        uint64_t r = ast_calc_static_value(ast->oper.r);
-        return l + r;
-    } break;
-    default:
-        assert(false);
-    }
+static AstRef
+ast_new_var(AstTree* t, AstRef val, Binding* b) {
+    t->vars[t->n_vars] = (struct AstVar){
+        .val = val,
+        .binding = b,
+    };
+    t->n_vars++;
+    return ast_add_node(t, AST_VAR, t->n_vars - 1);
 }
 
 static void
-print_ast_part(Ast* ast, int indent);
+print_ast_part(FILE* f, const AstTree* t, AstRef a, int indent);
 
 static void
-print_ast_children(AstList* list, int indent) {
-    Ast* a = list->first;
-    while (a) {
-        print_ast_part(a, indent);
-        a = a->next;
+print_ast_children(FILE* f, const AstTree* t, const struct AstBlock* blk,
+                   int indent) {
+    ast_for_children(a, t, blk) {
+        print_ast_part(f, t, a, indent);
     }
 }
 
 static void
-print_ast_part(Ast* ast, int indent) {
-    Ast* a = ast;
+print_ast_part(FILE* f, const AstTree* t, AstRef a, int indent) {
     int insp = indent * 4;
-    switch (a->type) {
+    switch (ast_type(t, a)) {
     case AST_VAR: {
-        Binding* b = a->var.binding;
-        fprintf(stderr, "%*s%.*s %.*s ", insp, "",
-                (int)b->name.len, b->name.data,
-                (int)b->type->name.len, b->type->name.data);
-        print_ast_part(a->var.value, indent);
-        fprintf(stderr, ";\n");
+        Binding* b = ast_var(t, a)->binding;
+        Str name = sym_str(b->name);
+        Str type = sym_str(b->type->name);
+        fprintf(f, "%*s%.*s %.*s ", insp, "",
+                (int)name.len, name.data, (int)type.len, type.data);
+        print_ast_part(f, t, ast_var(t, a)->val, indent);
+        fprintf(f, ";\n");
     } break;
     case AST_IF: {
-        fprintf(stderr, "%*sif ", insp, "");
-        print_ast_part(a->if_block.head, indent);
-        fprintf(stderr, " {\n");
-        print_ast_children(&a->if_block.block.children, indent + 1);
-        fprintf(stderr, "%*s}\n", insp, "");
+        fprintf(f, "%*sif ", insp, "");
+        print_ast_part(f, t, ast_block(t, a)->head, indent);
+        fprintf(f, " {\n");
+        print_ast_children(f, t, ast_block(t, a), indent + 1);
+        fprintf(f, "%*s}\n", insp, "");
     } break;
     case AST_WHILE: {
-        fprintf(stderr, "%*swhile ", insp, "");
-        print_ast_part(a->while_block.head, indent);
-        fprintf(stderr, " {\n");
-        print_ast_children(&a->while_block.block.children, indent + 1);
-        fprintf(stderr, "%*s}\n", insp, "");
+        fprintf(f, "%*swhile ", insp, "");
+        print_ast_part(f, t, ast_block(t, a)->head, indent);
+        fprintf(f, " {\n");
+        print_ast_children(f, t, ast_block(t, a), indent + 1);
+        fprintf(f, "%*s}\n", insp, "");
     } break;
     case AST_FN: {
-        Binding* b = a->fn_block.name;
-        fprintf(stderr, "%*sfn %.*s {\n",
-                insp, "", (int)b->name.len, b->name.data);
-        print_ast_children(&a->fn_block.block.children, indent + 1);
-        fprintf(stderr, "%*s}\n", insp, "");
+        Str name = sym_str(ast_block(t, a)->name->name);
+        fprintf(f, "%*sfn %.*s {\n",
+                insp, "", (int)name.len, name.data);
+        print_ast_children(f, t, ast_block(t, a), indent + 1);
+        fprintf(f, "%*s}\n", insp, "");
     } break;
     case AST_ROOT: {
-        fprintf(stderr, "%*sroot {\n", insp, "");
-        print_ast_children(&a->root.children, indent + 1);
-        fprintf(stderr, "%*s}\n", insp, "");
+        fprintf(f, "%*sroot {\n", insp, "");
+        print_ast_children(f, t, ast_block(t, a), indent + 1);
+        fprintf(f, "%*s}\n", insp, "");
     } break;
     case AST_EXIT: {
-        fprintf(stderr, "%*sexit ", insp, "");
-        print_ast_part(a->exit.val, indent);
-        fprintf(stderr, ";\n");
+        fprintf(f, "%*sexit ", insp, "");
+        print_ast_part(f, t, ast_val(t, a), indent);
+        fprintf(f, ";\n");
     } break;
     case AST_NUM: {
-        if (ast->num.sign) {
-            fprintf(stderr, "%ld", ast->num.i);
+        const struct AstNum* n = ast_num(t, a);
+        if (n->sign) {
+            fprintf(f, "%ld", n->i);
         } else {
-            fprintf(stderr, "%lu", ast->num.u);
+            fprintf(f, "%lu", n->u);
         }
     } break;
     case AST_LABEL: {
-        fprintf(stderr, "%.*s", (int)a->label.name.len, a->label.name.data);
+        Str name = sym_str(ast_name(t, a)->name);
+        fprintf(f, "%.*s", (int)name.len, name.data);
     } break;
     case AST_OPER: {
-        struct AstOper* o = &a->oper;
-        fprintf(stderr, "%s(", oper_to_str(o->oper));
-        print_ast_part(o->l, indent);
-        fprintf(stderr, ", ");
-        print_ast_part(o->r, indent);
-        fprintf(stderr, ")");
+        const struct AstOper* o = ast_oper(t, a);
+        fprintf(f, "%s(", oper_to_str(o->oper));
+        print_ast_part(f, t, o->l, indent);
+        fprintf(f, ", ");
+        print_ast_part(f, t, o->r, indent);
+        fprintf(f, ")");
     } break;
     case AST_ASSIGN: {
-        Str bn = a->assign.binding->name;
-        fprintf(stderr, "%*s%.*s = ", insp, "", (int)bn.len, bn.data);
-        print_ast_part(a->assign.val, indent);
-        fprintf(stderr, "\n");
+        Str bn = sym_str(ast_var(t, a)->binding->name);
+        fprintf(f, "%*s%.*s = ", insp, "", (int)bn.len, bn.data);
+        print_ast_part(f, t, ast_var(t, a)->val, indent);
+        fprintf(f, "\n");
     } break;
     case AST_CALL: {
-        Str name = a->call.binding->name;
-        fprintf(stderr, "%.*s()", (int)name.len, name.data);
+        Str name = sym_str(ast_name(t, a)->binding->name);
+        fprintf(f, "%.*s()", (int)name.len, name.data);
     } break;
+    case AST_RET:
+        break;
     }
 }
 
 static void
-print_ast(Ast* ast) {
-    return print_ast_part(ast, 0);
+print_ast(FILE* f, const AstTree* t) {
+    if (t->root != AST_NONE) {
+        print_ast_part(f, t, t->root, 0);
+    }
 }
@@ -0,0 +1,603 @@
+// Throughput benchmark for the compiler.
+//
+// bench gen [params]  writes a generated program to stdout.
+// bench run [options] compiles a suite of generated programs several
+//                     times each and reports how fast it went.
+//
+// See bench/README.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define ARR_LEN(a) (sizeof (a) / sizeof *(a))
+
+// What a generated program looks like.  Every dimension can be scaled
+// on its own.
+struct GenParams {
+    uint64_t seed;
+    int fns;    // Functions, not counting main.
+    int stmts;  // Statements in each function, nested ones included.
+    int depth;  // Precedence levels in an expression: 1 is + and -,
+                // 2 adds *, 3 adds <.  0 is a single operand.
+    int width;  // Operands on each level.
+    int nest;   // How deep if and while can be nested.
+    int vars;   // Variables declared at the start of each function.
+};
+
+static const struct GenParams default_params = {
+    .seed = 1,
+    .fns = 100,
+    .stmts = 20,
+    .depth = 1,
+    .width = 2,
+    .nest = 2,
+    .vars = 4,
+};
+
+// xorshift64*, so the programs are the same everywhere.
+static uint64_t rng_state;
+
+static uint32_t
+rng() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545f4914f6cdd1du) >> 32;
+}
+
+static int
+rng_below(int n) {
+    return n > 0 ? (int)(rng() % (uint32_t)n) : 0;
+}
+
+struct GenState {
+    FILE* f;
+    const struct GenParams* p;
+    int fn;      // The function that is generated.
+    int n_vars;  // Variables declared so far in the function.
+    int left;    // Statements left in the function.
+};
+
+static void
+gen_operand(struct GenState* g) {
+    int r = rng_below(10);
+    if (r < 4 && g->n_vars > 0) {
+        fprintf(g->f, "v%d", rng_below(g->n_vars));
+    } else if (r == 4 && g->fn > 0) {
+        fprintf(g->f, "f%d()", rng_below(g->fn));
+    } else {
+        fprintf(g->f, "%d", rng_below(100));
+    }
+}
+
+// The operators of each precedence level, lowest first.
+static const char* const level_ops[][2] = {
+    {"<", "<"},
+    {"+", "-"},
+    {"*", "*"},
+};
+
+// Levels are used from the highest precedence down, so depth 1 uses
+// only + and -.
+static void
+gen_expr_level(struct GenState* g, int depth) {
+    if (depth <= 0) {
+        gen_operand(g);
+        return;
+    }
+    int level = depth == 1 ? 1 : depth == 2 ? 2 : 0;
+    for (int i = 0; i < g->p->width; i++) {
+        if (i > 0) {
+            fprintf(g->f, " %s ", level_ops[level][rng_below(2)]);
+        }
+        gen_expr_level(g, depth - 1);
+    }
+}
+
+static void
+gen_expr(struct GenState* g) {
+    int depth = g->p->depth < 3 ? g->p->depth : 3;
+    gen_expr_level(g, depth);
+}
+
+static void
+gen_indent(struct GenState* g, int indent) {
+    fprintf(g->f, "%*s", indent * 4, "");
+}
+
+static void
+gen_block(struct GenState* g, int indent, int nest) {
+    int n = 1 + rng_below(4);
+    for (int i = 0; i < n && g->left > 0; i++) {
+        g->left--;
+        int r = rng_below(10);
+        if (r < 2 && nest < g->p->nest) {
+            gen_indent(g, indent);
+            fprintf(g->f, "if ");
+            gen_expr(g);
+            fprintf(g->f, " {\n");
+            gen_block(g, indent + 1, nest + 1);
+            gen_indent(g, indent);
+            fprintf(g->f, "}\n");
+        } else if (r < 3 && nest < g->p->nest && g->n_vars > 0) {
+            // Counts down, so it ends.
+            int v = rng_below(g->n_vars);
+            gen_indent(g, indent);
+            fprintf(g->f, "while v%d {\n", v);
+            gen_indent(g, indent + 1);
+            fprintf(g->f, "v%d = v%d - 1;\n", v, v);
+            gen_block(g, indent + 1, nest + 1);
+            gen_indent(g, indent);
+            fprintf(g->f, "}\n");
+        } else if (g->n_vars > 0) {
+            gen_indent(g, indent);
+            fprintf(g->f, "v%d = ", rng_below(g->n_vars));
+            gen_expr(g);
+            fprintf(g->f, ";\n");
+        } else {
+            gen_indent(g, indent);
+            fprintf(g->f, "v%d u64 ", g->n_vars);
+            gen_expr(g);
+            fprintf(g->f, ";\n");
+            g->n_vars++;
+        }
+    }
+}
+
+static void
+gen_program(FILE* f, const struct GenParams* p) {
+    rng_state = p->seed * 0x9e3779b97f4a7c15u + 1;
+    struct GenState g = {.f = f, .p = p};
+    for (g.fn = 0; g.fn < p->fns; g.fn++) {
+        g.n_vars = 0;
+        g.left = p->stmts;
+        fprintf(f, "f%d u64() {\n", g.fn);
+        for (int i = 0; i < p->vars; i++) {
+            fprintf(f, "    v%d u64 ", i);
+            gen_expr(&g);
+            fprintf(f, ";\n");
+            g.n_vars++;
+        }
+        while (g.left > 0) {
+            gen_block(&g, 1, 0);
+        }
+        fprintf(f, "    return ");
+        gen_expr(&g);
+        fprintf(f, ";\n}\n");
+    }
+    if (p->fns > 0) {
+        fprintf(f, "main void() {\n    exit f%d();\n}\n", p->fns - 1);
+    } else {
+        fprintf(f, "main void() {\n    exit 0;\n}\n");
+    }
+}
+
+// Parses --name=N for the generator.  Returns false if arg is not one.
+static bool
+parse_gen_param(const char* arg, struct GenParams* p) {
+    struct {
+        const char* name;
+        int* val;
+    } ints[] = {
+        {"--fns=", &p->fns},
+        {"--stmts=", &p->stmts},
+        {"--depth=", &p->depth},
+        {"--width=", &p->width},
+        {"--nest=", &p->nest},
+        {"--vars=", &p->vars},
+    };
+    for (size_t i = 0; i < ARR_LEN(ints); i++) {
+        size_t len = strlen(ints[i].name);
+        if (strncmp(arg, ints[i].name, len) == 0) {
+            *ints[i].val = atoi(arg + len);
+            return true;
+        }
+    }
+    if (strncmp(arg, "--seed=", 7) == 0) {
+        p->seed = strtoull(arg + 7, NULL, 10);
+        return true;
+    }
+    return false;
+}
+
+// A program of the suite.  Each one scales one dimension of the
+// default program.
+struct Case {
+    const char* name;
+    struct GenParams params;
+};
+
+static struct Case*
+make_suite(double scale, size_t* n_cases) {
+    static struct Case cases[7];
+    struct GenParams d = default_params;
+    d.fns = d.fns * scale > 1 ? d.fns * scale : 1;
+    size_t n = 0;
+    cases[n++] = (struct Case){"base", d};
+    cases[n] = (struct Case){"fns", d};
+    cases[n++].params.fns *= 20;
+    cases[n] = (struct Case){"stmts", d};
+    cases[n++].params.stmts *= 25;
+    cases[n] = (struct Case){"expr-width", d};
+    cases[n++].params.width = 16;
+    cases[n] = (struct Case){"expr-depth", d};
+    cases[n++].params.depth = 3;
+    cases[n] = (struct Case){"nest", d};
+    cases[n++].params.nest = 8;
+    cases[n] = (struct Case){"vars", d};
+    cases[n++].params.vars = 64;
+    *n_cases = n;
+    return cases;
+}
+
+struct Result {
+    char name[64];
+    bool ok;
+    int status;       // Exit status or signal of a failed compile.
+    size_t lines;
+    double median_s;
+    double lines_per_s;
+    size_t text_bytes;
+    double text_bytes_per_s;
+    long peak_rss_kib;
+};
+
+static double
+now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Runs the compiler once in the current directory.  Returns the wait
+// status.
+static int
+run_compiler(const char* compiler, const char* source, double* secs,
+             long* rss_kib) {
+    double start = now_s();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        execl(compiler, compiler, "--no-cache", source, (char*)NULL);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1) {
+        perror("wait4");
+        exit(1);
+    }
+    *secs = now_s() - start;
+    *rss_kib = ru.ru_maxrss;
+    return status;
+}
+
+// The size of the executable segment of the ELF file at path.
+static size_t
+text_size(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    Elf64_Ehdr eh;
+    size_t size = 0;
+    if (fread(&eh, sizeof eh, 1, f) == 1 && fseek(f, eh.e_phoff, SEEK_SET) == 0) {
+        for (int i = 0; i < eh.e_phnum; i++) {
+            Elf64_Phdr ph;
+            if (fread(&ph, sizeof ph, 1, f) != 1) {
+                break;
+            }
+            if (ph.p_type == PT_LOAD && (ph.p_flags & PF_X)) {
+                size += ph.p_filesz;
+            }
+        }
+    }
+    fclose(f);
+    return size;
+}
+
+static size_t
+count_lines(const char* path) {
+    FILE* f = fopen(path, "r");
+    size_t n = 0;
+    int c;
+    while (f && (c = getc(f)) != EOF) {
+        n += c == '\n';
+    }
+    if (f) {
+        fclose(f);
+    }
+    return n;
+}
+
+static void
+run_case(const struct Case* c, const char* compiler, int runs,
+         struct Result* r) {
+    *r = (struct Result){0};
+    snprintf(r->name, sizeof r->name, "%s", c->name);
+    FILE* f = fopen("case.l", "w");
+    if (f == NULL) {
+        perror("case.l");
+        exit(1);
+    }
+    gen_program(f, &c->params);
+    fclose(f);
+    r->lines = count_lines("case.l");
+
+    double* times = calloc(runs, sizeof *times);
+    r->ok = true;
+    for (int i = 0; i < runs; i++) {
+        unlink("a");
+        long rss;
+        int status = run_compiler(compiler, "case.l", &times[i], &rss);
+        if (rss > r->peak_rss_kib) {
+            r->peak_rss_kib = rss;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0
+            || access("a", F_OK) != 0) {
+            r->ok = false;
+            r->status = WIFSIGNALED(status) ? -WTERMSIG(status)
+                                            : WEXITSTATUS(status);
+            break;
+        }
+    }
+    if (r->ok) {
+        qsort(times, runs, sizeof *times, cmp_double);
+        r->median_s = runs % 2 ? times[runs / 2]
+                               : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+        r->text_bytes = text_size("a");
+        r->lines_per_s = r->lines / r->median_s;
+        r->text_bytes_per_s = r->text_bytes / r->median_s;
+    }
+    free(times);
+}
+
+#define RESULTS_HEADER \
+    "case\tstatus\tlines\tmedian_s\tlines_per_s\ttext_bytes\t" \
+    "text_bytes_per_s\tpeak_rss_kib\n"
+
+static bool
+write_results(const char* path, const struct Result* rs, size_t n) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fprintf(f, RESULTS_HEADER);
+    for (size_t i = 0; i < n; i++) {
+        const struct Result* r = &rs[i];
+        fprintf(f, "%s\t%d\t%zu\t%.6f\t%.1f\t%zu\t%.1f\t%ld\n",
+                r->name, r->ok ? 0 : (r->status ? r->status : 1), r->lines,
+                r->median_s, r->lines_per_s, r->text_bytes,
+                r->text_bytes_per_s, r->peak_rss_kib);
+    }
+    return fclose(f) == 0;
+}
+
+// Returns the number of results read, or -1 if the file can not be
+// read.
+static long
+read_results(const char* path, struct Result* rs, size_t cap) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[512];
+    size_t n = 0;
+    if (fgets(line, sizeof line, f) == NULL) {
+        fclose(f);
+        return 0;
+    }
+    while (n < cap && fgets(line, sizeof line, f)) {
+        struct Result* r = &rs[n];
+        *r = (struct Result){0};
+        int status;
+        if (sscanf(line, "%63s %d %zu %lf %lf %zu %lf %ld", r->name, &status,
+                   &r->lines, &r->median_s, &r->lines_per_s, &r->text_bytes,
+                   &r->text_bytes_per_s, &r->peak_rss_kib) == 8) {
+            r->ok = status == 0;
+            r->status = status;
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+// Prints how the results changed.  Returns the number of cases that
+// got slower or bigger by more than threshold percent, or stopped
+// compiling.
+static int
+compare_results(const struct Result* rs, size_t n, const struct Result* base,
+                size_t n_base, double threshold) {
+    int regressions = 0;
+    printf("\n%-12s %12s %12s\n", "vs baseline", "lines/s", "peak RSS");
+    for (size_t i = 0; i < n; i++) {
+        const struct Result* r = &rs[i];
+        const struct Result* b = NULL;
+        for (size_t j = 0; j < n_base; j++) {
+            if (strcmp(base[j].name, r->name) == 0) {
+                b = &base[j];
+            }
+        }
+        if (b == NULL || !b->ok) {
+            continue;
+        }
+        if (!r->ok) {
+            printf("%-12s %12s\n", r->name, "FAILED");
+            regressions++;
+            continue;
+        }
+        double speed = 100 * (r->lines_per_s / b->lines_per_s - 1);
+        double rss = 100 * ((double)r->peak_rss_kib / b->peak_rss_kib - 1);
+        bool bad = speed < -threshold || rss > threshold;
+        printf("%-12s %+11.1f%% %+11.1f%%%s\n", r->name, speed, rss,
+               bad ? "  REGRESSION" : "");
+        regressions += bad;
+    }
+    return regressions;
+}
+
+static void
+usage() {
+    fprintf(stderr,
+            "usage: bench gen [--seed=N] [--fns=N] [--stmts=N] [--depth=N]\n"
+            "                 [--width=N] [--nest=N] [--vars=N]\n"
+            "       bench run [--compiler=PATH] [--runs=N] [--scale=X]\n"
+            "                 [--out=FILE] [--baseline=FILE]\n"
+            "                 [--threshold=PCT]\n");
+}
+
+static int
+cmd_gen(int argc, char** argv) {
+    struct GenParams p = default_params;
+    for (int i = 0; i < argc; i++) {
+        if (!parse_gen_param(argv[i], &p)) {
+            usage();
+            return 1;
+        }
+    }
+    gen_program(stdout, &p);
+    return 0;
+}
+
+static char*
+abs_path(const char* cwd, const char* path) {
+    char* p;
+    if (path[0] == '/') {
+        p = strdup(path);
+    } else if (asprintf(&p, "%s/%s", cwd, path) == -1) {
+        p = NULL;
+    }
+    if (p == NULL) {
+        perror("malloc");
+        abort();
+    }
+    return p;
+}
+
+static int
+cmd_run(int argc, char** argv) {
+    const char* compiler = "./l";
+    const char* out = "bench-results.tsv";
+    const char* baseline = "bench/baseline.tsv";
+    int runs = 5;
+    double scale = 1;
+    double threshold = 10;
+    for (int i = 0; i < argc; i++) {
+        const char* a = argv[i];
+        if (strncmp(a, "--compiler=", 11) == 0) {
+            compiler = a + 11;
+        } else if (strncmp(a, "--runs=", 7) == 0) {
+            runs = atoi(a + 7);
+        } else if (strncmp(a, "--scale=", 8) == 0) {
+            scale = atof(a + 8);
+        } else if (strncmp(a, "--out=", 6) == 0) {
+            out = a + 6;
+        } else if (strncmp(a, "--baseline=", 11) == 0) {
+            baseline = a + 11;
+        } else if (strncmp(a, "--threshold=", 12) == 0) {
+            threshold = atof(a + 12);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (runs < 1) {
+        runs = 1;
+    }
+    // Paths are made absolute since the compiler runs in a directory
+    // of its own, where it writes its output.
+    char compiler_path[PATH_MAX];
+    if (realpath(compiler, compiler_path) == NULL) {
+        perror(compiler);
+        return 1;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof cwd) == NULL) {
+        perror("getcwd");
+        return 1;
+    }
+    char* out_path = abs_path(cwd, out);
+    char* baseline_path = abs_path(cwd, baseline);
+    char dir[] = "/tmp/l-bench.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    size_t n_cases;
+    const struct Case* cases = make_suite(scale, &n_cases);
+    struct Result results[n_cases];
+    printf("%-12s %8s %10s %12s %14s %10s\n", "case", "lines", "median ms",
+           "lines/s", "text bytes/s", "RSS KiB");
+    for (size_t i = 0; i < n_cases; i++) {
+        struct Result* r = &results[i];
+        run_case(&cases[i], compiler_path, runs, r);
+        if (r->ok) {
+            printf("%-12s %8zu %10.2f %12.0f %14.0f %10ld\n", r->name,
+                   r->lines, r->median_s * 1e3, r->lines_per_s,
+                   r->text_bytes_per_s, r->peak_rss_kib);
+        } else {
+            printf("%-12s %8zu  failed (%s %d)\n", r->name, r->lines,
+                   r->status < 0 ? "signal" : "exit status",
+                   r->status < 0 ? -r->status : r->status);
+        }
+        fflush(stdout);
+    }
+    unlink("case.l");
+    unlink("a");
+    if (chdir(cwd) != 0 || rmdir(dir) != 0) {
+        perror(dir);
+    }
+
+    if (!write_results(out_path, results, n_cases)) {
+        return 1;
+    }
+    struct Result base[64];
+    long n_base = read_results(baseline_path, base, ARR_LEN(base));
+    if (n_base < 0) {
+        return 0;
+    }
+    if (compare_results(results, n_cases, base, n_base, threshold) > 0) {
+        return 2;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "gen") == 0) {
+        return cmd_gen(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "run") == 0) {
+        return cmd_run(argc - 2, argv + 2);
+    }
+    usage();
+    return 1;
+}
@@ -0,0 +1,442 @@
+#include <dirent.h>
+#include <errno.h>
+
+// Cache of encoded functions on disk.  An entry is keyed by a hash of
+// the function's AST and holds its text and the calls that are patched
+// when linking.
+
+// Part of every hash, so entries from another build of the compiler
+// are never used.
+#define CACHE_VERSION "l-fncache-2 rv64 " __DATE__ " " __TIME__
+
+#define CACHE_MAGIC 0x434e464cu  // "LFNC"
+
+struct CacheFixup {
+    uint32_t type;    // enum Rv64Type of the patched instruction.
+    uint32_t offset;  // In the function's text.
+    Str callee;       // Points into the entry's buffer.
+};
+
+struct CacheEntry {
+    uint32_t start;   // Offset of the function start in the text.
+    Str text;
+    struct CacheFixup* fixups;
+    size_t n_fixups;
+    char* buf;        // The whole file.
+};
+
+struct CacheStats {
+    atomic_size_t hits;
+    atomic_size_t misses;
+    atomic_size_t stored;
+    size_t evicted;
+    size_t size;
+};
+
+static struct CacheStats cache_stats;
+static char cache_dir[4096];
+
+static void
+hash_bytes(uint64_t* h, const void* data, size_t len) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < len; i++) {
+        *h = (*h ^ p[i]) * 0x100000001b3u;
+    }
+}
+
+static void
+hash_u64(uint64_t* h, uint64_t x) {
+    hash_bytes(h, &x, sizeof x);
+}
+
+static void
+hash_str(uint64_t* h, Str s) {
+    hash_u64(h, s.len);
+    hash_bytes(h, s.data, s.len);
+}
+
+static void
+hash_binding(uint64_t* h, const Binding* b) {
+    hash_str(h, b ? sym_str(b->name) : STR(""));
+    hash_str(h, b && b->type ? sym_str(b->type->name) : STR(""));
+}
+
+static void
+hash_expr(uint64_t* h, const AstTree* t, AstRef a);
+
+// A label is hashed by its text since symbol numbers differ between
+// runs.  A variable from outside [first, last] has its value compiled
+// into the function, so the value is part of the hash.
+static void
+hash_label(uint64_t* h, const AstTree* t, AstRef a, AstRef first,
+           AstRef last) {
+    const struct AstName* label = ast_name(t, a);
+    hash_str(h, sym_str(label->name));
+    const Binding* b = label->binding;
+    if (b && (b->decl < first || b->decl > last)
+        && ast_type(t, b->decl) == AST_VAR) {
+        hash_expr(h, t, ast_var(t, b->decl)->val);
+    }
+}
+
+static void
+hash_expr(uint64_t* h, const AstTree* t, AstRef a) {
+    hash_u64(h, ast_type(t, a));
+    switch (ast_type(t, a)) {
+    case AST_NUM:
+        hash_u64(h, ast_num(t, a)->sign);
+        hash_u64(h, ast_num(t, a)->u);
+        break;
+    case AST_OPER:
+        hash_u64(h, ast_oper(t, a)->oper);
+        hash_expr(h, t, ast_oper(t, a)->l);
+        hash_expr(h, t, ast_oper(t, a)->r);
+        break;
+    case AST_LABEL:
+        hash_label(h, t, a, a, a);
+        break;
+    case AST_CALL:
+        hash_str(h, sym_str(ast_name(t, a)->name));
+        break;
+    default:
+        break;
+    }
+}
+
+// Other nodes in the function are referred to by their distance from
+// its first node, which does not depend on where the function is.
+static void
+hash_ref(uint64_t* h, AstRef a, AstRef first) {
+    hash_u64(h, a == AST_NONE ? UINT64_MAX : a - first);
+}
+
+// The nodes of the function are next to each other, so they are
+// hashed in the order they are stored.
+static uint64_t
+fn_cache_key(const AstTree* t, AstRef fn) {
+    uint64_t h = 0xcbf29ce484222325u;
+    hash_str(&h, STR(CACHE_VERSION));
+    hash_u64(&h, options.target);
+    AstRef first = ast_block(t, fn)->first;
+    for (AstRef a = first; a <= fn; a++) {
+        hash_u64(&h, ast_type(t, a));
+        switch (ast_type(t, a)) {
+        case AST_NUM:
+            hash_u64(&h, ast_num(t, a)->sign);
+            hash_u64(&h, ast_num(t, a)->u);
+            break;
+        case AST_OPER:
+            hash_u64(&h, ast_oper(t, a)->oper);
+            hash_ref(&h, ast_oper(t, a)->l, first);
+            hash_ref(&h, ast_oper(t, a)->r, first);
+            break;
+        case AST_ROOT:
+        case AST_FN:
+        case AST_IF:
+        case AST_WHILE: {
+            const struct AstBlock* blk = ast_block(t, a);
+            hash_binding(&h, blk->name);
+            hash_ref(&h, blk->head, first);
+            hash_u64(&h, blk->n_children);
+            ast_for_children(c, t, blk) {
+                hash_ref(&h, c, first);
+            }
+        } break;
+        case AST_LABEL:
+            hash_label(&h, t, a, first, fn);
+            break;
+        case AST_EXIT:
+        case AST_RET:
+            hash_ref(&h, ast_val(t, a), first);
+            break;
+        case AST_ASSIGN:
+        case AST_VAR:
+            hash_binding(&h, ast_var(t, a)->binding);
+            hash_ref(&h, ast_var(t, a)->val, first);
+            break;
+        case AST_CALL:
+            hash_str(&h, sym_str(ast_name(t, a)->name));
+            break;
+        }
+    }
+    return h;
+}
+
+// Callees may be inlined, so a key also depends on the functions that
+// are called, as deep as calls are inlined.
+static void
+hash_callees(uint64_t* h, const struct FnCode* fc, int depth) {
+    const AstTree* t = fc->tree;
+    for (AstRef a = ast_block(t, fc->fn)->first; a < fc->fn; a++) {
+        if (ast_type(t, a) != AST_CALL) {
+            continue;
+        }
+        const struct FnCode* callee = ast_name(t, a)->binding->code;
+        hash_u64(h, callee->ast_key);
+        if (depth > 1) {
+            hash_callees(h, callee, depth - 1);
+        }
+    }
+}
+
+static bool
+mkdir_p(char* path) {
+    for (char* p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            int r = mkdir(path, 0755);
+            *p = '/';
+            if (r == -1 && errno != EEXIST) {
+                return false;
+            }
+        }
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+// Returns false if there is no usable cache directory.
+static bool
+cache_init() {
+    const char* env = getenv("L_CACHE_DIR");
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    int n;
+    if (env && env[0]) {
+        n = snprintf(cache_dir, sizeof cache_dir, "%s", env);
+    } else if (xdg && xdg[0]) {
+        n = snprintf(cache_dir, sizeof cache_dir, "%s/l", xdg);
+    } else if (home && home[0]) {
+        n = snprintf(cache_dir, sizeof cache_dir, "%s/.cache/l", home);
+    } else {
+        return false;
+    }
+    if (n < 0 || (size_t)n >= sizeof cache_dir - 32) {
+        return false;
+    }
+    if (!mkdir_p(cache_dir)) {
+        fprintf(stderr, "Could not create cache directory %s\n", cache_dir);
+        perror("mkdir");
+        return false;
+    }
+    return true;
+}
+
+static void
+cache_path(char* path, size_t size, uint64_t key) {
+    snprintf(path, size, "%s/%016lx", cache_dir, key);
+}
+
+static bool
+read_u32(const char** p, const char* end, uint32_t* x) {
+    if (end - *p < 4) {
+        return false;
+    }
+    memcpy(x, *p, 4);
+    *p += 4;
+    return true;
+}
+
+static bool
+read_str(const char** p, const char* end, Str* s) {
+    uint32_t len;
+    if (!read_u32(p, end, &len) || (size_t)(end - *p) < len) {
+        return false;
+    }
+    *s = (Str){*p, len};
+    *p += len;
+    return true;
+}
+
+static void
+free_cache_entry(struct CacheEntry* e) {
+    free(e->fixups);
+    free(e->buf);
+    free(e);
+}
+
+// Returns NULL if there is no entry or it is broken.
+static struct CacheEntry*
+cache_load(uint64_t key) {
+    char path[4096 + 32];
+    cache_path(path, sizeof path, key);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct File f = {.name = path};
+    bool ok = read_whole_fd(fd, &f);
+    close(fd);
+    if (!ok) {
+        return NULL;
+    }
+    struct CacheEntry* e = calloc(1, sizeof *e);
+    e->buf = f.content;
+    const char* p = f.content;
+    const char* end = f.content + f.size;
+    uint32_t magic;
+    uint32_t n_fixups;
+    ok = read_u32(&p, end, &magic) && magic == CACHE_MAGIC
+        && read_u32(&p, end, &e->start)
+        && read_str(&p, end, &e->text)
+        && read_u32(&p, end, &n_fixups)
+        && n_fixups <= (size_t)(end - p) / 12;
+    if (ok) {
+        e->fixups = calloc(n_fixups, sizeof *e->fixups);
+        e->n_fixups = n_fixups;
+        for (size_t i = 0; ok && i < n_fixups; i++) {
+            struct CacheFixup* fx = &e->fixups[i];
+            ok = read_u32(&p, end, &fx->type)
+                && read_u32(&p, end, &fx->offset)
+                && read_str(&p, end, &fx->callee)
+                && fx->type == RV64_J
+                && fx->offset + 4 <= e->text.len;
+        }
+    }
+    if (!ok) {
+        free_cache_entry(e);
+        return NULL;
+    }
+    // Mark it as recently used.
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return e;
+}
+
+// Gives the function the text, start and calls of the entry, as if it
+// had been compiled.
+static void
+cache_apply(struct FnCode* fc, const struct CacheEntry* e) {
+    init_seg_mem(&fc->text, ".text", e->text.len + 1, &fn_mem);
+    emit_bytes(&fc->text, e->text.data, e->text.len);
+    vreg_set_state_mem_addr(fc->name->last_vreg, &fc->text, e->start);
+    fc->vinstrs = (ChunkArray){.elem_size = sizeof (Rv64Instr), .mem = &fn_mem};
+    fc->postinstrs = (ChunkArray){.elem_size = sizeof (Rv64Instr), .mem = &fn_mem};
+    for (size_t i = 0; i < e->n_fixups; i++) {
+        const struct CacheFixup* fx = &e->fixups[i];
+        Rv64Instr* call = chunk_array_add(&fc->vinstrs);
+        *call = (Rv64Instr){
+            .type = fx->type,
+            .offset = fx->offset,
+        };
+        Rv64Instr* patch = chunk_array_add(&fc->postinstrs);
+        *patch = (Rv64Instr){
+            .type = PATCH_BINDING,
+            .patch_binding = {
+                .instr = call,
+                .binding = get_function(sym_intern(fx->callee)),
+            },
+        };
+    }
+}
+
+static void
+write_u32(FILE* f, uint32_t x) {
+    fwrite(&x, sizeof x, 1, f);
+}
+
+static void
+write_str(FILE* f, Str s) {
+    write_u32(f, s.len);
+    fwrite(s.data, 1, s.len, f);
+}
+
+// Must be called after the function is compiled but before it is linked.
+static void
+cache_store(const struct FnCode* fc) {
+    char path[4096 + 32];
+    char tmp[4096 + 64];
+    cache_path(path, sizeof path, fc->key);
+    snprintf(tmp, sizeof tmp, "%s.%ld.%p", path, (long)getpid(), (void*)fc);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        return;
+    }
+    write_u32(f, CACHE_MAGIC);
+    write_u32(f, fc->name->last_vreg->loc.offset);
+    write_str(f, (Str){fc->text.data, fc->text.len});
+    write_u32(f, fc->postinstrs.len);
+    for (size_t i = 0; i < fc->postinstrs.len; i++) {
+        const Rv64Instr* p = chunk_array_at(&fc->postinstrs, i);
+        write_u32(f, p->patch_binding.instr->type);
+        write_u32(f, p->patch_binding.instr->offset);
+        write_str(f, sym_str(p->patch_binding.binding->name));
+    }
+    bool ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    if (ok && rename(tmp, path) == 0) {
+        atomic_fetch_add(&cache_stats.stored, 1);
+    } else {
+        unlink(tmp);
+    }
+}
+
+struct CacheFile {
+    char name[256];
+    off_t size;
+    struct timespec used;
+};
+
+static int
+cmp_cache_file_use(const void* a, const void* b) {
+    const struct CacheFile* x = a;
+    const struct CacheFile* y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    if (x->used.tv_nsec != y->used.tv_nsec) {
+        return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+// Removes the least recently used entries until the cache is at most
+// max_size bytes.
+static void
+cache_evict(size_t max_size) {
+    DIR* dir = opendir(cache_dir);
+    if (dir == NULL) {
+        return;
+    }
+    struct CacheFile* files = NULL;
+    size_t n_files = 0;
+    size_t cap_files = 0;
+    size_t total = 0;
+    struct dirent* d;
+    while ((d = readdir(dir))) {
+        struct stat st;
+        if (d->d_name[0] == '.' || strlen(d->d_name) >= 256
+            || fstatat(dirfd(dir), d->d_name, &st, 0) == -1
+            || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (n_files == cap_files) {
+            files = grow_array(files, &cap_files, sizeof *files);
+        }
+        struct CacheFile* cf = &files[n_files];
+        strcpy(cf->name, d->d_name);
+        cf->size = st.st_size;
+        cf->used = st.st_mtim;
+        n_files++;
+        total += st.st_size;
+    }
+    if (total > max_size) {
+        qsort(files, n_files, sizeof *files, cmp_cache_file_use);
+        for (size_t i = 0; i < n_files && total > max_size; i++) {
+            if (unlinkat(dirfd(dir), files[i].name, 0) == 0) {
+                total -= files[i].size;
+                cache_stats.evicted++;
+            }
+        }
+    }
+    cache_stats.size = total;
+    closedir(dir);
+    free(files);
+}
+
+static void
+print_cache_stats() {
+    fprintf(stderr, "cache: %zu hits, %zu misses, %zu stored, "
+                    "%zu evicted, %zu bytes in %s\n",
+            (size_t)cache_stats.hits, (size_t)cache_stats.misses,
+            (size_t)cache_stats.stored, cache_stats.evicted,
+            cache_stats.size, cache_dir);
+}
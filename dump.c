@@ -0,0 +1,98 @@
+// Debug output that is asked for with --dump.  A compile prints none
+// of it otherwise, and the checks are left out altogether when built
+// with -DL_NO_DUMP.
+
+enum DumpKind {
+    DUMP_AST,
+    DUMP_IR,
+    DUMP_VINSTR,
+    DUMP_TEXT,
+    DUMP_DATA,
+    DUMP_BINDINGS,
+    N_DUMP_KINDS,
+};
+
+static const char* const dump_names[N_DUMP_KINDS] = {
+    [DUMP_AST] = "ast",
+    [DUMP_IR] = "ir",
+    [DUMP_VINSTR] = "vinstr",
+    [DUMP_TEXT] = "text",
+    [DUMP_DATA] = "data",
+    [DUMP_BINDINGS] = "bindings",
+};
+
+#ifdef L_NO_DUMP
+#define dumping(kind) false
+#else
+#define dumping(kind) __builtin_expect((options.dump >> (kind)) & 1, 0)
+#endif
+
+// Where the dumps go.  It is fully buffered, also when it is stderr.
+static FILE* dump_out;
+
+// Parses the comma separated kinds of --dump into options.dump.
+static bool
+parse_dump_kinds(const char* list) {
+#ifdef L_NO_DUMP
+    fprintf(stderr, "Dumps are not compiled in\n");
+    return false;
+#else
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        size_t k;
+        for (k = 0; k < N_DUMP_KINDS; k++) {
+            if (strlen(dump_names[k]) == len
+                && strncmp(list, dump_names[k], len) == 0) {
+                options.dump |= 1u << k;
+                break;
+            }
+        }
+        if (k == N_DUMP_KINDS) {
+            if (len == 3 && strncmp(list, "all", 3) == 0) {
+                options.dump = (1u << N_DUMP_KINDS) - 1;
+            } else {
+                fprintf(stderr, "Unknown dump %.*s\n", (int)len, list);
+                return false;
+            }
+        }
+        list += len;
+        if (*list == ',') {
+            list++;
+        }
+    }
+    return true;
+#endif
+}
+
+// Opens options.dump_file, or a stream of its own on stderr.
+static bool
+dump_open() {
+    if (options.dump_file) {
+        dump_out = fopen(options.dump_file, "w");
+    } else {
+        int fd = dup(STDERR_FILENO);
+        dump_out = fd == -1 ? NULL : fdopen(fd, "w");
+    }
+    if (dump_out == NULL) {
+        perror(options.dump_file ? options.dump_file : "stderr");
+        return false;
+    }
+    setvbuf(dump_out, NULL, _IOFBF, 1 << 16);
+    return true;
+}
+
+static void
+dump_begin(const char* title) {
+    fprintf(dump_out, "\n%s:\n", title);
+}
+
+// The compile may still abort after a dump, so it is written out now.
+static void
+dump_end() {
+    fflush(dump_out);
+}
+
+static bool
+dump_close() {
+    return dump_out == NULL || fclose(dump_out) == 0;
+}
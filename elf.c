@@ -14,7 +14,7 @@ write_elf_file(const char* filename) {
     size_t strings_offset = data_offset + seg_data.len;
     size_t shdr_offset = strings_offset + sizeof strings;
 
-    const Binding* mainfn = get_binding(STR("main"));
+    const Binding* mainfn = get_function(SYM_MAIN);
     if (mainfn == NULL) {
         fprintf(stderr, "No main function.\n");
         return;
@@ -22,6 +22,10 @@ write_elf_file(const char* filename) {
     assert(mainfn->last_vreg->state == VREG_MEM_ADDR);
     Location loc = mainfn->last_vreg->loc;
     size_t entry = loc.seg->addr + loc.offset;
+    if (options.target == TARGET_X86_64) {
+        // The code from x86_write_start calls main.
+        entry = seg_text.addr;
+    }
 
     Elf64_Ehdr elf_header = {
         .e_ident = {
@@ -31,7 +35,7 @@ write_elf_file(const char* filename) {
             0, 0, 0, 0,
         },
         .e_type = ET_EXEC,
-        .e_machine = EM_RISCV,
+        .e_machine = options.target == TARGET_X86_64 ? EM_X86_64 : EM_RISCV,
         .e_version = EV_CURRENT,
         .e_entry = entry,
         .e_phoff = phdr_offset,
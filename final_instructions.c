@@ -2,6 +2,7 @@ typedef void (*Rv64FnR)(Segment*, enum reg, enum reg, enum reg);
 typedef void (*Rv64FnI)(Segment*, enum reg, enum reg, int16_t);
 typedef void (*Rv64FnRi64)(Segment*, enum reg, uint64_t);
 typedef void (*Rv64FnB)(Segment*, enum reg, enum reg, uint64_t);
+typedef void (*Rv64FnS)(Segment*, enum reg, enum reg, int16_t);
 typedef void (*Rv64FnJ)(Segment*, int16_t);
 typedef void (*Rv64FnNone)(Segment*);
 
@@ -10,11 +11,13 @@ enum Rv64Type {
     RV64_R,
     RV64_RI64,
     RV64_B,
+    RV64_S,
     RV64_J,
     RV64_NONE,
 
     // Not real instructions
     FN_START,
+    FN_LEAVE,  // Where the frame is taken down, before a return.
     ASSIGN,
     PATCH,
     PATCH_BINDING,
@@ -49,6 +52,12 @@ struct Rv64Instr {
             Vreg* rs2;
             uint64_t imm;
         } b;
+        struct {
+            Rv64FnS fn;
+            Vreg* rs1;  // The address is rs1 + imm.
+            Vreg* rs2;  // The value.
+            int64_t imm;
+        } s;
         struct {
             Rv64FnJ fn;
             int16_t imm;
@@ -73,6 +82,16 @@ struct Rv64Instr {
 };
 typedef struct Rv64Instr Rv64Instr;
 
+// The most bytes that one of the rv64_write_ functions emits.  That is
+// rv64_write_li with a full 64-bit constant: lui and addiw for the top
+// 32 bits, then slli and addi for each of the three 12-bit chunks
+// below them.
+#define RV64_MAX_INSTR_SIZE (8 * 4)
+
+// Functions start on a 4-byte boundary, so that their first 32-bit
+// instruction does not cross a fetch block.  The padding is never run.
+#define RV64_FN_ALIGN 4
+
 // Returns the bits of x between (including) position l and h.
 // Example: BITS(0b1100101, 2, 5) == 1001
 #define BITS(x, l, h) ((x & ((1 << ((h + 1) % (sizeof (x) * 8))) - 1)) >> l)
@@ -105,27 +124,32 @@ rv64_write_add(Segment* seg, enum reg rd, enum reg rs1, enum reg rs2) {
         rs2 = rs1;
         rs1 = rd;
     }
-    if (rs1 == REG_ZERO) {
+    // The compressed forms can not have x0 as rs2.
+    if (rs2 == REG_ZERO) {
+        i = 0b0110011 | (rd << 7) | (rs1 << 15) | (rs2 << 20);
+        emit32(seg, i);
+    } else if (rs1 == REG_ZERO) {
         i = 0b1000000000000010 | (rs2 << 2) | (rd << 7);
-        add_data(seg, &i, 2);
+        emit16(seg, i);
     } else if (rs1 == rd) {
         i = 0b1001000000000010 | (rs2 << 2) | (rd << 7);
-        add_data(seg, &i, 2);
+        emit16(seg, i);
     } else {
         i = 0b0110011 | (rd << 7) | (rs1 << 15) | (rs2 << 20);
-        add_data(seg, &i, 4);
+        emit32(seg, i);
     }
 }
 
 static void
 rv64_write_sub(Segment* seg, enum reg rd, enum reg rs1, enum reg rs2) {
     uint32_t i;
-    if (rs1 == rd) {
-        i = 0b1000110000000001 | (rs2 << 2) | (rd << 7);
-        add_data(seg, &i, 2);
+    // c.sub only has room for x8 to x15.
+    if (rs1 == rd && rd >= 8 && rd < 16 && rs2 >= 8 && rs2 < 16) {
+        i = 0b1000110000000001 | ((rs2 - 8) << 2) | ((rd - 8) << 7);
+        emit16(seg, i);
     } else {
         i = (1 << 30) | 0b0110011 | (rd << 7) | (rs1 << 15) | (rs2 << 20);
-        add_data(seg, &i, 4);
+        emit32(seg, i);
     }
 }
 
@@ -133,19 +157,114 @@ static void
 rv64_write_mul(Segment* seg, enum reg rd, enum reg rs1, enum reg rs2) {
     uint32_t i;
     i = 0b0110011 | rd << 7 | rs1 << 15 | rs2 << 20 | 1 << 25;
-    add_data(seg, &i, 4);
+    emit32(seg, i);
+}
+
+static void
+rv64_write_slt(Segment* seg, enum reg rd, enum reg rs1, enum reg rs2) {
+    uint32_t i;
+    i = 0b0110011 | rd << 7 | 0b010 << 12 | rs1 << 15 | rs2 << 20;
+    emit32(seg, i);
+}
+
+static void
+rv64_write_sltu(Segment* seg, enum reg rd, enum reg rs1, enum reg rs2) {
+    uint32_t i;
+    i = 0b0110011 | rd << 7 | 0b011 << 12 | rs1 << 15 | rs2 << 20;
+    emit32(seg, i);
+}
+
+static void
+rv64_write_slli(Segment* seg, enum reg rd, enum reg rs1, int16_t shamt) {
+    uint32_t i;
+    assert(shamt > 0 && shamt < 64);
+    if (rs1 == rd && rd != REG_ZERO) {
+        i = 0b10 | (BITS(shamt, 0, 4) << 2) | (rd << 7)
+            | (BITS(shamt, 5, 5) << 12);
+        emit16(seg, i);
+    } else {
+        i = 0b0010011 | rd << 7 | 0b001 << 12 | rs1 << 15 | shamt << 20;
+        emit32(seg, i);
+    }
 }
 
+// srli, or srai when `arith`.
+static void
+rv64_write_shift_right(Segment* seg, enum reg rd, enum reg rs1, int16_t shamt,
+                       bool arith) {
+    uint32_t i;
+    assert(shamt > 0 && shamt < 64);
+    // c.srli and c.srai only have room for x8 to x15.
+    if (rs1 == rd && rd >= 8 && rd < 16) {
+        i = 0b1000000000000001 | (BITS(shamt, 0, 4) << 2) | ((rd - 8) << 7)
+            | (arith ? 1 << 10 : 0) | (BITS(shamt, 5, 5) << 12);
+        emit16(seg, i);
+    } else {
+        i = 0b0010011 | rd << 7 | 0b101 << 12 | rs1 << 15 | shamt << 20
+            | (arith ? 1 << 30 : 0);
+        emit32(seg, i);
+    }
+}
+
+static void
+rv64_write_srli(Segment* seg, enum reg rd, enum reg rs1, int16_t shamt) {
+    rv64_write_shift_right(seg, rd, rs1, shamt, false);
+}
+
+static void
+rv64_write_srai(Segment* seg, enum reg rd, enum reg rs1, int16_t shamt) {
+    rv64_write_shift_right(seg, rd, rs1, shamt, true);
+}
+
+// imm is sign extended, also for sltiu.
+static void
+rv64_write_slti(Segment* seg, enum reg rd, enum reg rs1, int16_t imm) {
+    uint32_t i;
+    i = 0b0010011 | rd << 7 | 0b010 << 12 | rs1 << 15
+        | BITS(imm, 0, 11) << 20;
+    emit32(seg, i);
+}
+
+static void
+rv64_write_sltiu(Segment* seg, enum reg rd, enum reg rs1, int16_t imm) {
+    uint32_t i;
+    i = 0b0010011 | rd << 7 | 0b011 << 12 | rs1 << 15
+        | BITS(imm, 0, 11) << 20;
+    emit32(seg, i);
+}
+
+// Any 64-bit value.  The bits above the low 12 are loaded first and
+// the low 12 are added, which is one instruction for small values and
+// lui and addiw for 32-bit ones.
 static void
 rv64_write_li(Segment* seg, enum reg rd, uint64_t n) {
+    int64_t v = n;
+    int64_t lo = (int64_t)(n << 52) >> 52;
     uint32_t i;
-    if ((n & 0b111111) == n) {
+    if (v >= -32 && v < 32) {
         i = 0b0100000000000001 | (rd << 7) | (BITS(n, 0, 4) << 2)
             | (BITS(n, 5, 5) << 12);
-        add_data(seg, &i, 2);
-    } else {
+        emit16(seg, i);
+    } else if (v == lo) {
         i = 0b0010011 | (rd << 7) | (BITS(n, 0, 11) << 20);
-        add_data(seg, &i, 4);
+        emit32(seg, i);
+    } else if (v == (int32_t)v) {
+        i = 0b0110111 | (rd << 7) | ((uint32_t)(n - lo) & 0xfffff000);
+        emit32(seg, i);
+        if (lo) {
+            // addiw
+            i = 0b0011011 | (rd << 7) | (rd << 15) | (BITS(lo, 0, 11) << 20);
+            emit32(seg, i);
+        }
+    } else {
+        rv64_write_li(seg, rd, (int64_t)(n - lo) >> 12);
+        // slli
+        i = 0b0010011 | (rd << 7) | (0b001 << 12) | (rd << 15) | (12 << 20);
+        emit32(seg, i);
+        if (lo) {
+            i = 0b0010011 | (rd << 7) | (rd << 15) | (BITS(lo, 0, 11) << 20);
+            emit32(seg, i);
+        }
     }
 }
 
@@ -155,10 +274,10 @@ rv64_write_lui(Segment* seg, enum reg rd, int32_t addr) {
     if (addr < (1 << 18)) {
         i = 0b0110000000000001 | (rd << 7) | (BITS(addr, 12, 16) << 2)
             | (BITS(addr, 17, 17) << 12);
-        add_data(seg, &i, 2);
+        emit16(seg, i);
     } else {
         i = 0b0110111 | (rd << 7) | (BITS(addr, 12, 31) << 12);
-        add_data(seg, &i, 4);
+        emit32(seg, i);
     }
 }
 
@@ -167,7 +286,7 @@ rv64_write_lw(Segment* seg, enum reg rd, uint16_t addr, enum reg rs1) {
     uint32_t i;
     i = 0b010000000000011 | (rd << 7) | (rs1 << 15)
         | (BITS(addr, 0, 11) << 20);
-    add_data(seg, &i, 4);
+    emit32(seg, i);
 }
 
 static void
@@ -175,7 +294,59 @@ rv64_write_sw(Segment* seg, enum reg rs2, uint16_t addr, enum reg rs1) {
     uint32_t i;
     i = 0b010000000100011 | (BITS(addr, 0, 4) << 7) | (rs1 << 15)
         | (rs2 << 20) | (BITS(addr, 5, 11) << 25);
-    add_data(seg, &i, 4);
+    emit32(seg, i);
+}
+
+// c.addi16sp, c.addi or addi.
+static void
+rv64_write_addi(Segment* seg, enum reg rd, enum reg rs1, int16_t imm) {
+    uint32_t i;
+    if (rd == REG_SP && rs1 == REG_SP && imm != 0 && imm % 16 == 0
+        && imm >= -512 && imm < 512) {
+        i = 0b0110000100000001 | (BITS(imm, 5, 5) << 2)
+            | (BITS(imm, 7, 8) << 3) | (BITS(imm, 6, 6) << 5)
+            | (BITS(imm, 4, 4) << 6) | (BITS(imm, 9, 9) << 12);
+        emit16(seg, i);
+    } else if (rd == rs1 && rd != REG_ZERO && imm != 0
+               && imm >= -32 && imm < 32) {
+        i = 0b01 | (BITS(imm, 0, 4) << 2) | (rd << 7)
+            | (BITS(imm, 5, 5) << 12);
+        emit16(seg, i);
+    } else {
+        i = 0b0010011 | (rd << 7) | (rs1 << 15) | (BITS(imm, 0, 11) << 20);
+        emit32(seg, i);
+    }
+}
+
+// rd = 64 bits at rs1 + imm.  c.ldsp when it is on the stack.
+static void
+rv64_write_ld(Segment* seg, enum reg rd, enum reg rs1, int16_t imm) {
+    uint32_t i;
+    if (rs1 == REG_SP && rd != REG_ZERO && imm % 8 == 0
+        && imm >= 0 && imm < 512) {
+        i = 0b0110000000000010 | (BITS(imm, 6, 8) << 2)
+            | (BITS(imm, 3, 4) << 5) | (rd << 7) | (BITS(imm, 5, 5) << 12);
+        emit16(seg, i);
+    } else {
+        i = 0b0000011 | (rd << 7) | (0b011 << 12) | (rs1 << 15)
+            | (BITS(imm, 0, 11) << 20);
+        emit32(seg, i);
+    }
+}
+
+// 64 bits at rs1 + imm = rs2.  c.sdsp when it is on the stack.
+static void
+rv64_write_sd(Segment* seg, enum reg rs1, enum reg rs2, int16_t imm) {
+    uint32_t i;
+    if (rs1 == REG_SP && imm % 8 == 0 && imm >= 0 && imm < 512) {
+        i = 0b1110000000000010 | (rs2 << 2) | (BITS(imm, 6, 8) << 7)
+            | (BITS(imm, 3, 5) << 10);
+        emit16(seg, i);
+    } else {
+        i = 0b0100011 | (BITS(imm, 0, 4) << 7) | (0b011 << 12) | (rs1 << 15)
+            | (rs2 << 20) | (BITS(imm, 5, 11) << 25);
+        emit32(seg, i);
+    }
 }
 
 static void
@@ -187,7 +358,7 @@ rv64_write_jump_unknown(Segment* seg, int16_t off) {
         | (BITS(off, 11, 11) << 20)
         | (BITS(off, 1, 10) << 21)
         | (BITS(off, 20, 20) << 31);
-    add_data(seg, &n, 4);
+    emit32(seg, n);
 }
 
 static void
@@ -201,7 +372,7 @@ rv64_write_call_unknown(Segment* seg, int16_t off) {
         | (BITS(off, 11, 11) << 20)
         | (BITS(off, 1, 10) << 21)
         | (BITS(off, 20, 20) << 31);
-    add_data(seg, &n, 4);
+    emit32(seg, n);
 }
 
 static void
@@ -211,7 +382,7 @@ rv64_write_jalr(Segment* seg, enum reg rd, enum reg rs1, int16_t off) {
         | (rd << 7)
         | (rs1 << 15)
         | (BITS(off, 0, 11) << 20);
-    add_data(seg, &n, 4);
+    emit32(seg, n);
 }
 
 static void
@@ -226,12 +397,12 @@ rv64_write_beqz_unknown(Segment* seg, enum reg rs1, enum reg rs2, uint64_t imm)
         | (rs1 << 15)
         | (BITS(imm, 5, 10) << 25)
         | (BITS(imm, 12, 12) << 31);
-    add_data(seg, &n, 4);
+    emit32(seg, n);
 }
 
 static void
 rv64_write_ecall(Segment* seg) {
     uint32_t i;
     i = 0b1110011;
-    add_data(seg, &i, 4);
+    emit32(seg, i);
 }
@@ -0,0 +1,330 @@
+// Constant propagation over the AST of one function.  Before a
+// function is lowered, this finds the expressions whose value is known
+// at compile time and the statements that can never run.  The lowering
+// then uses the values instead of computing them and leaves out the
+// statements that can not run.
+//
+// Control flow is structured, so a single walk in source order is
+// enough, with what is known about each local variable as the state.
+// The state at the start of a loop is iterated until it no longer
+// changes, and the branches of an `if` or a loop are only looked at
+// when the condition can be true.
+
+enum FoldState {
+    FOLD_UNDEF,    // No value has reached here yet.
+    FOLD_CONST,
+    FOLD_VARYING,
+};
+
+struct FoldVal {
+    enum FoldState state;
+    uint64_t val;
+};
+
+// What is known about the local variables at a point in the function.
+struct FoldEnv {
+    struct FoldVal* vars;
+    bool live;  // The point can be reached.
+};
+
+// Per node.
+#define FOLD_REACHABLE 1  // Statements.
+#define FOLD_KNOWN 2      // Expressions, the value is in `vals`.
+
+struct Fold {
+    const AstTree* tree;
+    AstRef first;  // The nodes of the function are first..end.
+    AstRef end;
+    uint8_t* flags;
+    uint64_t* vals;
+    uint32_t* var_index;  // For AST_VAR, the index in FoldEnv.vars.
+    uint32_t n_vars;
+    const Type* type_bool;
+};
+
+// For the function that is being lowered on this thread.  The arrays
+// are in scratch_mem.
+static _Thread_local struct Fold fold;
+
+static inline bool
+fold_in_fn(AstRef a) {
+    return a >= fold.first && a < fold.end;
+}
+
+// The index of the variable if it is local to the function, or -1.
+static int32_t
+fold_local(const Binding* b) {
+    if (!fold_in_fn(b->decl)
+        || ast_type(fold.tree, b->decl) != AST_VAR
+        || ast_var(fold.tree, b->decl)->binding != b) {
+        return -1;
+    }
+    return fold.var_index[b->decl - fold.first];
+}
+
+// Wraps v to the type, like the code that is generated for it.
+static uint64_t
+fold_wrap(uint64_t v, const Type* type) {
+    unsigned bits = type_wrap_bits(type);
+    return bits ? wrap_bits(v, bits, type->is_signed) : v;
+}
+
+static struct FoldVal
+fold_meet(struct FoldVal a, struct FoldVal b) {
+    if (a.state == FOLD_UNDEF) {
+        return b;
+    }
+    if (b.state == FOLD_UNDEF) {
+        return a;
+    }
+    if (a.state == FOLD_CONST && b.state == FOLD_CONST && a.val == b.val) {
+        return a;
+    }
+    return (struct FoldVal){FOLD_VARYING, 0};
+}
+
+static struct FoldEnv
+fold_env_copy(const struct FoldEnv* env) {
+    struct FoldEnv copy = {
+        .vars = mem_alloc_array(&scratch_mem, struct FoldVal, fold.n_vars),
+        .live = env->live,
+    };
+    memcpy(copy.vars, env->vars, fold.n_vars * sizeof *copy.vars);
+    return copy;
+}
+
+// Merges `from` into `env`.  Returns whether env changed.
+static bool
+fold_env_meet(struct FoldEnv* env, const struct FoldEnv* from) {
+    if (!from->live) {
+        return false;
+    }
+    if (!env->live) {
+        memcpy(env->vars, from->vars, fold.n_vars * sizeof *env->vars);
+        env->live = true;
+        return true;
+    }
+    bool changed = false;
+    for (uint32_t i = 0; i < fold.n_vars; i++) {
+        struct FoldVal v = fold_meet(env->vars[i], from->vars[i]);
+        if (v.state != env->vars[i].state || v.val != env->vars[i].val) {
+            env->vars[i] = v;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void
+fold_record(AstRef a, struct FoldVal v) {
+    if (!fold_in_fn(a)) {
+        return;
+    }
+    fold.flags[a - fold.first] = v.state == FOLD_CONST ? FOLD_KNOWN : 0;
+    fold.vals[a - fold.first] = v.val;
+}
+
+// `type` is set to the type of the expression, or NULL if it is an
+// untyped number.
+static struct FoldVal
+fold_expr(AstRef a, const struct FoldEnv* env, const Type** type) {
+    const AstTree* t = fold.tree;
+    struct FoldVal v = {FOLD_VARYING, 0};
+    *type = NULL;
+    switch (ast_type(t, a)) {
+    case AST_NUM: {
+        v = (struct FoldVal){FOLD_CONST, ast_num(t, a)->u};
+    } break;
+    case AST_LABEL: {
+        Binding* b = ast_name(t, a)->binding;
+        int32_t i = fold_local(b);
+        *type = b->type;
+        if (i >= 0) {
+            v = env->vars[i];
+            if (v.state != FOLD_CONST) {
+                v.state = FOLD_VARYING;
+            }
+        } else if (b->last_vreg && b->last_vreg->state == VREG_AST) {
+            // A global, which is compiled where it is used.
+            const Type* init_type;
+            v = fold_expr(b->last_vreg->ast, env, &init_type);
+            v.val = fold_wrap(v.val, b->type);
+        }
+    } break;
+    case AST_CALL: {
+        *type = ast_name(t, a)->binding->type;
+    } break;
+    case AST_OPER: {
+        const struct AstOper* oper = ast_oper(t, a);
+        const Type* lt;
+        const Type* rt;
+        struct FoldVal l = fold_expr(oper->l, env, &lt);
+        struct FoldVal r = fold_expr(oper->r, env, &rt);
+        const Type* ot = lt ? lt : rt;
+        *type = oper->oper == OP_LESS ? fold.type_bool : ot;
+        if (l.state != FOLD_CONST || r.state != FOLD_CONST) {
+            break;
+        }
+        uint64_t x = fold_wrap(l.val, ot);
+        uint64_t y = fold_wrap(r.val, ot);
+        switch (oper->oper) {
+        case OP_PLUS:
+            v.val = x + y;
+            break;
+        case OP_MINUS:
+            v.val = x - y;
+            break;
+        case OP_TIMES:
+            v.val = x * y;
+            break;
+        case OP_LESS:
+            if (ot && ot->is_signed) {
+                v.val = (int64_t)x < (int64_t)y;
+            } else {
+                v.val = x < y;
+            }
+            break;
+        }
+        v.state = FOLD_CONST;
+        v.val = fold_wrap(v.val, *type);
+    } break;
+    // These do not belong inside an expression.
+    case AST_ROOT:
+    case AST_FN:
+    case AST_IF:
+    case AST_WHILE:
+    case AST_EXIT:
+    case AST_RET:
+    case AST_ASSIGN:
+    case AST_VAR:
+        abort();
+        break;
+    }
+    fold_record(a, v);
+    return v;
+}
+
+static void
+fold_set_var(struct FoldEnv* env, Binding* b, struct FoldVal v) {
+    int32_t i = fold_local(b);
+    if (i >= 0) {
+        v.val = fold_wrap(v.val, b->type);
+        env->vars[i] = v;
+    }
+}
+
+static void
+fold_block(const struct AstBlock* block, struct FoldEnv* env) {
+    const AstTree* t = fold.tree;
+    const Type* type;
+    ast_for_children(s, t, block) {
+        if (!env->live) {
+            fold.flags[s - fold.first] = 0;
+            continue;
+        }
+        fold.flags[s - fold.first] = FOLD_REACHABLE;
+        switch (ast_type(t, s)) {
+        case AST_VAR:
+        case AST_ASSIGN: {
+            const struct AstVar* var = ast_var(t, s);
+            fold_set_var(env, var->binding, fold_expr(var->val, env, &type));
+        } break;
+        case AST_IF: {
+            const struct AstBlock* blk = ast_block(t, s);
+            struct FoldVal c = fold_expr(blk->head, env, &type);
+            if (c.state == FOLD_CONST) {
+                if (c.val) {
+                    fold_block(blk, env);
+                }
+            } else {
+                struct FoldEnv body = fold_env_copy(env);
+                fold_block(blk, &body);
+                fold_env_meet(env, &body);
+            }
+        } break;
+        case AST_WHILE: {
+            // env is what is known at the start of the loop.  It is
+            // reached from before the loop and from the end of the
+            // body, so the body is looked at again until env stays
+            // the same.
+            const struct AstBlock* blk = ast_block(t, s);
+            struct FoldEnv body = fold_env_copy(env);
+            struct FoldVal c;
+            for (;;) {
+                c = fold_expr(blk->head, env, &type);
+                if (c.state == FOLD_CONST && !c.val) {
+                    break;
+                }
+                memcpy(body.vars, env->vars, fold.n_vars * sizeof *body.vars);
+                body.live = true;
+                fold_block(blk, &body);
+                if (!fold_env_meet(env, &body)) {
+                    break;
+                }
+            }
+            if (c.state == FOLD_CONST && c.val) {
+                env->live = false;
+            }
+        } break;
+        case AST_EXIT:
+        case AST_RET: {
+            fold_expr(ast_val(t, s), env, &type);
+            env->live = false;
+        } break;
+        // These do not belong inside a code block.
+        case AST_ROOT:
+        case AST_FN:
+        case AST_NUM:
+        case AST_LABEL:
+        case AST_OPER:
+        case AST_CALL:
+            abort();
+            break;
+        }
+    }
+}
+
+// Finds what is known in the function `fn`.  Must be called with a
+// mark on scratch_mem that is released after the function is lowered.
+static void
+fold_fn(const AstTree* t, AstRef fn) {
+    const struct AstBlock* blk = ast_block(t, fn);
+    size_t n = fn - blk->first;
+    fold = (struct Fold){
+        .tree = t,
+        .first = blk->first,
+        .end = fn,
+        .flags = mem_alloc_zero(&scratch_mem, n, 1),
+        .vals = mem_alloc_array(&scratch_mem, uint64_t, n),
+        .var_index = mem_alloc_array(&scratch_mem, uint32_t, n),
+        .type_bool = get_type(SYM_BOOL),
+    };
+    for (AstRef a = fold.first; a < fold.end; a++) {
+        if (ast_type(t, a) == AST_VAR) {
+            fold.var_index[a - fold.first] = fold.n_vars;
+            fold.n_vars++;
+        }
+    }
+    struct FoldEnv env = {
+        .vars = mem_alloc_zero(&scratch_mem,
+                               fold.n_vars * sizeof (struct FoldVal),
+                               _Alignof(struct FoldVal)),
+        .live = true,
+    };
+    fold_block(blk, &env);
+}
+
+static inline bool
+fold_reachable(AstRef stmt) {
+    return fold.flags[stmt - fold.first] & FOLD_REACHABLE;
+}
+
+static inline bool
+fold_known(AstRef expr) {
+    return fold_in_fn(expr) && fold.flags[expr - fold.first] & FOLD_KNOWN;
+}
+
+static inline uint64_t
+fold_value(AstRef expr) {
+    return fold.vals[expr - fold.first];
+}
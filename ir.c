@@ -0,0 +1,1059 @@
+// The mid-level IR.  A function is lowered from the AST to basic blocks
+// of instructions in SSA form, and instructions are selected from that.
+// An instruction that gives a value is the value.  Each one keeps the
+// list of its uses, and each operand points at its definition.
+//
+// The IR of a function is in the arena given to ir_new_fn and is
+// thrown away when the function has been lowered.
+
+enum IrOp {
+    IR_CONST,
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_LT,      // Signed less than.
+    IR_LTU,
+    // Keep the low `imm` bits and sign or zero extend them, which is
+    // how a value is wrapped to a type that is narrower than 64 bits.
+    IR_SEXT,
+    IR_ZEXT,
+    IR_CALL,
+    IR_PHI,     // One operand per predecessor, in the same order.
+
+    // The last instruction of every block is one of these, and they
+    // are nowhere else.
+    IR_JUMP,
+    IR_BRANCH,  // To succs[0] if the operand is not 0, else succs[1].
+    IR_RET,     // With the operand as the value if there is one.
+    IR_EXIT,
+};
+
+static const char* const ir_op_names[] = {
+    [IR_CONST] = "const",
+    [IR_ADD] = "add",
+    [IR_SUB] = "sub",
+    [IR_MUL] = "mul",
+    [IR_LT] = "lt",
+    [IR_LTU] = "ltu",
+    [IR_SEXT] = "sext",
+    [IR_ZEXT] = "zext",
+    [IR_CALL] = "call",
+    [IR_PHI] = "phi",
+    [IR_JUMP] = "jump",
+    [IR_BRANCH] = "branch",
+    [IR_RET] = "ret",
+    [IR_EXIT] = "exit",
+};
+
+typedef struct IrInstr IrInstr;
+typedef struct IrBlock IrBlock;
+
+// An operand.  It is in the list of uses of its definition.
+struct IrUse {
+    IrInstr* def;
+    IrInstr* user;
+    struct IrUse* next;   // In def->uses.
+    struct IrUse** prev;  // What points at this one.
+};
+typedef struct IrUse IrUse;
+
+struct IrInstr {
+    enum IrOp op;
+    uint32_t id;       // Unique in the function, for dumps and bit sets.
+    uint32_t pos;      // Order in the block, set by ir_compute_liveness.
+    IrBlock* block;
+    IrInstr* prev;
+    IrInstr* next;
+    IrUse* args;
+    uint32_t n_args;
+    uint32_t cap_args;
+    IrUse* uses;
+    uint64_t imm;      // IR_CONST.
+    bool in_reg;       // IR_CONST that is kept in a register from where
+                       // it is, instead of loaded where it is used.
+    Binding* binding;  // The callee of IR_CALL, the variable of IR_PHI.
+    IrInstr* replaced_by;  // A removed phi, what it was the same as.
+
+    // Values that share a register, set by ir_coalesce.  `home` is the
+    // one that stands for all of them, and `next_home` the next in the
+    // list that starts at it.
+    IrInstr* home;
+    IrInstr* next_home;
+    Vreg* vreg;        // For instruction selection.
+};
+
+struct IrBlock {
+    uint32_t id;
+    IrInstr* first;
+    IrInstr* last;
+    IrBlock** preds;
+    uint32_t n_preds;
+    uint32_t cap_preds;
+    IrBlock* succs[2];
+    uint32_t n_succs;
+
+    // Set by ir_compute_doms.  `order` is the index in reverse
+    // post-order, or IR_NO_ORDER if the block can not be reached.
+    uint32_t order;
+    IrBlock* idom;
+    IrBlock* dom_child;
+    IrBlock* dom_sibling;
+    uint32_t dom_pre;   // Numbers in the dominator tree, so that a
+    uint32_t dom_post;  // dominates b if b is inside a's range.
+
+    // Bit sets of value ids, set by ir_compute_liveness.
+    uint64_t* live_in;
+    uint64_t* live_out;
+
+    Rv64Instr* start;  // For instruction selection.
+};
+
+#define IR_NO_ORDER UINT32_MAX
+
+struct IrFn {
+    Binding* name;
+    Mem* mem;
+    IrBlock** blocks;  // In the order they are laid out, entry first.
+    uint32_t n_blocks;
+    uint32_t cap_blocks;
+    uint32_t n_ids;    // Of blocks and instructions.
+    IrBlock** rpo;     // The reachable blocks in reverse post-order.
+    uint32_t n_rpo;
+};
+typedef struct IrFn IrFn;
+
+// Grows an array in an arena.  The old one is left where it is.
+static void*
+ir_grow_array(Mem* mem, void* a, uint32_t* cap, size_t size) {
+    uint32_t new_cap = *cap ? *cap * 2 : 4;
+    void* new_a = mem_alloc_align(mem, new_cap * size, _Alignof(max_align_t));
+    if (a) {
+        memcpy(new_a, a, *cap * size);
+    }
+    *cap = new_cap;
+    return new_a;
+}
+
+static IrFn*
+ir_new_fn(Mem* mem, Binding* name) {
+    IrFn* fn = mem_alloc(mem, IrFn);
+    *fn = (IrFn){
+        .name = name,
+        .mem = mem,
+    };
+    return fn;
+}
+
+// The block is not laid out until ir_append_block.
+static IrBlock*
+ir_new_block(IrFn* fn) {
+    IrBlock* b = mem_alloc(fn->mem, IrBlock);
+    *b = (IrBlock){
+        .id = fn->n_ids++,
+        .order = IR_NO_ORDER,
+    };
+    return b;
+}
+
+static void
+ir_append_block(IrFn* fn, IrBlock* b) {
+    if (fn->n_blocks == fn->cap_blocks) {
+        fn->blocks = ir_grow_array(fn->mem, fn->blocks, &fn->cap_blocks,
+                                   sizeof *fn->blocks);
+    }
+    fn->blocks[fn->n_blocks] = b;
+    fn->n_blocks++;
+}
+
+static void
+ir_use_link(IrUse* u, IrInstr* def) {
+    u->def = def;
+    u->next = def->uses;
+    u->prev = &def->uses;
+    if (def->uses) {
+        def->uses->prev = &u->next;
+    }
+    def->uses = u;
+}
+
+static void
+ir_use_unlink(IrUse* u) {
+    *u->prev = u->next;
+    if (u->next) {
+        u->next->prev = u->prev;
+    }
+    u->def = NULL;
+}
+
+// The operands are set with ir_set_arg.
+static IrInstr*
+ir_new_instr(IrFn* fn, enum IrOp op, uint32_t n_args) {
+    IrInstr* i = mem_alloc(fn->mem, IrInstr);
+    *i = (IrInstr){
+        .op = op,
+        .id = fn->n_ids++,
+        .args = n_args ? mem_alloc_array(fn->mem, IrUse, n_args) : NULL,
+        .n_args = n_args,
+        .cap_args = n_args,
+    };
+    for (uint32_t k = 0; k < n_args; k++) {
+        i->args[k] = (IrUse){.user = i};
+    }
+    return i;
+}
+
+static void
+ir_set_arg(IrInstr* i, uint32_t k, IrInstr* def) {
+    IrUse* u = &i->args[k];
+    if (u->def) {
+        ir_use_unlink(u);
+    }
+    ir_use_link(u, def);
+}
+
+static inline IrInstr*
+ir_arg(const IrInstr* i, uint32_t k) {
+    return i->args[k].def;
+}
+
+// For phis, when the block gets a predecessor.
+static void
+ir_add_arg(IrFn* fn, IrInstr* i, IrInstr* def) {
+    if (i->n_args == i->cap_args) {
+        IrUse* old = i->args;
+        i->args = ir_grow_array(fn->mem, NULL, &i->cap_args, sizeof *i->args);
+        // The uses are in lists by address, so they are moved one by
+        // one.
+        for (uint32_t k = 0; k < i->n_args; k++) {
+            IrInstr* d = old[k].def;
+            ir_use_unlink(&old[k]);
+            i->args[k] = (IrUse){.user = i};
+            ir_use_link(&i->args[k], d);
+        }
+    }
+    i->args[i->n_args] = (IrUse){.user = i};
+    ir_use_link(&i->args[i->n_args], def);
+    i->n_args++;
+}
+
+static inline bool
+ir_is_terminator(const IrInstr* i) {
+    return i->op >= IR_JUMP;
+}
+
+// Whether the value is kept in a register.
+static inline bool
+ir_has_value(const IrInstr* i) {
+    return (i->op != IR_CONST || i->in_reg) && !ir_is_terminator(i);
+}
+
+static void
+ir_append(IrBlock* b, IrInstr* i) {
+    i->block = b;
+    i->prev = b->last;
+    i->next = NULL;
+    if (b->last) {
+        b->last->next = i;
+    } else {
+        b->first = i;
+    }
+    b->last = i;
+}
+
+// Whether x * n is done with at most two shifts and an add or sub
+// instead of mul, which takes several cycles on most cores: n is 0, 1,
+// a power of two or its negation, or the sum or difference of two
+// powers of two.
+static bool
+ir_mul_by_shifts(uint64_t n) {
+    if ((n & (n - 1)) == 0 || (-n & (-n - 1)) == 0) {
+        return true;
+    }
+    uint64_t low = n & -n;
+    return ((n - low) & (n - low - 1)) == 0
+           || ((n + low) & (n + low - 1)) == 0;
+}
+
+// Whether the value fits in the sign extended 12-bit immediate of an
+// I-type instruction.
+static inline bool
+ir_fits_imm12(uint64_t n) {
+    return (int64_t)n >= -2048 && (int64_t)n < 2048;
+}
+
+// Whether the instruction that c is selected to has c in its code, so
+// c does not need a register for `user`.
+static bool
+ir_const_in_code(const IrInstr* user, const IrInstr* c) {
+    switch (user->op) {
+    case IR_MUL:
+        return ir_mul_by_shifts(c->imm);
+    case IR_LT:
+    case IR_LTU:
+        return ir_arg(user, 1) == c && ir_fits_imm12(c->imm);
+    default:
+        return false;
+    }
+}
+
+// The call that the return is a tail call of, or NULL.  It is one if
+// nothing is done between them but constants that have no code, and
+// the return has the value of the call or the call's value is not
+// used at all.
+static IrInstr*
+ir_tail_call(const IrInstr* ret) {
+    if (ret->op != IR_RET) {
+        return NULL;
+    }
+    IrInstr* i = ret->prev;
+    while (i && i->op == IR_CONST && !i->in_reg) {
+        i = i->prev;
+    }
+    if (i == NULL || i->op != IR_CALL) {
+        return NULL;
+    }
+    if (ret->n_args == 0) {
+        return i->uses ? NULL : i;
+    }
+    if (ir_arg(ret, 0) != i || i->uses->next) {
+        return NULL;
+    }
+    return i;
+}
+
+// Moves the instruction to right before `before`, which may be in
+// another block.
+static void
+ir_move_before(IrInstr* i, IrInstr* before) {
+    IrBlock* b = i->block;
+    if (i->prev) {
+        i->prev->next = i->next;
+    } else {
+        b->first = i->next;
+    }
+    if (i->next) {
+        i->next->prev = i->prev;
+    } else {
+        b->last = i->prev;
+    }
+    b = before->block;
+    i->block = b;
+    i->next = before;
+    i->prev = before->prev;
+    if (before->prev) {
+        before->prev->next = i;
+    } else {
+        b->first = i;
+    }
+    before->prev = i;
+}
+
+// Puts the phi after the other phis of the block.
+static void
+ir_insert_phi(IrBlock* b, IrInstr* phi) {
+    IrInstr* after = NULL;
+    for (IrInstr* i = b->first; i && i->op == IR_PHI; i = i->next) {
+        after = i;
+    }
+    phi->block = b;
+    phi->prev = after;
+    phi->next = after ? after->next : b->first;
+    if (phi->next) {
+        phi->next->prev = phi;
+    } else {
+        b->last = phi;
+    }
+    if (after) {
+        after->next = phi;
+    } else {
+        b->first = phi;
+    }
+}
+
+// The instruction must not be used.
+static void
+ir_remove_instr(IrInstr* i) {
+    assert(i->uses == NULL);
+    for (uint32_t k = 0; k < i->n_args; k++) {
+        if (i->args[k].def) {
+            ir_use_unlink(&i->args[k]);
+        }
+    }
+    IrBlock* b = i->block;
+    if (i->prev) {
+        i->prev->next = i->next;
+    } else {
+        b->first = i->next;
+    }
+    if (i->next) {
+        i->next->prev = i->prev;
+    } else {
+        b->last = i->prev;
+    }
+    i->block = NULL;
+}
+
+static void
+ir_replace_uses(IrInstr* old, IrInstr* new) {
+    while (old->uses) {
+        IrUse* u = old->uses;
+        ir_use_unlink(u);
+        ir_use_link(u, new);
+    }
+}
+
+static void
+ir_add_edge(IrBlock* from, IrBlock* to, Mem* mem) {
+    assert(from->n_succs < 2);
+    from->succs[from->n_succs] = to;
+    from->n_succs++;
+    if (to->n_preds == to->cap_preds) {
+        to->preds = ir_grow_array(mem, to->preds, &to->cap_preds,
+                                  sizeof *to->preds);
+    }
+    to->preds[to->n_preds] = from;
+    to->n_preds++;
+}
+
+static IrInstr*
+ir_add_const(IrFn* fn, IrBlock* b, uint64_t val) {
+    IrInstr* i = ir_new_instr(fn, IR_CONST, 0);
+    i->imm = val;
+    ir_append(b, i);
+    return i;
+}
+
+static IrInstr*
+ir_add_op(IrFn* fn, IrBlock* b, enum IrOp op, IrInstr* l, IrInstr* r) {
+    IrInstr* i = ir_new_instr(fn, op, 2);
+    ir_set_arg(i, 0, l);
+    ir_set_arg(i, 1, r);
+    ir_append(b, i);
+    return i;
+}
+
+// IR_SEXT or IR_ZEXT of the low `bits` of v.
+static IrInstr*
+ir_add_ext(IrFn* fn, IrBlock* b, enum IrOp op, IrInstr* v, uint32_t bits) {
+    IrInstr* i = ir_new_instr(fn, op, 1);
+    ir_set_arg(i, 0, v);
+    i->imm = bits;
+    ir_append(b, i);
+    return i;
+}
+
+static IrInstr*
+ir_add_call(IrFn* fn, IrBlock* b, Binding* callee) {
+    IrInstr* i = ir_new_instr(fn, IR_CALL, 0);
+    i->binding = callee;
+    ir_append(b, i);
+    return i;
+}
+
+// The operands are added with ir_add_arg, one for each predecessor.
+static IrInstr*
+ir_add_phi(IrFn* fn, IrBlock* b, Binding* var) {
+    IrInstr* i = ir_new_instr(fn, IR_PHI, 0);
+    i->binding = var;
+    ir_insert_phi(b, i);
+    return i;
+}
+
+static void
+ir_add_jump(IrFn* fn, IrBlock* b, IrBlock* to) {
+    ir_append(b, ir_new_instr(fn, IR_JUMP, 0));
+    ir_add_edge(b, to, fn->mem);
+}
+
+static void
+ir_add_branch(IrFn* fn, IrBlock* b, IrInstr* cond, IrBlock* if_true,
+              IrBlock* if_false) {
+    IrInstr* i = ir_new_instr(fn, IR_BRANCH, 1);
+    ir_set_arg(i, 0, cond);
+    ir_append(b, i);
+    ir_add_edge(b, if_true, fn->mem);
+    ir_add_edge(b, if_false, fn->mem);
+}
+
+// val is NULL for a function without a value.
+static void
+ir_add_ret(IrFn* fn, IrBlock* b, IrInstr* val) {
+    IrInstr* i = ir_new_instr(fn, IR_RET, val ? 1 : 0);
+    if (val) {
+        ir_set_arg(i, 0, val);
+    }
+    ir_append(b, i);
+}
+
+static void
+ir_add_exit(IrFn* fn, IrBlock* b, IrInstr* val) {
+    IrInstr* i = ir_new_instr(fn, IR_EXIT, 1);
+    ir_set_arg(i, 0, val);
+    ir_append(b, i);
+}
+
+// Removes the phi if it only has one value other than itself, and then
+// the phis that used it if that made them the same.  Returns what the
+// phi stands for.
+static IrInstr*
+ir_try_remove_trivial_phi(IrFn* fn, IrInstr* phi) {
+    IrInstr* same = NULL;
+    for (uint32_t k = 0; k < phi->n_args; k++) {
+        IrInstr* a = ir_arg(phi, k);
+        if (a == same || a == phi) {
+            continue;
+        }
+        if (same) {
+            return phi;
+        }
+        same = a;
+    }
+    assert(same);
+    for (uint32_t k = 0; k < phi->n_args; k++) {
+        ir_use_unlink(&phi->args[k]);
+    }
+    phi->n_args = 0;
+    // The phis that use it are looked at again once the uses are
+    // replaced.
+    uint32_t n_users = 0;
+    for (IrUse* u = phi->uses; u; u = u->next) {
+        n_users += u->user->op == IR_PHI;
+    }
+    IrInstr** users = mem_alloc_array(fn->mem, IrInstr*, n_users);
+    n_users = 0;
+    for (IrUse* u = phi->uses; u; u = u->next) {
+        if (u->user->op == IR_PHI) {
+            users[n_users] = u->user;
+            n_users++;
+        }
+    }
+    ir_replace_uses(phi, same);
+    ir_remove_instr(phi);
+    phi->replaced_by = same;
+    for (uint32_t i = 0; i < n_users; i++) {
+        if (users[i]->block) {
+            ir_try_remove_trivial_phi(fn, users[i]);
+        }
+    }
+    return same;
+}
+
+// What the value is now, if it was a phi that has been removed.
+static IrInstr*
+ir_resolve(IrInstr* i) {
+    while (i->replaced_by) {
+        i = i->replaced_by;
+    }
+    return i;
+}
+
+// Sets `order` and fn->rpo.
+static void
+ir_compute_order(IrFn* fn) {
+    for (uint32_t i = 0; i < fn->n_blocks; i++) {
+        fn->blocks[i]->order = IR_NO_ORDER;
+    }
+    fn->rpo = mem_alloc_array(fn->mem, IrBlock*, fn->n_blocks);
+    fn->n_rpo = 0;
+    if (fn->n_blocks == 0) {
+        return;
+    }
+    // Depth first with a stack of blocks and the next successor to look
+    // at in each.  Blocks are numbered in post-order first.
+    struct Visit {
+        IrBlock* b;
+        uint32_t next_succ;
+    };
+    struct Visit* stack = mem_alloc_array(fn->mem, struct Visit,
+                                          fn->n_blocks);
+    uint32_t n = 0;
+    uint32_t n_post = 0;
+    IrBlock* entry = fn->blocks[0];
+    entry->order = 0;
+    stack[n++] = (struct Visit){entry, 0};
+    while (n > 0) {
+        struct Visit* v = &stack[n - 1];
+        if (v->next_succ < v->b->n_succs) {
+            IrBlock* s = v->b->succs[v->next_succ];
+            v->next_succ++;
+            if (s->order == IR_NO_ORDER) {
+                s->order = 0;
+                stack[n++] = (struct Visit){s, 0};
+            }
+        } else {
+            fn->rpo[n_post] = v->b;
+            n_post++;
+            n--;
+        }
+    }
+    for (uint32_t i = 0; i < n_post / 2; i++) {
+        IrBlock* t = fn->rpo[i];
+        fn->rpo[i] = fn->rpo[n_post - 1 - i];
+        fn->rpo[n_post - 1 - i] = t;
+    }
+    for (uint32_t i = 0; i < n_post; i++) {
+        fn->rpo[i]->order = i;
+    }
+    fn->n_rpo = n_post;
+}
+
+static IrBlock*
+ir_intersect(IrBlock* a, IrBlock* b) {
+    while (a != b) {
+        while (a->order > b->order) {
+            a = a->idom;
+        }
+        while (b->order > a->order) {
+            b = b->idom;
+        }
+    }
+    return a;
+}
+
+// Finds the immediate dominators with the algorithm of Cooper, Harvey
+// and Kennedy and numbers the dominator tree.
+static void
+ir_compute_doms(IrFn* fn) {
+    ir_compute_order(fn);
+    if (fn->n_rpo == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < fn->n_blocks; i++) {
+        IrBlock* b = fn->blocks[i];
+        b->idom = NULL;
+        b->dom_child = NULL;
+        b->dom_sibling = NULL;
+    }
+    IrBlock* entry = fn->rpo[0];
+    entry->idom = entry;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t i = 1; i < fn->n_rpo; i++) {
+            IrBlock* b = fn->rpo[i];
+            IrBlock* idom = NULL;
+            for (uint32_t p = 0; p < b->n_preds; p++) {
+                IrBlock* pred = b->preds[p];
+                if (pred->idom == NULL) {
+                    continue;
+                }
+                idom = idom ? ir_intersect(pred, idom) : pred;
+            }
+            if (idom != b->idom) {
+                b->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    entry->idom = NULL;
+    for (uint32_t i = fn->n_rpo - 1; i > 0; i--) {
+        IrBlock* b = fn->rpo[i];
+        b->dom_sibling = b->idom->dom_child;
+        b->idom->dom_child = b;
+    }
+    // Pre- and post-order numbers of the tree, without recursion.
+    uint32_t counter = 0;
+    IrBlock* b = entry;
+    b->dom_pre = counter++;
+    for (;;) {
+        if (b->dom_child) {
+            b = b->dom_child;
+            b->dom_pre = counter++;
+            continue;
+        }
+        for (;;) {
+            b->dom_post = counter++;
+            if (b->dom_sibling) {
+                b = b->dom_sibling;
+                b->dom_pre = counter++;
+                break;
+            }
+            b = b->idom;
+            if (b == NULL) {
+                return;
+            }
+        }
+    }
+}
+
+static inline bool
+ir_dominates(const IrBlock* a, const IrBlock* b) {
+    return a->dom_pre <= b->dom_pre && b->dom_post <= a->dom_post;
+}
+
+static inline bool
+ir_bit(const uint64_t* set, uint32_t i) {
+    return (set[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void
+ir_set_bit(uint64_t* set, uint32_t i) {
+    set[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline void
+ir_clear_bit(uint64_t* set, uint32_t i) {
+    set[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+// Sets live_in, live_out and `pos`.  Only values that are kept in
+// registers are in the sets.  A phi is defined at the start of its
+// block, and its operands are used at the end of the predecessors they
+// come from.  ir_compute_doms must have been called.
+static void
+ir_compute_liveness(IrFn* fn) {
+    uint32_t n_words = (fn->n_ids + 63) / 64;
+    for (uint32_t i = 0; i < fn->n_rpo; i++) {
+        IrBlock* b = fn->rpo[i];
+        b->live_in = mem_alloc_zero(fn->mem, n_words * sizeof (uint64_t),
+                                    _Alignof(uint64_t));
+        b->live_out = mem_alloc_zero(fn->mem, n_words * sizeof (uint64_t),
+                                     _Alignof(uint64_t));
+        uint32_t pos = 0;
+        for (IrInstr* in = b->first; in; in = in->next) {
+            in->pos = pos++;
+        }
+    }
+    uint64_t* live = mem_alloc_array(fn->mem, uint64_t, n_words);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t i = fn->n_rpo; i-- > 0;) {
+            IrBlock* b = fn->rpo[i];
+            memset(live, 0, n_words * sizeof *live);
+            for (uint32_t s = 0; s < b->n_succs; s++) {
+                IrBlock* succ = b->succs[s];
+                for (uint32_t w = 0; w < n_words; w++) {
+                    live[w] |= succ->live_in[w];
+                }
+                uint32_t p = 0;
+                while (succ->preds[p] != b) {
+                    p++;
+                }
+                for (IrInstr* phi = succ->first; phi && phi->op == IR_PHI;
+                     phi = phi->next) {
+                    if (ir_has_value(ir_arg(phi, p))) {
+                        ir_set_bit(live, ir_arg(phi, p)->id);
+                    }
+                }
+            }
+            memcpy(b->live_out, live, n_words * sizeof *live);
+            for (IrInstr* in = b->last; in; in = in->prev) {
+                ir_clear_bit(live, in->id);
+                if (in->op == IR_PHI) {
+                    continue;
+                }
+                for (uint32_t k = 0; k < in->n_args; k++) {
+                    if (ir_has_value(ir_arg(in, k))) {
+                        ir_set_bit(live, ir_arg(in, k)->id);
+                    }
+                }
+            }
+            if (memcmp(live, b->live_in, n_words * sizeof *live) != 0) {
+                memcpy(b->live_in, live, n_words * sizeof *live);
+                changed = true;
+            }
+        }
+    }
+}
+
+// Whether a is defined before b on every path to b.
+static bool
+ir_def_dominates(const IrInstr* a, const IrInstr* b) {
+    if (a->block == b->block) {
+        return a->pos < b->pos;
+    }
+    return ir_dominates(a->block, b->block);
+}
+
+// Whether a is live where b is defined.  a must be defined before b.
+static bool
+ir_live_at(const IrInstr* a, const IrInstr* b) {
+    const IrBlock* bb = b->block;
+    if (b->op == IR_PHI) {
+        // The phis of a block are all defined at its start.
+        return ir_bit(bb->live_in, a->id)
+               || (a->op == IR_PHI && a->block == bb);
+    }
+    if (ir_bit(bb->live_out, a->id)) {
+        return true;
+    }
+    for (const IrInstr* i = b->next; i; i = i->next) {
+        for (uint32_t k = 0; k < i->n_args; k++) {
+            if (ir_arg(i, k) == a) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool
+ir_interfere(const IrInstr* a, const IrInstr* b) {
+    if (ir_def_dominates(a, b)) {
+        return ir_live_at(a, b);
+    }
+    if (ir_def_dominates(b, a)) {
+        return ir_live_at(b, a);
+    }
+    return false;
+}
+
+static IrInstr*
+ir_home(IrInstr* i) {
+    while (i->home != i) {
+        i = i->home;
+    }
+    return i;
+}
+
+// Puts each phi in the same register as its operands where their
+// lifetimes do not overlap, so that no copy is needed for them.
+static void
+ir_coalesce(IrFn* fn) {
+    bool has_phis = false;
+    for (uint32_t i = 0; i < fn->n_rpo; i++) {
+        IrBlock* b = fn->rpo[i];
+        for (IrInstr* in = b->first; in; in = in->next) {
+            in->home = in;
+            in->next_home = NULL;
+            has_phis |= in->op == IR_PHI;
+        }
+    }
+    if (!has_phis) {
+        return;
+    }
+    ir_compute_liveness(fn);
+    for (uint32_t i = 0; i < fn->n_rpo; i++) {
+        IrBlock* b = fn->rpo[i];
+        for (IrInstr* phi = b->first; phi && phi->op == IR_PHI;
+             phi = phi->next) {
+            for (uint32_t k = 0; k < phi->n_args; k++) {
+                IrInstr* a = ir_arg(phi, k);
+                if (!ir_has_value(a)) {
+                    continue;
+                }
+                IrInstr* ha = ir_home(a);
+                IrInstr* hp = ir_home(phi);
+                if (ha == hp) {
+                    continue;
+                }
+                bool interfere = false;
+                for (IrInstr* x = ha; x && !interfere; x = x->next_home) {
+                    for (IrInstr* y = hp; y; y = y->next_home) {
+                        if (ir_interfere(x, y)) {
+                            interfere = true;
+                            break;
+                        }
+                    }
+                }
+                if (interfere) {
+                    continue;
+                }
+                IrInstr* tail = hp;
+                while (tail->next_home) {
+                    tail = tail->next_home;
+                }
+                tail->next_home = ha;
+                ha->home = hp;
+            }
+        }
+    }
+}
+
+static void
+ir_print_instr(FILE* f, const IrInstr* i) {
+    fprintf(f, "    ");
+    if (!ir_is_terminator(i)) {
+        fprintf(f, "v%u = ", i->id);
+    }
+    fprintf(f, "%s", ir_op_names[i->op]);
+    switch (i->op) {
+    case IR_CONST:
+        fprintf(f, " %lu%s", i->imm, i->in_reg ? "  ; in reg" : "");
+        break;
+    case IR_SEXT:
+    case IR_ZEXT:
+        fprintf(f, " v%u, %lu", ir_arg(i, 0)->id, i->imm);
+        break;
+    case IR_CALL: {
+        Str name = sym_str(i->binding->name);
+        fprintf(f, " %.*s", (int)name.len, name.data);
+    } break;
+    case IR_PHI:
+        for (uint32_t k = 0; k < i->n_args; k++) {
+            fprintf(f, "%s v%u b%u", k ? "," : "", ir_arg(i, k)->id,
+                    i->block->preds[k]->id);
+        }
+        break;
+    default:
+        for (uint32_t k = 0; k < i->n_args; k++) {
+            fprintf(f, "%s v%u", k ? "," : "", ir_arg(i, k)->id);
+        }
+        break;
+    }
+    if (i->op == IR_JUMP || i->op == IR_BRANCH) {
+        for (uint32_t s = 0; s < i->block->n_succs; s++) {
+            fprintf(f, "%s b%u", s || i->n_args ? "," : "",
+                    i->block->succs[s]->id);
+        }
+    }
+    if (i->op == IR_PHI && i->binding) {
+        Str name = sym_str(i->binding->name);
+        fprintf(f, "  ; %.*s", (int)name.len, name.data);
+    }
+    fprintf(f, "\n");
+}
+
+static void
+ir_print_fn(FILE* f, const IrFn* fn) {
+    Str name = sym_str(fn->name->name);
+    fprintf(f, "fn %.*s\n", (int)name.len, name.data);
+    for (uint32_t i = 0; i < fn->n_blocks; i++) {
+        const IrBlock* b = fn->blocks[i];
+        fprintf(f, "  b%u:", b->id);
+        if (b->n_preds) {
+            fprintf(f, "  ; preds");
+            for (uint32_t p = 0; p < b->n_preds; p++) {
+                fprintf(f, " b%u", b->preds[p]->id);
+            }
+        }
+        fprintf(f, "\n");
+        for (const IrInstr* in = b->first; in; in = in->next) {
+            ir_print_instr(f, in);
+        }
+    }
+}
+
+static void
+ir_verify_fail(const IrFn* fn, const char* after, const IrBlock* b,
+               const IrInstr* i, const char* msg) {
+    Str name = sym_str(fn->name->name);
+    fprintf(stderr, "Bad IR of %.*s after %s: b%u", (int)name.len, name.data,
+            after, b->id);
+    if (i) {
+        fprintf(stderr, ", v%u", i->id);
+    }
+    fprintf(stderr, ": %s\n", msg);
+    ir_print_fn(stderr, fn);
+    abort();
+}
+
+static uint32_t
+ir_count_edges(IrBlock* const* blocks, uint32_t n, const IrBlock* b) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        count += blocks[i] == b;
+    }
+    return count;
+}
+
+// Checks that the IR is well formed and in SSA form, and aborts with a
+// dump of it if not.  `after` names what made the IR.
+static void
+ir_verify(IrFn* fn, const char* after) {
+    if (fn->n_blocks == 0) {
+        return;
+    }
+    ir_compute_doms(fn);
+    if (fn->blocks[0]->n_preds) {
+        ir_verify_fail(fn, after, fn->blocks[0], NULL,
+                       "the entry has predecessors");
+    }
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        IrBlock* b = fn->blocks[bi];
+        if (b->order == IR_NO_ORDER) {
+            ir_verify_fail(fn, after, b, NULL, "unreachable block");
+        }
+        if (b->last == NULL || !ir_is_terminator(b->last)) {
+            ir_verify_fail(fn, after, b, b->last, "no terminator");
+        }
+        uint32_t n_succs = b->last->op == IR_JUMP ? 1
+                           : b->last->op == IR_BRANCH ? 2 : 0;
+        if (b->n_succs != n_succs) {
+            ir_verify_fail(fn, after, b, b->last,
+                           "successors do not match the terminator");
+        }
+        for (uint32_t s = 0; s < b->n_succs; s++) {
+            IrBlock* succ = b->succs[s];
+            if (ir_count_edges(succ->preds, succ->n_preds, b)
+                != ir_count_edges(b->succs, b->n_succs, succ)) {
+                ir_verify_fail(fn, after, b, NULL,
+                               "successor does not have it as predecessor");
+            }
+        }
+        for (uint32_t p = 0; p < b->n_preds; p++) {
+            IrBlock* pred = b->preds[p];
+            if (ir_count_edges(pred->succs, pred->n_succs, b) == 0) {
+                ir_verify_fail(fn, after, b, NULL,
+                               "predecessor does not have it as successor");
+            }
+        }
+        uint32_t pos = 0;
+        bool past_phis = false;
+        for (IrInstr* i = b->first; i; i = i->next) {
+            i->pos = pos++;
+            if (i->block != b) {
+                ir_verify_fail(fn, after, b, i, "in the wrong block");
+            }
+            if ((i->next ? i->next->prev != i : b->last != i)
+                || (i->prev == NULL && b->first != i)) {
+                ir_verify_fail(fn, after, b, i, "bad instruction list");
+            }
+            if (ir_is_terminator(i) && i != b->last) {
+                ir_verify_fail(fn, after, b, i,
+                               "terminator in the middle of a block");
+            }
+            if (i->op == IR_PHI) {
+                if (past_phis) {
+                    ir_verify_fail(fn, after, b, i, "phi after other code");
+                }
+                if (i->n_args != b->n_preds) {
+                    ir_verify_fail(fn, after, b, i,
+                                   "phi operands do not match predecessors");
+                }
+            } else {
+                past_phis = true;
+            }
+            for (uint32_t k = 0; k < i->n_args; k++) {
+                const IrUse* u = &i->args[k];
+                if (u->def == NULL || u->user != i || *u->prev != u) {
+                    ir_verify_fail(fn, after, b, i, "bad operand");
+                }
+                if (u->def->block == NULL || ir_is_terminator(u->def)) {
+                    ir_verify_fail(fn, after, b, i,
+                                   "operand is not a value in the function");
+                }
+            }
+            for (const IrUse* u = i->uses; u; u = u->next) {
+                if (u->def != i || u < u->user->args
+                    || u >= u->user->args + u->user->n_args) {
+                    ir_verify_fail(fn, after, b, i, "bad use list");
+                }
+            }
+        }
+    }
+    // Every definition dominates its uses.  The positions are all set
+    // now.
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        IrBlock* b = fn->blocks[bi];
+        for (IrInstr* i = b->first; i; i = i->next) {
+            for (uint32_t k = 0; k < i->n_args; k++) {
+                IrInstr* def = ir_arg(i, k);
+                bool ok;
+                if (i->op == IR_PHI) {
+                    // Used at the end of the predecessor.
+                    ok = ir_dominates(def->block, b->preds[k]);
+                } else if (def->block == b) {
+                    ok = def->pos < i->pos;
+                } else {
+                    ok = ir_dominates(def->block, b);
+                }
+                if (!ok) {
+                    ir_verify_fail(fn, after, b, i,
+                                   "operand is not defined before it");
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,183 @@
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+enum TokenKind {
+    TOK_EOF,
+    TOK_LABEL,
+    TOK_NUMBER,
+    TOK_CHAR,
+};
+
+struct Token {
+    enum TokenKind kind;
+    uint32_t offset;
+    uint32_t len;
+    // TOK_NUMBER: the value.  TOK_LABEL: the Sym.  TOK_CHAR: the character.
+    uint64_t num;
+};
+typedef struct Token Token;
+
+struct TokenList {
+    Token* tokens;
+    size_t len;
+    size_t cap;
+};
+typedef struct TokenList TokenList;
+
+static bool
+is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool
+is_letter(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool
+is_whitespace(char c) {
+    return c == ' ' || c == '\n' || c == '\t';
+}
+
+static bool
+is_label_char(char c) {
+    return is_letter(c) || is_digit(c) || c == '_';
+}
+
+// The SIMD kernels below build a mask with one bit per byte that is
+// set where the byte still belongs to the run being scanned.  The run
+// ends at the first zero bit.  Bytes >= 0x80 are negative as signed
+// chars so they never compare as being inside a range of letters.
+
+#if defined(__AVX2__)
+#define LEX_VEC_LEN 32
+typedef __m256i LexVec;
+#define lex_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define lex_set1(c) _mm256_set1_epi8(c)
+#define lex_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define lex_gt(a, b) _mm256_cmpgt_epi8(a, b)
+#define lex_or(a, b) _mm256_or_si256(a, b)
+#define lex_and(a, b) _mm256_and_si256(a, b)
+#define lex_mask(a) ((uint32_t)_mm256_movemask_epi8(a))
+#define LEX_FULL_MASK 0xffffffffu
+#elif defined(__SSE2__)
+#define LEX_VEC_LEN 16
+typedef __m128i LexVec;
+#define lex_load(p) _mm_loadu_si128((const __m128i*)(p))
+#define lex_set1(c) _mm_set1_epi8(c)
+#define lex_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define lex_gt(a, b) _mm_cmpgt_epi8(a, b)
+#define lex_or(a, b) _mm_or_si128(a, b)
+#define lex_and(a, b) _mm_and_si128(a, b)
+#define lex_mask(a) ((uint32_t)_mm_movemask_epi8(a))
+#define LEX_FULL_MASK 0xffffu
+#endif
+
+#ifdef LEX_VEC_LEN
+// Mask of the bytes in [lo, hi].
+static inline LexVec
+lex_in_range(LexVec v, char lo, char hi) {
+    return lex_and(lex_gt(v, lex_set1(lo - 1)), lex_gt(lex_set1(hi + 1), v));
+}
+#endif
+
+// Returns the offset of the first non-whitespace byte at or after `o`.
+static size_t
+scan_whitespace(const char* s, size_t o, size_t size) {
+#ifdef LEX_VEC_LEN
+    const LexVec sp = lex_set1(' ');
+    const LexVec nl = lex_set1('\n');
+    const LexVec tab = lex_set1('\t');
+    while (o + LEX_VEC_LEN <= size) {
+        LexVec v = lex_load(s + o);
+        LexVec ws = lex_or(lex_or(lex_eq(v, sp), lex_eq(v, nl)), lex_eq(v, tab));
+        uint32_t m = lex_mask(ws);
+        if (m != LEX_FULL_MASK) {
+            return o + __builtin_ctz(~m);
+        }
+        o += LEX_VEC_LEN;
+    }
+#endif
+    while (o < size && is_whitespace(s[o])) {
+        o++;
+    }
+    return o;
+}
+
+// Returns the offset of the first byte at or after `o` that can not be
+// part of a label.
+static size_t
+scan_label(const char* s, size_t o, size_t size) {
+#ifdef LEX_VEC_LEN
+    const LexVec underscore = lex_set1('_');
+    while (o + LEX_VEC_LEN <= size) {
+        LexVec v = lex_load(s + o);
+        LexVec ok = lex_or(lex_or(lex_in_range(v, 'a', 'z'),
+                                  lex_in_range(v, 'A', 'Z')),
+                           lex_or(lex_in_range(v, '0', '9'),
+                                  lex_eq(v, underscore)));
+        uint32_t m = lex_mask(ok);
+        if (m != LEX_FULL_MASK) {
+            return o + __builtin_ctz(~m);
+        }
+        o += LEX_VEC_LEN;
+    }
+#endif
+    while (o < size && is_label_char(s[o])) {
+        o++;
+    }
+    return o;
+}
+
+static inline void
+token_list_add(TokenList* list, Token t) {
+    assert(list->len < list->cap);
+    list->tokens[list->len] = t;
+    list->len++;
+}
+
+// Splits the whole file into tokens.  The list always ends with a
+// TOK_EOF token whose offset is the size of the file.  Every token is
+// at least one byte, so the list is allocated once from `mem` with
+// room for as many tokens as there are bytes.  Only the part that is
+// written to is backed by memory.
+static bool
+lex_file(const struct File* file, TokenList* list, Mem* mem) {
+    const char* s = file->content;
+    size_t size = file->size;
+    if (size >= UINT32_MAX) {
+        fprintf(stderr, "%s: File is too big\n", file->name);
+        return false;
+    }
+    list->cap = size + 1;
+    list->tokens = mem_alloc_array(mem, Token, list->cap);
+    list->len = 0;
+    size_t o = scan_whitespace(s, 0, size);
+    while (o < size) {
+        char c = s[o];
+        Token t = {.offset = o};
+        size_t end;
+        if (is_digit(c)) {
+            uint64_t n = 0;
+            for (end = o; end < size && is_digit(s[end]); end++) {
+                n = n * 10 + (s[end] - '0');
+            }
+            t.kind = TOK_NUMBER;
+            t.num = n;
+        } else if (is_label_char(c)) {
+            end = scan_label(s, o + 1, size);
+            t.kind = TOK_LABEL;
+            t.num = sym_intern((Str){s + o, end - o});
+        } else {
+            end = o + 1;
+            t.kind = TOK_CHAR;
+            t.num = (unsigned char)c;
+        }
+        t.len = end - o;
+        token_list_add(list, t);
+        o = scan_whitespace(s, end, size);
+    }
+    token_list_add(list, (Token){.kind = TOK_EOF, .offset = size});
+    return true;
+}
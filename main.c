@@ -1,11 +1,16 @@
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
 typedef enum {false, true} bool;
 
@@ -20,6 +25,32 @@ typedef struct Str Str;
 
 #define ARR_LEN(a) (sizeof (a) / sizeof *(a))
 
+enum Target {
+    TARGET_RV64,
+    TARGET_X86_64,
+};
+
+// Set from the command line.
+struct Options {
+    bool no_cache;
+    bool cache_stats;
+    size_t cache_size;  // In bytes.
+    bool huge_pages;    // Back big arena segments with huge pages.
+    bool mem_stats;
+    bool time_report;
+    const char* time_trace;  // File for the Chrome trace, or NULL.
+    unsigned dump;           // Bit mask of enum DumpKind.
+    const char* dump_file;   // Or NULL for stderr.
+    enum Target target;
+    bool run;                // Run the program instead of writing it.
+    bool verify_ir;
+    bool inline_report;
+};
+
+static struct Options options = {
+    .cache_size = (size_t)256 << 20,
+};
+
 static bool
 str_eq(Str a, Str b) {
     if (a.len != b.len) {
@@ -33,11 +64,22 @@ str_eq(Str a, Str b) {
     return true;
 }
 
+#include "sym.c"
+
+#include "mem.c"
+
+#include "timing.c"
+
+#include "dump.c"
+
 struct Segment {
     const char* name;
     char* data;
     size_t len;
+    size_t cap;
+    size_t high_water;  // The most that has been reserved at once.
     size_t addr;
+    Mem* mem;  // Where the data is from, or NULL if it is mapped.
 
     // Type is *Patch
     void* patches;
@@ -46,52 +88,160 @@ struct Segment {
 typedef struct Segment Segment;
 
 static void
-init_seg(Segment* seg, const char* name, size_t addr) {
-    seg->data = mmap(NULL, 0x100000, PROT_READ | PROT_WRITE,
+init_seg(Segment* seg, const char* name, size_t addr, size_t cap) {
+    seg->cap = cap;
+    seg->data = mmap(NULL, seg->cap, PROT_READ | PROT_WRITE,
                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (seg->data == MAP_FAILED) {
+        perror("mmap");
+        abort();
+    }
     seg->len = 0;
+    seg->high_water = 0;
     seg->name = name;
     seg->addr = addr;
+    seg->mem = NULL;
+}
+
+// A segment that is only used while compiling, with its data in an
+// arena.
+static void
+init_seg_mem(Segment* seg, const char* name, size_t cap, Mem* mem) {
+    *seg = (Segment){
+        .name = name,
+        .data = mem_alloc_size(mem, cap),
+        .cap = cap,
+        .mem = mem,
+    };
+}
+
+static __attribute__((noinline)) void
+seg_grow(Segment* seg, size_t needed) {
+    size_t cap = seg->cap * 2;
+    while (needed > cap) {
+        cap *= 2;
+    }
+    if (seg->mem) {
+        char* p = mem_alloc_size(seg->mem, cap);
+        memcpy(p, seg->data, seg->len);
+        seg->data = p;
+        seg->cap = cap;
+        return;
+    }
+    char* p = mremap(seg->data, seg->cap, cap, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED) {
+        perror("mremap");
+        abort();
+    }
+    seg->data = p;
+    seg->cap = cap;
+}
+
+// Makes room for `size` more bytes so that emitting them will not need
+// to grow the segment.
+static inline void
+seg_reserve(Segment* seg, size_t size) {
+    size_t needed = seg->len + size;
+    if (needed > seg->cap) {
+        seg_grow(seg, needed);
+    }
+    if (needed > seg->high_water) {
+        seg->high_water = needed;
+    }
+}
+
+static inline size_t
+emit_bytes(Segment* seg, const void* data, size_t size) {
+    seg_reserve(seg, size);
+    memcpy(seg->data + seg->len, data, size);
+    seg->len += size;
+    return seg->len - size;
+}
+
+static inline size_t
+emit16(Segment* seg, uint16_t x) {
+    return emit_bytes(seg, &x, sizeof x);
+}
+
+static inline size_t
+emit32(Segment* seg, uint32_t x) {
+    return emit_bytes(seg, &x, sizeof x);
+}
+
+// Pads with `fill` until the length is a multiple of `align`.
+static size_t
+seg_pad(Segment* seg, size_t align, char fill) {
+    size_t n = (align - seg->len % align) % align;
+    seg_reserve(seg, n);
+    memset(seg->data + seg->len, fill, n);
+    seg->len += n;
+    return seg->len;
 }
 
 static void
-print_segment(Segment* seg) {
+print_segment(FILE* f, Segment* seg) {
+    fprintf(f, "%zu bytes, high-water %zu, capacity %zu\n",
+            seg->len, seg->high_water, seg->cap);
     for (size_t i = 0; i < seg->len; i++) {
         if (i % 4 == 0) {
-            fprintf(stderr, " ");
+            fprintf(f, " ");
         }
-        fprintf(stderr, "%02X ", (unsigned char)seg->data[i]);
+        fprintf(f, "%02X ", (unsigned char)seg->data[i]);
     }
-    fprintf(stderr, "\n");
+    fprintf(f, "\n");
 }
 
 static Segment seg_data;
 static Segment seg_text;
 
 struct Type {
-    Str name;
+    Sym name;
     size_t size;
+    bool is_signed;
 };
 typedef struct Type Type;
 
-static Type types[100];
-static size_t n_types;
+static ChunkArray types = {.elem_size = sizeof (Type), .mem = &default_mem};
 
 static const Type*
-get_type(Str name) {
-    for (size_t i = 0; i < n_types; i++) {
-        if (str_eq(name, types[i].name)) {
-            return types + i;
+get_type(Sym name) {
+    for (size_t i = 0; i < types.len; i++) {
+        Type* t = chunk_array_at(&types, i);
+        if (t->name == name) {
+            return t;
         }
     }
     return NULL;
 }
 
 static Type*
-add_type(Str name, size_t size) {
-    types[n_types] = (Type){name, size};
-    n_types++;
-    return types + n_types - 1;
+add_type(Sym name, size_t size, bool is_signed) {
+    Type* t = chunk_array_add(&types);
+    *t = (Type){name, size, is_signed};
+    return t;
+}
+
+// Values are computed in 64 bits and wrapped to their type after every
+// operation.  This is how many bits are kept, or 0 if the type is not
+// narrower than that.  Untyped numbers (NULL) are 64 bits.
+static unsigned
+type_wrap_bits(const Type* type) {
+    if (type == NULL || type->size == 0 || type->size >= 8) {
+        return 0;
+    }
+    return type->size * 8;
+}
+
+// Keeps the low `bits` of v and sign or zero extends them back to 64
+// bits.
+static inline uint64_t
+wrap_bits(uint64_t v, unsigned bits, bool is_signed) {
+    uint64_t mask = ((uint64_t)1 << bits) - 1;
+    v &= mask;
+    if (is_signed && (v >> (bits - 1)) & 1) {
+        v |= ~mask;
+    }
+    return v;
 }
 
 struct Location {
@@ -103,60 +253,168 @@ typedef struct Location Location;
 struct Vreg;
 
 struct Binding {
-    Str name;
+    Sym name;
     const Type* type;
     struct Vreg* last_vreg;
+    struct Binding* shadowed;  // Outer binding with the same name.
+    uint32_t decl;             // The AST_VAR or AST_FN node that declared
+                               // it, in the tree of its file.
+    struct FnCode* code;       // For functions.
+    bool global;               // Declared at the top of its file.
 };
 typedef struct Binding Binding;
 
-#define MAX_BINDINGS 100
-static Binding bindings[MAX_BINDINGS];
-static size_t n_bindings;
+// The parser state below is per thread so that files can be parsed in
+// parallel.
 
-struct Vreg;
+// The bindings of the file being parsed, in the order they appear.
+static _Thread_local ChunkArray bindings = {.elem_size = sizeof (Binding)};
 
-static Binding*
-add_binding(Str name, const Type* type, struct Vreg* r) {
-    if (n_bindings < MAX_BINDINGS) {
-        bindings[n_bindings] = (Binding){
-            .name = name,
-            .type = type,
-            .last_vreg = r,
-        };
-        n_bindings++;
-        return bindings + n_bindings - 1;
+// Maps every name to the innermost binding that is currently visible.
+// A slot is never emptied once it has a key; leaving a scope sets the
+// value back to the shadowed binding, which may be NULL.
+struct BindingMap {
+    uint32_t* keys;  // Sym + 1, 0 for an empty slot.
+    Binding** vals;
+    size_t len;
+    size_t cap;
+};
+
+static _Thread_local struct BindingMap binding_map;
+
+// The bindings added in the open scopes, innermost last.
+static _Thread_local Binding** scope_bindings;
+static _Thread_local size_t n_scope_bindings;
+static _Thread_local size_t cap_scope_bindings;
+
+// Index into scope_bindings where each open scope starts.
+static _Thread_local size_t* scopes;
+static _Thread_local size_t n_scopes;
+static _Thread_local size_t cap_scopes;
+
+// The functions of all files.  Filled in when the files are merged.
+static struct BindingMap functions;
+
+static size_t
+binding_map_slot(const struct BindingMap* m, Sym name) {
+    size_t mask = m->cap - 1;
+    size_t i = (name * 2654435761u) & mask;
+    while (m->keys[i] && m->keys[i] != name + 1) {
+        i = (i + 1) & mask;
     }
-    return NULL;
+    return i;
 }
 
-static Binding*
-get_binding(Str name) {
-    for (size_t i = 0; i < n_bindings; i++) {
-        Binding* b = bindings + i;
-        if (str_eq(b->name, name)) {
-            return b;
+static void
+binding_map_grow(struct BindingMap* m) {
+    struct BindingMap new = {
+        .cap = m->cap ? m->cap * 2 : 256,
+        .len = m->len,
+    };
+    new.keys = calloc(new.cap, sizeof *new.keys);
+    new.vals = calloc(new.cap, sizeof *new.vals);
+    if (new.keys == NULL || new.vals == NULL) {
+        perror("calloc");
+        abort();
+    }
+    for (size_t i = 0; i < m->cap; i++) {
+        if (m->keys[i]) {
+            size_t j = binding_map_slot(&new, m->keys[i] - 1);
+            new.keys[j] = m->keys[i];
+            new.vals[j] = m->vals[i];
         }
     }
-    return NULL;
+    free(m->keys);
+    free(m->vals);
+    *m = new;
 }
 
 static void
-print_bindings() {
-    for (size_t i = 0; i < n_bindings; i++) {
-        Binding* b = bindings + i;
-        fprintf(stderr, "%.*s %.*s\n",
-                (int)b->name.len, b->name.data,
-                (int)b->type->name.len, b->type->name.data);
+binding_map_set(struct BindingMap* m, Sym name, Binding* b) {
+    if ((m->len + 1) * 2 > m->cap) {
+        binding_map_grow(m);
     }
+    size_t i = binding_map_slot(m, name);
+    if (m->keys[i] == 0) {
+        m->keys[i] = name + 1;
+        m->len++;
+    }
+    m->vals[i] = b;
 }
 
-static size_t
-add_data(Segment* segment, void* data, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-        segment->data[segment->len + i] = ((char*)data)[i];
+static Binding*
+binding_map_get(const struct BindingMap* m, Sym name) {
+    if (m->cap == 0) {
+        return NULL;
+    }
+    return m->vals[binding_map_slot(m, name)];
+}
+
+static void
+push_scope() {
+    if (n_scopes == cap_scopes) {
+        scopes = grow_array(scopes, &cap_scopes, sizeof *scopes);
+    }
+    scopes[n_scopes] = n_scope_bindings;
+    n_scopes++;
+}
+
+// Makes the bindings of the innermost scope invisible again.
+static void
+pop_scope() {
+    assert(n_scopes > 0);
+    n_scopes--;
+    while (n_scope_bindings > scopes[n_scopes]) {
+        n_scope_bindings--;
+        Binding* b = scope_bindings[n_scope_bindings];
+        binding_map_set(&binding_map, b->name, b->shadowed);
+    }
+}
+
+struct Vreg;
+
+// Adds a binding to the innermost scope.  It shadows any visible
+// binding with the same name until the scope is popped.
+static Binding*
+add_binding(Sym name, const Type* type, struct Vreg* r) {
+    Binding* b = chunk_array_add(&bindings);
+    *b = (Binding){
+        .name = name,
+        .type = type,
+        .last_vreg = r,
+        .shadowed = binding_map_get(&binding_map, name),
+        .global = n_scopes == 1,
+    };
+    binding_map_set(&binding_map, name, b);
+    if (n_scope_bindings == cap_scope_bindings) {
+        scope_bindings = grow_array(scope_bindings, &cap_scope_bindings,
+                                    sizeof *scope_bindings);
+    }
+    scope_bindings[n_scope_bindings] = b;
+    n_scope_bindings++;
+    return b;
+}
+
+// Returns the innermost visible binding with this name or NULL.
+static Binding*
+get_binding(Sym name) {
+    return binding_map_get(&binding_map, name);
+}
+
+static Binding*
+get_function(Sym name) {
+    return binding_map_get(&functions, name);
+}
+
+static void
+print_bindings(FILE* f, const ChunkArray* bs) {
+    for (size_t i = 0; i < bs->len; i++) {
+        Binding* b = chunk_array_at(bs, i);
+        Str name = sym_str(b->name);
+        Str type = sym_str(b->type->name);
+        fprintf(f, "%.*s %.*s\n",
+                (int)name.len, name.data, (int)type.len, type.data);
     }
-    segment->len += size;
-    return segment->len - size;
 }
 
 struct File {
@@ -165,9 +423,15 @@ struct File {
     size_t size;
 };
 
+#include "lex.c"
+
 struct State {
     const struct File* file;
-    size_t offset;
+    struct AstTree* tree;
+    const Token* tokens;
+    size_t tok;     // Index of the next token to read.
+    size_t offset;  // Position in the file, used for diagnostics.
+    bool failed;    // An error has been reported.
 };
 typedef struct State State;
 
@@ -202,90 +466,68 @@ struct Result {
 };
 typedef struct Result Result;
 
-#include "mem.c"
-
 #include "ast.c"
 
 #include "regs.c"
 
+#include "fold.c"
+
 #include "final_instructions.c"
 
 #include "var_instructions.c"
 
-static bool
-is_digit(char c) {
-    return c >= '0' && c <= '9';
+#include "ir.c"
+
+#include "opt.c"
+
+#include "x86_64.c"
+
+static const Token*
+peek_token(State* s) {
+    return &s->tokens[s->tok];
 }
 
-static bool
-is_letter(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+static void
+next_token(State* s) {
+    const Token* t = &s->tokens[s->tok];
+    s->offset = t->offset + t->len;
+    s->tok++;
 }
 
-static size_t
-skip_whitespace(State* s) {
-    size_t o;
-    for (o = s->offset; o < s->file->size; o++) {
-        char c = s->file->content[o];
-        if (c != ' ' && c != '\n' && c != '\t') {
-            break;
-        }
-    }
-    size_t len = o - s->offset;
-    s->offset = o;
-    return len;
+static bool
+at_eof(State* s) {
+    return peek_token(s)->kind == TOK_EOF;
 }
 
 static size_t
-read_label(State* s, Ast** r) {
-    skip_whitespace(s);
-    size_t o;
-    for (o = s->offset; o < s->file->size; o++) {
-        char c = s->file->content[o];
-        if (o == s->offset && is_digit(c)) {
-            return 0;
-        }
-        if (!is_letter(c) && !is_digit(c) && c != '_') {
-            break;
-        }
-    }
-    if (o == s->offset) {
+read_label(State* s, Sym* r) {
+    const Token* t = peek_token(s);
+    if (t->kind != TOK_LABEL) {
         return 0;
     }
-    size_t len = o - s->offset;
-    Str lab = {s->file->content + s->offset, len};
-    *r = ast_new_label(lab);
-    s->offset = o;
+    size_t len = t->len;
+    *r = t->num;
+    next_token(s);
     return len;
 }
 
 static size_t
-read_number(State* s, Ast** r) {
-    skip_whitespace(s);
-    size_t o;
-    uint64_t n = 0;
-    int base = 10;
-    for (o = s->offset; o < s->file->size; o++) {
-        char c = s->file->content[o];
-        if (!is_digit(c)) {
-            break;
-        }
-        n = n * base + (c - '0');
-    }
-    if (o == s->offset) {
+read_number(State* s, AstRef* r) {
+    const Token* t = peek_token(s);
+    if (t->kind != TOK_NUMBER) {
         return 0;
     }
-    size_t len = o - s->offset;
-    *r = ast_new_num_signed(n);
-    s->offset = o;
+    size_t len = t->len;
+    *r = ast_new_num_signed(s->tree, t->num);
+    next_token(s);
     return len;
 }
 
 static size_t
 read_char(State* s, char c) {
-    skip_whitespace(s);
-    if (s->file->content[s->offset] == c) {
-        s->offset++;
+    const Token* t = peek_token(s);
+    if (t->kind == TOK_CHAR && t->num == (unsigned char)c) {
+        next_token(s);
         return 1;
     }
     return 0;
@@ -343,78 +585,184 @@ get_full_line(const char* code, size_t where) {
 
 static void
 print_error(const char* msg, State* s) {
+    s->failed = true;
     size_t line, col;
     get_linecol(s, &line, &col);
-    fprintf(stderr, "%s:%lu:%lu %s\n", s->file->name, line, col, msg);
     Str codeline = get_full_line(s->file->content, s->offset);
+    // Keep the lines together when several files are parsed at once.
+    flockfile(stderr);
+    fprintf(stderr, "%s:%lu:%lu %s\n", s->file->name, line, col, msg);
     fprintf(stderr, " | %.*s\n", (int)codeline.len, codeline.data);
     fprintf(stderr, " | %*s\n", (int)col + 1, "^");
+    funlockfile(stderr);
 }
 
-#include "elf.c"
+// How the content of a File was loaded.
+enum FileLoad {
+    FILE_MAPPED,
+    FILE_READ,
+};
 
+// Reads everything from a file that can not be mapped, like a pipe.
 static bool
-higher_precedence(enum oper a, enum oper b) {
-    struct Prec {
-        enum oper op;
-        int prec;
-    };
-    struct Prec p[] = {
-        {OP_TIMES, 13},
-        {OP_PLUS, 12},
-        {OP_MINUS, 12},
-        {OP_LESS, 10},
+read_whole_fd(int fd, struct File* file) {
+    size_t cap = 0x10000;
+    size_t size = 0;
+    char* buf = malloc(cap);
+    if (buf == NULL) {
+        perror("malloc");
+        return false;
+    }
+    for (;;) {
+        // Always keep one byte for the terminating '\0'.
+        if (cap - size < 2) {
+            char* p = realloc(buf, cap * 2);
+            if (p == NULL) {
+                perror("realloc");
+                free(buf);
+                return false;
+            }
+            buf = p;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + size, cap - size - 1);
+        if (n == 0) {
+            break;
+        }
+        if (n == -1) {
+            perror("read");
+            free(buf);
+            return false;
+        }
+        size += n;
+    }
+    buf[size] = '\0';
+    file->content = buf;
+    file->size = size;
+    return true;
+}
+
+// Loads a source file, or standard input if the name is "-".
+static bool
+load_file(const char* filename, struct File* file, enum FileLoad* how) {
+    bool is_stdin = filename[0] == '-' && filename[1] == '\0';
+    int fd = is_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open file %s\n", filename);
+        perror("open");
+        return false;
+    }
+    *file = (struct File){
+        .name = is_stdin ? "<stdin>" : filename,
     };
-    struct Prec pa, pb;
-    for (size_t i = 0; i < ARR_LEN(p); i++) {
-        if (p[i].op == a) {
-            pa = p[i];
-        } else if (p[i].op == b) {
-            pb = p[i];
+    struct stat st;
+    bool ok;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = mem != MAP_FAILED;
+        if (!ok) {
+            fprintf(stderr, "Could not map the source file to memory.\n");
+            perror("mmap");
         }
+        file->content = mem;
+        file->size = st.st_size;
+        *how = FILE_MAPPED;
+    } else {
+        ok = read_whole_fd(fd, file);
+        *how = FILE_READ;
+    }
+    if (!is_stdin) {
+        close(fd);
+    }
+    return ok;
+}
+
+static void
+unload_file(struct File* file, enum FileLoad how) {
+    switch (how) {
+    case FILE_MAPPED:
+        munmap(file->content, file->size);
+        break;
+    case FILE_READ:
+        free(file->content);
+        break;
+    }
+}
+
+#include "elf.c"
+
+static int
+precedence(enum oper op) {
+    switch (op) {
+    case OP_TIMES:  return 13;
+    case OP_PLUS:   return 12;
+    case OP_MINUS:  return 12;
+    case OP_LESS:   return 10;
     }
-    return pa.prec > pb.prec;
+    abort();
+}
+
+// Operators of the same precedence are left-associative.
+static bool
+higher_precedence(enum oper a, enum oper b) {
+    return precedence(a) > precedence(b);
 }
 
-static Ast*
+// The calls in the file being parsed.  Type is AstRef.
+static _Thread_local ChunkArray calls = {.elem_size = sizeof (AstRef)};
+
+static AstRef
 compile_expr(State* state) {
+    AstTree* t = state->tree;
     struct ExprFrame {
-        Ast* l;
+        AstRef l;
         enum oper op;
     };
-#define MAX_N_EXPR_FRAMES 10
-    struct ExprFrame expr_stack[MAX_N_EXPR_FRAMES];
+    // Kept between calls so that it only has to grow once.
+    static _Thread_local struct ExprFrame* expr_stack;
+    static _Thread_local size_t expr_stack_cap;
     size_t expr_stack_len = 0;
     struct ExprFrame* frame;  // The current (top) one.
 
-    Ast* return_ast = NULL;
+    AstRef return_ast = AST_NONE;
 
-    Ast* r1 = NULL;
+    AstRef r1 = AST_NONE;
     enum oper op;
     bool past_first_op = false;
-    Ast* r2 = NULL;
+    AstRef r2 = AST_NONE;
     enum oper latest_oper;
 
-    while (state->offset < state->file->size) {
-        Ast** r;
+    while (!at_eof(state)) {
+        AstRef* r;
+        Sym label;
         if (past_first_op) {
             r = &r2;
         } else {
             r = &r1;
         }
 
-        if (read_label(state, r)) {
+        if (read_label(state, &label)) {
             if (read_char(state, '(')) {
                 if (read_char(state, ')')) {
-                    Binding* b = get_binding(r[0]->label.name);
-                    *r = ast_new_call(b);
+                    *r = ast_new_call(t, label);
+                    *(AstRef*)chunk_array_add(&calls) = *r;
+                }
+            } else {
+                Binding* b = get_binding(label);
+                if (b == NULL) {
+                    state->offset = state->tokens[state->tok - 1].offset;
+                    print_error("Unknown variable", state);
                 }
+                *r = ast_new_label(t, label, b);
             }
         } else if (read_number(state, r)) {
         } else if (read_binop(state, &latest_oper)) {
             if (past_first_op) {
                 if (higher_precedence(latest_oper, op)) {
-                    assert(expr_stack_len < MAX_N_EXPR_FRAMES);
+                    if (expr_stack_len == expr_stack_cap) {
+                        expr_stack = grow_array(expr_stack, &expr_stack_cap,
+                                                sizeof *expr_stack);
+                    }
                     expr_stack[expr_stack_len] = (struct ExprFrame){
                         r1, op,
                     };
@@ -422,16 +770,16 @@ compile_expr(State* state) {
                     expr_stack_len++;
                     r1 = r2;
                 } else {
-                    r1 = ast_new_oper(r1, op, r2);
-                    op = latest_oper;
+                    // Everything on the left that binds at least as
+                    // tightly as the new operator is its left operand.
+                    r1 = ast_new_oper(t, r1, op, r2);
                     while (expr_stack_len > 0) {
                         frame = &expr_stack[expr_stack_len - 1];
-                        if (higher_precedence(op, frame->op)) {
+                        if (higher_precedence(latest_oper, frame->op)) {
                             break;
                         }
                         expr_stack_len--;
-                        r1 = ast_new_oper(frame->l, frame->op, r1);
-                        op = frame->op;
+                        r1 = ast_new_oper(t, frame->l, frame->op, r1);
                     }
                 }
             }
@@ -442,10 +790,10 @@ compile_expr(State* state) {
                 return_ast = r1;
                 break;
             }
-            r2 = ast_new_oper(r1, op, r2);
+            r2 = ast_new_oper(t, r1, op, r2);
             while (expr_stack_len > 0) {
                 frame = &expr_stack[expr_stack_len - 1];
-                r2 = ast_new_oper(frame->l, frame->op, r2);
+                r2 = ast_new_oper(t, frame->l, frame->op, r2);
                 expr_stack_len--;
             }
             return_ast = r2;
@@ -455,58 +803,181 @@ compile_expr(State* state) {
     return return_ast;
 }
 
-#define ast_for(a, list) \
-    for (const Ast* a = list.first; a; a = a->next)
-static Vreg*
-compile_ast_expr(const Ast* ast, Vreg* rd) {
-    switch (ast->type) {
-    case AST_NUM: {
-        Vreg* v = alloc_vreg();
-        v->state = VREG_STATIC;
-        v->val = ast;
+struct Jobs {
+    void (*fn)(void* ctx, size_t i);
+    void* ctx;
+    size_t n_jobs;
+    atomic_size_t next;
+};
+
+static void*
+jobs_worker(void* arg) {
+    struct Jobs* jobs = arg;
+    uint64_t start_ns = timing.on ? clock_ns(CLOCK_MONOTONIC) : 0;
+    size_t n_done = 0;
+    for (;;) {
+        size_t i = atomic_fetch_add(&jobs->next, 1);
+        if (i >= jobs->n_jobs) {
+            break;
+        }
+        jobs->fn(jobs->ctx, i);
+        n_done++;
+    }
+    trace_worker(start_ns, n_done);
+    mem_flush_allocated();
+    return NULL;
+}
+
+// A worker thread of its own.  Nothing it left in scratch_mem is needed
+// once it is done.
+static void*
+jobs_thread(void* arg) {
+    jobs_worker(arg);
+    mem_free(&scratch_mem);
+    return NULL;
+}
+
+// Calls fn(ctx, i) for every i below n_jobs, on as many threads as
+// there are cores.  The calling thread is one of the workers.
+static void
+run_parallel(size_t n_jobs, void (*fn)(void* ctx, size_t i), void* ctx) {
+    struct Jobs jobs = {
+        .fn = fn,
+        .ctx = ctx,
+        .n_jobs = n_jobs,
+    };
+    long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_threads = n_cores > 1 ? n_cores : 1;
+    if (n_threads > n_jobs) {
+        n_threads = n_jobs;
+    }
+    pthread_t* threads = calloc(n_threads, sizeof *threads);
+    size_t n_started = 0;
+    for (size_t i = 1; i < n_threads; i++) {
+        if (pthread_create(&threads[i], NULL, jobs_thread, &jobs) != 0) {
+            break;
+        }
+        n_started++;
+    }
+    jobs_worker(&jobs);
+    for (size_t i = 1; i <= n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// The function that is being lowered to IR on this thread.
+struct IrBuild {
+    IrFn* fn;
+    IrBlock* block;    // Where code goes, or NULL after exit or return.
+    IrInstr** defs;    // The value of each local variable, by fold_local.
+    Binding** vars;    // Each local variable.
+    const Type* ret_type;
+};
+
+static _Thread_local struct IrBuild irb;
+
+static IrInstr**
+copy_defs() {
+    IrInstr** copy = mem_alloc_array(&scratch_mem, IrInstr*, fold.n_vars);
+    memcpy(copy, irb.defs, fold.n_vars * sizeof *copy);
+    return copy;
+}
+
+// The type of an expression, or NULL for an untyped number.  The
+// operands of an operator have the same type, apart from numbers.
+static const Type*
+expr_type(const AstTree* t, AstRef ast) {
+    switch (ast_type(t, ast)) {
+    case AST_LABEL:
+    case AST_CALL:
+        return ast_name(t, ast)->binding->type;
+    case AST_OPER: {
+        const struct AstOper* oper = ast_oper(t, ast);
+        if (oper->oper == OP_LESS) {
+            return get_type(SYM_BOOL);
+        }
+        const Type* type = expr_type(t, oper->l);
+        return type ? type : expr_type(t, oper->r);
+    }
+    default:
+        return NULL;
+    }
+}
+
+// v wrapped to `type`.
+static IrInstr*
+compile_wrap(IrInstr* v, const Type* type) {
+    unsigned bits = type_wrap_bits(type);
+    if (bits == 0) {
         return v;
+    }
+    if (v->op == IR_CONST) {
+        return ir_add_const(irb.fn, irb.block,
+                            wrap_bits(v->imm, bits, type->is_signed));
+    }
+    return ir_add_ext(irb.fn, irb.block, type->is_signed ? IR_SEXT : IR_ZEXT,
+                      v, bits);
+}
+
+static IrInstr*
+compile_ast_expr(const AstTree* t, AstRef ast);
+
+// The value of the expression as a `type`.  A value of another type, or
+// an untyped number, is wrapped to it.
+static IrInstr*
+compile_ast_expr_as(const AstTree* t, AstRef ast, const Type* type) {
+    IrInstr* v = compile_ast_expr(t, ast);
+    return expr_type(t, ast) == type ? v : compile_wrap(v, type);
+}
+
+static IrInstr*
+compile_ast_expr(const AstTree* t, AstRef ast) {
+    if (fold_known(ast)) {
+        return ir_add_const(irb.fn, irb.block, fold_value(ast));
+    }
+    switch (ast_type(t, ast)) {
+    case AST_NUM: {
+        return ir_add_const(irb.fn, irb.block, ast_num(t, ast)->u);
     } break;
     case AST_LABEL: {
-        Vreg* v;
-        Binding* b = get_binding(ast->label.name);
-        if (b->last_vreg) {
-            v = b->last_vreg;
-            if (v->state == VREG_AST) {
-                v = compile_ast_expr(v->ast, alloc_vreg());
-            }
-        } else {
-            v = alloc_vreg();
-            v->state = VREG_USED;
-            v->binding = b;
+        Binding* b = ast_name(t, ast)->binding;
+        int32_t i = fold_local(b);
+        if (i >= 0) {
+            assert(irb.defs[i]);
+            return irb.defs[i];
         }
-        return v;
+        // Globals are compiled where they are used.
+        if (b->last_vreg == NULL || b->last_vreg->state != VREG_AST) {
+            abort();
+        }
+        return compile_ast_expr_as(t, b->last_vreg->ast, b->type);
     } break;
     case AST_CALL: {
-        Rv64Instr* call = rv64_add_call(&seg_text, ast->call.binding);
-        rv64_add_patch_addr_binding(&seg_text, call, ast->call.binding);
-        Vreg* v = alloc_this_reg(REG_A0);
-        return v;
+        return ir_add_call(irb.fn, irb.block, ast_name(t, ast)->binding);
     } break;
     case AST_OPER: {
-        const struct AstOper* oper = &ast->oper;
-        Vreg* l = compile_ast_expr(oper->l, alloc_vreg());
-        Vreg* r = compile_ast_expr(oper->r, alloc_vreg());
-        if (0 && l->state == VREG_STATIC && r->state == VREG_STATIC) {
-            l->val = ast;
-            free_vreg(r);
-            return l;
-        } else {
-            switch (oper->oper) {
-            case OP_PLUS: {
-                return rv64_add_add(&seg_text, rd, l, r);
-            } break;
-            case OP_MINUS: {
-                return rv64_add_sub(&seg_text, rd, l, r);
-            } break;
-            default:
-                abort();
-            }
+        static const enum IrOp ops[] = {
+            [OP_PLUS] = IR_ADD,
+            [OP_MINUS] = IR_SUB,
+            [OP_TIMES] = IR_MUL,
+            [OP_LESS] = IR_LT,
+        };
+        const struct AstOper* oper = ast_oper(t, ast);
+        enum IrOp op = ops[oper->oper];
+        const Type* type = expr_type(t, oper->l);
+        if (type == NULL) {
+            type = expr_type(t, oper->r);
         }
+        if (op == IR_LT && (type == NULL || !type->is_signed)) {
+            op = IR_LTU;
+        }
+        // A number next to a narrower operand is wrapped to its type
+        // first, and so is the result.
+        IrInstr* l = compile_ast_expr_as(t, oper->l, type);
+        IrInstr* r = compile_ast_expr_as(t, oper->r, type);
+        IrInstr* v = ir_add_op(irb.fn, irb.block, op, l, r);
+        return op == IR_LT || op == IR_LTU ? v : compile_wrap(v, type);
     } break;
     // These do not belong inside an expression.
     case AST_ROOT:
@@ -514,6 +985,7 @@ compile_ast_expr(const Ast* ast, Vreg* rd) {
     case AST_IF:
     case AST_WHILE:
     case AST_EXIT:
+    case AST_RET:
     case AST_ASSIGN:
     case AST_VAR:
         abort();
@@ -522,42 +994,141 @@ compile_ast_expr(const Ast* ast, Vreg* rd) {
 }
 
 static void
-compile_ast_block(const struct AstBlock* block) {
-    ast_for(b, block->children) {
-        switch (b->type) {
-        case AST_VAR: {
-            Vreg* r = compile_ast_expr(b->var.value, alloc_vreg());
-            b->var.binding->last_vreg = r;
-            add_assign(&seg_text, b->var.binding->last_vreg, r);
-        } break;
+compile_ast_block(const AstTree* t, const struct AstBlock* block);
+
+static void
+compile_ast_if(const AstTree* t, const struct AstBlock* blk) {
+    IrFn* fn = irb.fn;
+    if (fold_known(blk->head)) {
+        if (fold_value(blk->head)) {
+            compile_ast_block(t, blk);
+        }
+        return;
+    }
+    IrInstr* cond = compile_ast_expr(t, blk->head);
+    IrBlock* then = ir_new_block(fn);
+    IrBlock* join = ir_new_block(fn);
+    ir_add_branch(fn, irb.block, cond, then, join);
+    IrInstr** before = copy_defs();
+    ir_append_block(fn, then);
+    irb.block = then;
+    compile_ast_block(t, blk);
+    ir_append_block(fn, join);
+    if (irb.block == NULL) {
+        memcpy(irb.defs, before, fold.n_vars * sizeof *before);
+        irb.block = join;
+        return;
+    }
+    ir_add_jump(fn, irb.block, join);
+    // The variables that the block changed.  The ones it declared are
+    // gone after it.
+    for (uint32_t i = 0; i < fold.n_vars; i++) {
+        if (before[i] == NULL) {
+            irb.defs[i] = NULL;
+        } else if (before[i] != irb.defs[i]) {
+            IrInstr* phi = ir_add_phi(fn, join, irb.vars[i]);
+            ir_add_arg(fn, phi, before[i]);
+            ir_add_arg(fn, phi, irb.defs[i]);
+            irb.defs[i] = phi;
+        }
+    }
+    irb.block = join;
+}
+
+static void
+compile_ast_while(const AstTree* t, AstRef loop) {
+    IrFn* fn = irb.fn;
+    const struct AstBlock* blk = ast_block(t, loop);
+    bool known = fold_known(blk->head);
+    if (known && !fold_value(blk->head)) {
+        return;
+    }
+    IrBlock* head = ir_new_block(fn);
+    ir_add_jump(fn, irb.block, head);
+    ir_append_block(fn, head);
+    // A phi for every variable from outside that is assigned in the
+    // loop.  The ones that turn out to be the same all around are
+    // removed again.
+    IrInstr** phis = mem_alloc_zero(&scratch_mem,
+                                    fold.n_vars * sizeof (IrInstr*),
+                                    _Alignof(IrInstr*));
+    for (AstRef a = blk->first; a < loop; a++) {
+        if (ast_type(t, a) != AST_ASSIGN) {
+            continue;
+        }
+        int32_t i = fold_local(ast_var(t, a)->binding);
+        if (i >= 0 && irb.defs[i] && phis[i] == NULL) {
+            phis[i] = ir_add_phi(fn, head, irb.vars[i]);
+            ir_add_arg(fn, phis[i], irb.defs[i]);
+            irb.defs[i] = phis[i];
+        }
+    }
+    irb.block = head;
+    IrBlock* exit = NULL;
+    if (!known) {
+        IrInstr* cond = compile_ast_expr(t, blk->head);
+        IrBlock* body = ir_new_block(fn);
+        exit = ir_new_block(fn);
+        ir_add_branch(fn, irb.block, cond, body, exit);
+        ir_append_block(fn, body);
+        irb.block = body;
+    }
+    IrInstr** at_head = copy_defs();
+    compile_ast_block(t, blk);
+    if (irb.block) {
+        ir_add_jump(fn, irb.block, head);
+        for (uint32_t i = 0; i < fold.n_vars; i++) {
+            if (phis[i]) {
+                ir_add_arg(fn, phis[i], irb.defs[i]);
+            }
+        }
+    }
+    for (uint32_t i = 0; i < fold.n_vars; i++) {
+        if (phis[i] && phis[i]->block) {
+            ir_try_remove_trivial_phi(fn, phis[i]);
+        }
+    }
+    // The loop is left from its start, with the values there.
+    for (uint32_t i = 0; i < fold.n_vars; i++) {
+        irb.defs[i] = at_head[i] ? ir_resolve(at_head[i]) : NULL;
+    }
+    if (exit) {
+        ir_append_block(fn, exit);
+    }
+    irb.block = exit;
+}
+
+static void
+compile_ast_block(const AstTree* t, const struct AstBlock* block) {
+    ast_for_children(b, t, block) {
+        if (irb.block == NULL || !fold_reachable(b)) {
+            break;
+        }
+        switch (ast_type(t, b)) {
+        case AST_VAR:
         case AST_ASSIGN: {
-            Vreg* r = compile_ast_expr(b->assign.val, alloc_vreg());
-            rv64_add_add(&seg_text, b->assign.binding->last_vreg, get_vreg_zero(), r);
+            const struct AstVar* var = ast_var(t, b);
+            IrInstr* v = compile_ast_expr_as(t, var->val, var->binding->type);
+            // The parser only lets local variables be assigned to.
+            int32_t i = fold_local(var->binding);
+            assert(i >= 0);
+            irb.defs[i] = v;
         } break;
         case AST_IF: {
-            Vreg* r = compile_ast_expr(b->if_block.head, alloc_vreg());
-            Rv64Instr* branch_instr = rv64_add_beqz(&seg_text, r);
-            compile_ast_block(&b->if_block.block);
-            Rv64Instr* after_instr = &vinstrs[n_vinstrs];
-            rv64_add_patch_addr(&seg_text, branch_instr, after_instr);
+            compile_ast_if(t, ast_block(t, b));
         } break;
         case AST_WHILE: {
-            Rv64Instr* first_instr = &vinstrs[n_vinstrs];
-            Vreg* r = compile_ast_expr(b->while_block.head, alloc_vreg());
-            Rv64Instr* branch_instr = rv64_add_beqz(&seg_text, r);
-            compile_ast_block(&b->while_block.block);
-            Rv64Instr* jump_instr = rv64_add_jump(&seg_text);
-            Rv64Instr* after_instr = &vinstrs[n_vinstrs];
-            rv64_add_patch_addr(&seg_text, branch_instr, after_instr);
-            rv64_add_patch_addr(&seg_text, jump_instr, first_instr);
+            compile_ast_while(t, b);
         } break;
         case AST_EXIT: {
-            Vreg* r = compile_ast_expr(b->exit.val, alloc_vreg());
-            rv64_add_exit(&seg_text, r);
+            IrInstr* v = compile_ast_expr(t, ast_val(t, b));
+            ir_add_exit(irb.fn, irb.block, v);
+            irb.block = NULL;
         } break;
         case AST_RET: {
-            Vreg* r = compile_ast_expr(b->exit.val, alloc_vreg());
-            rv64_add_ret_val(&seg_text, r);
+            IrInstr* v = compile_ast_expr_as(t, ast_val(t, b), irb.ret_type);
+            ir_add_ret(irb.fn, irb.block, v);
+            irb.block = NULL;
         } break;
         // These do not belong inside a code block.
         case AST_ROOT:
@@ -572,269 +1143,1167 @@ compile_ast_block(const struct AstBlock* block) {
     }
 }
 
-static void
-compile_ast_fn(const struct AstFn* fn) {
-    add_function_start(&seg_text, fn->name);
-    compile_ast_block(&fn->block);
-    rv64_add_ret_void(&seg_text);
+// Lowers the function to IR in `mem`.  What is only needed while
+// lowering is in scratch_mem.
+static IrFn*
+compile_ast_fn(const AstTree* t, AstRef fn, Mem* mem) {
+    const struct AstBlock* blk = ast_block(t, fn);
+    fold_fn(t, fn);
+    irb = (struct IrBuild){
+        .fn = ir_new_fn(mem, blk->name),
+        .defs = mem_alloc_zero(&scratch_mem,
+                               fold.n_vars * sizeof (IrInstr*),
+                               _Alignof(IrInstr*)),
+        .vars = mem_alloc_array(&scratch_mem, Binding*, fold.n_vars),
+        .ret_type = blk->name->type,
+    };
+    for (AstRef a = blk->first; a < fn; a++) {
+        if (ast_type(t, a) == AST_VAR) {
+            Binding* b = ast_var(t, a)->binding;
+            irb.vars[fold_local(b)] = b;
+        }
+    }
+    irb.block = ir_new_block(irb.fn);
+    ir_append_block(irb.fn, irb.block);
+    compile_ast_block(t, blk);
+    if (irb.block) {
+        ir_add_ret(irb.fn, irb.block, NULL);
+    }
+    return irb.fn;
 }
 
-static void
-compile_ast_root(const Ast* root) {
-    ast_for(a, root->root.children) {
-        switch (a->type) {
-        case AST_FN: {
-            compile_ast_fn(&a->fn_block);
-        } break;
-        // These do not belong in the root.
-        case AST_ROOT:
-        case AST_NUM:
-        case AST_LABEL:
-        case AST_OPER:
-        case AST_IF:
-        case AST_WHILE:
-        case AST_EXIT:
-        case AST_ASSIGN:
-            abort();
-            break;
+// Instruction selection.
+
+// A jump or branch to patch once the function is done, and a pointer
+// to where its target is filled in.
+struct Patch {
+    Rv64Instr* instr;
+    Rv64Instr** target;
+};
+
+static _Thread_local struct Patch* sel_patches;
+static _Thread_local uint32_t n_sel_patches;
+static _Thread_local uint32_t cap_sel_patches;
+
+static void
+select_patch(Rv64Instr* instr, Rv64Instr** target) {
+    if (n_sel_patches == cap_sel_patches) {
+        sel_patches = ir_grow_array(&scratch_mem, sel_patches,
+                                    &cap_sel_patches, sizeof *sel_patches);
+    }
+    sel_patches[n_sel_patches] = (struct Patch){instr, target};
+    n_sel_patches++;
+}
+
+static Vreg*
+select_vreg(IrInstr* i) {
+    return ir_has_value(i) ? ir_home(i)->vreg : i->vreg;
+}
+
+// Whether nothing that gives any code comes between the value and its
+// only use, and it shares its register with nothing.
+static bool
+used_right_after(const IrInstr* i) {
+    if (i->home != i || i->next_home || i->uses == NULL
+        || i->uses->next) {
+        return false;
+    }
+    const IrInstr* next = i->next;
+    while (next->op == IR_CONST) {
+        next = next->next;
+    }
+    return i->uses->user == next;
+}
+
+// Whether a call can leave its value in a0.
+static bool
+select_in_a0(const IrInstr* call) {
+    return used_right_after(call);
+}
+
+static void
+select_copy(Vreg* dest, Vreg* src) {
+    if (src->state == VREG_STATIC) {
+        rv64_add_li(&seg_text, dest, src->val);
+    } else {
+        rv64_add_add(&seg_text, dest, get_vreg_zero(), src);
+    }
+}
+
+// The operand of a return or exit.  It is put in a0 there, so it gets
+// a register of its own unless it is only used right there.
+static Vreg*
+select_result(const IrInstr* i) {
+    IrInstr* val = ir_arg(i, 0);
+    Vreg* v = select_vreg(val);
+    if (v->state == VREG_STATIC || v->state == VREG_EXACT
+        || used_right_after(val)) {
+        return v;
+    }
+    Vreg* copy = alloc_vreg();
+    select_copy(copy, v);
+    return copy;
+}
+
+static uint32_t
+pred_index(const IrBlock* b, const IrBlock* pred) {
+    uint32_t p = 0;
+    while (b->preds[p] != pred) {
+        p++;
+    }
+    return p;
+}
+
+// Whether anything has to be copied for the phis of `to` when coming
+// from `from`.
+static bool
+edge_has_copies(IrBlock* from, IrBlock* to) {
+    uint32_t p = pred_index(to, from);
+    for (IrInstr* phi = to->first; phi && phi->op == IR_PHI;
+         phi = phi->next) {
+        if (select_vreg(ir_arg(phi, p)) != select_vreg(phi)) {
+            return true;
         }
     }
+    return false;
 }
-#undef ast_for
 
-// Decide the location of vregs.
+// The copies for the phis of `to` when coming from `from`.  They are
+// done as if all at the same time, so a value that is copied from is
+// not written before it is read.
 static void
-determine_vregs() {
-    for (size_t i = 0; i < n_vinstrs; i++) {
-        Rv64Instr *instr = &vinstrs[i];
-        switch (instr->type) {
-        case RV64_R:
-            if (instr->r.rs1->state == VREG_USED) {
-                abort();
+select_edge_copies(IrBlock* from, IrBlock* to) {
+    uint32_t p = pred_index(to, from);
+    uint32_t n = 0;
+    for (IrInstr* phi = to->first; phi && phi->op == IR_PHI;
+         phi = phi->next) {
+        n++;
+    }
+    Vreg** dests = mem_alloc_array(&scratch_mem, Vreg*, n);
+    Vreg** srcs = mem_alloc_array(&scratch_mem, Vreg*, n);
+    n = 0;
+    for (IrInstr* phi = to->first; phi && phi->op == IR_PHI;
+         phi = phi->next) {
+        Vreg* src = select_vreg(ir_arg(phi, p));
+        if (src != select_vreg(phi)) {
+            dests[n] = select_vreg(phi);
+            srcs[n] = src;
+            n++;
+        }
+    }
+    while (n > 0) {
+        // A copy whose destination no other copy reads, or else a
+        // cycle, which is broken with a temporary.
+        uint32_t c = 0;
+        for (; c < n; c++) {
+            uint32_t j = 0;
+            while (j < n && (j == c || srcs[j] != dests[c])) {
+                j++;
             }
-            if (instr->r.rs2->state == VREG_USED) {
-                abort();
+            if (j == n) {
+                break;
+            }
+        }
+        if (c == n) {
+            Vreg* tmp = alloc_vreg();
+            select_copy(tmp, dests[0]);
+            for (uint32_t j = 0; j < n; j++) {
+                if (srcs[j] == dests[0]) {
+                    srcs[j] = tmp;
+                }
+            }
+            continue;
+        }
+        select_copy(dests[c], srcs[c]);
+        n--;
+        dests[c] = dests[n];
+        srcs[c] = srcs[n];
+    }
+}
+
+// Where the edge from `from` to its successor s goes.  Copies that can
+// not go at the end of `from` or the start of the successor get a
+// block of their own, right before the successor.
+static bool
+edge_needs_stub(IrBlock* from, uint32_t s) {
+    IrBlock* to = from->succs[s];
+    return from->n_succs > 1 && to->n_preds > 1 && edge_has_copies(from, to);
+}
+
+// The stubs that go before block b, as the predecessor and successor
+// index of each.
+static uint32_t
+block_stubs(IrBlock* b, IrBlock** stub_from, uint32_t* stub_succ) {
+    uint32_t n = 0;
+    for (uint32_t p = 0; p < b->n_preds; p++) {
+        IrBlock* pred = b->preds[p];
+        for (uint32_t s = 0; s < pred->n_succs; s++) {
+            if (pred->succs[s] == b && edge_needs_stub(pred, s)) {
+                stub_from[n] = pred;
+                stub_succ[n] = s;
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+// x * c with shifts where ir_mul_by_shifts says so.
+static void
+select_mul(IrInstr* i) {
+    IrInstr* x = ir_arg(i, 0);
+    IrInstr* c = ir_arg(i, 1);
+    if (x->op == IR_CONST) {
+        IrInstr* t = x;
+        x = c;
+        c = t;
+    }
+    Vreg* d = select_vreg(i);
+    Vreg* xv = select_vreg(x);
+    if (c->op != IR_CONST || !ir_mul_by_shifts(c->imm)) {
+        rv64_add_mul(&seg_text, d, xv, select_vreg(c));
+        return;
+    }
+    uint64_t n = c->imm;
+    if (n == 0) {
+        rv64_add_li(&seg_text, d, 0);
+    } else if (n == 1) {
+        select_copy(d, xv);
+    } else if ((n & (n - 1)) == 0) {
+        rv64_add_slli(&seg_text, d, xv, __builtin_ctzll(n));
+    } else if ((-n & (-n - 1)) == 0) {
+        Vreg* t = rv64_add_slli(&seg_text, alloc_vreg(), xv,
+                                __builtin_ctzll(-n));
+        rv64_add_sub(&seg_text, d, get_vreg_zero(), t);
+    } else {
+        // 2^a + 2^b or 2^a - 2^b, with b the lowest bit.
+        unsigned b = __builtin_ctzll(n);
+        uint64_t low = (uint64_t)1 << b;
+        bool plus = ((n - low) & (n - low - 1)) == 0;
+        uint64_t high = plus ? n - low : n + low;
+        Vreg* h = rv64_add_slli(&seg_text, alloc_vreg(), xv,
+                                __builtin_ctzll(high));
+        Vreg* l = b ? rv64_add_slli(&seg_text, alloc_vreg(), xv, b) : xv;
+        if (plus) {
+            rv64_add_add(&seg_text, d, h, l);
+        } else {
+            rv64_add_sub(&seg_text, d, h, l);
+        }
+    }
+}
+
+// slt or sltu, or slti or sltiu when the right side is a constant that
+// fits.
+static void
+select_less(IrInstr* i) {
+    bool is_signed = i->op == IR_LT;
+    IrInstr* l = ir_arg(i, 0);
+    IrInstr* r = ir_arg(i, 1);
+    if (r->op == IR_CONST && ir_fits_imm12(r->imm)) {
+        rv64_add_slti(&seg_text, select_vreg(i), select_vreg(l), r->imm,
+                      is_signed);
+    } else {
+        rv64_add_slt(&seg_text, select_vreg(i), select_vreg(l),
+                     select_vreg(r), is_signed);
+    }
+}
+
+// Adds a jump to `target` unless it is what comes next.
+static void
+select_jump(Rv64Instr** target, Rv64Instr** next) {
+    if (target != next) {
+        select_patch(rv64_add_jump(&seg_text), target);
+    }
+}
+
+static void
+select_instrs(IrFn* fn) {
+    ir_compute_doms(fn);
+    ir_coalesce(fn);
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        for (IrInstr* i = fn->blocks[bi]->first; i; i = i->next) {
+            if (i->op == IR_CONST && !i->in_reg) {
+                i->vreg = alloc_vreg();
+                i->vreg->state = VREG_STATIC;
+                i->vreg->val = i->imm;
+            } else if (i->op == IR_CALL && select_in_a0(i)) {
+                i->vreg = alloc_this_reg(REG_A0);
+            } else if (ir_has_value(i) && i->home == i) {
+                i->vreg = alloc_vreg();
+            }
+        }
+    }
+    // Where each block and stub starts, and which comes after which.
+    Rv64Instr** stub_starts = mem_alloc_zero(
+        &scratch_mem, 2 * fn->n_ids * sizeof (Rv64Instr*),
+        _Alignof(Rv64Instr*));
+    IrBlock** stub_from = mem_alloc_array(&scratch_mem, IrBlock*, 2 * fn->n_ids);
+    uint32_t* stub_succ = mem_alloc_array(&scratch_mem, uint32_t, 2 * fn->n_ids);
+    n_sel_patches = 0;
+    cap_sel_patches = 0;
+    sel_patches = NULL;
+    add_function_start(&seg_text, fn->name);
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        IrBlock* b = fn->blocks[bi];
+        uint32_t n_stubs = block_stubs(b, stub_from, stub_succ);
+        for (uint32_t k = 0; k < n_stubs; k++) {
+            Rv64Instr** start =
+                &stub_starts[2 * stub_from[k]->id + stub_succ[k]];
+            *start = next_vinstr();
+            select_edge_copies(stub_from[k], b);
+            if (k + 1 < n_stubs) {
+                select_jump(&b->start, NULL);
+            }
+        }
+        b->start = next_vinstr();
+        if (b->n_preds == 1 && b->preds[0]->n_succs > 1) {
+            select_edge_copies(b->preds[0], b);
+        }
+        // What comes after this block.
+        Rv64Instr** next = NULL;
+        if (bi + 1 < fn->n_blocks) {
+            IrBlock* nb = fn->blocks[bi + 1];
+            if (block_stubs(nb, stub_from, stub_succ)) {
+                next = &stub_starts[2 * stub_from[0]->id + stub_succ[0]];
+            } else {
+                next = &nb->start;
+            }
+        }
+        for (IrInstr* i = b->first; i; i = i->next) {
+            switch (i->op) {
+            case IR_CONST:
+                if (i->in_reg) {
+                    rv64_add_li(&seg_text, select_vreg(i), i->imm);
+                }
+                break;
+            case IR_PHI:
+                break;
+            case IR_ADD:
+                rv64_add_add(&seg_text, select_vreg(i),
+                             select_vreg(ir_arg(i, 0)),
+                             select_vreg(ir_arg(i, 1)));
+                break;
+            case IR_SUB:
+                rv64_add_sub(&seg_text, select_vreg(i),
+                             select_vreg(ir_arg(i, 0)),
+                             select_vreg(ir_arg(i, 1)));
+                break;
+            case IR_MUL:
+                select_mul(i);
+                break;
+            case IR_LT:
+            case IR_LTU:
+                select_less(i);
+                break;
+            case IR_SEXT:
+            case IR_ZEXT: {
+                // Shifted up to the top and back down.
+                Vreg* d = select_vreg(i);
+                rv64_add_slli(&seg_text, d, select_vreg(ir_arg(i, 0)),
+                              64 - i->imm);
+                rv64_add_srli(&seg_text, d, d, 64 - i->imm,
+                              i->op == IR_SEXT);
+            } break;
+            case IR_CALL: {
+                if (ir_tail_call(b->last) == i) {
+                    // The callee returns to where this function would.
+                    rv64_add_fn_leave(&seg_text);
+                    Rv64Instr* jump = rv64_add_jump(&seg_text);
+                    rv64_add_patch_addr_binding(&seg_text, jump, i->binding);
+                    break;
+                }
+                Rv64Instr* call = rv64_add_call(&seg_text, i->binding);
+                rv64_add_patch_addr_binding(&seg_text, call, i->binding);
+                if (!select_in_a0(i)) {
+                    rv64_add_add(&seg_text, select_vreg(i), get_vreg_zero(),
+                                 alloc_this_reg(REG_A0));
+                }
+            } break;
+            case IR_JUMP:
+                if (b->succs[0]->n_preds > 1) {
+                    select_edge_copies(b, b->succs[0]);
+                }
+                select_jump(&b->succs[0]->start, next);
+                break;
+            case IR_BRANCH: {
+                Rv64Instr** targets[2];
+                for (uint32_t s = 0; s < 2; s++) {
+                    targets[s] = edge_needs_stub(b, s)
+                                 ? &stub_starts[2 * b->id + s]
+                                 : &b->succs[s]->start;
+                }
+                Vreg* cond = select_vreg(ir_arg(i, 0));
+                if (cond->state == VREG_STATIC) {
+                    select_jump(targets[cond->val ? 0 : 1], next);
+                    break;
+                }
+                select_patch(rv64_add_beqz(&seg_text, cond), targets[1]);
+                select_jump(targets[0], next);
+            } break;
+            case IR_RET:
+                if (ir_tail_call(i)) {
+                    break;
+                } else if (i->n_args) {
+                    rv64_add_ret_val(&seg_text, select_result(i));
+                } else {
+                    rv64_add_ret_void(&seg_text);
+                }
+                break;
+            case IR_EXIT:
+                rv64_add_exit(&seg_text, select_result(i));
+                break;
             }
-            if (instr->r.rd->state == VREG_USED) {
-                enum reg reg = use_free_reg();
-                vreg_set_state_exact(instr->r.rd, reg);
+        }
+    }
+    for (uint32_t i = 0; i < n_sel_patches; i++) {
+        rv64_add_patch_addr(&seg_text, sel_patches[i].instr,
+                            *sel_patches[i].target);
+    }
+}
+
+// The code of one function.  Functions are lowered and encoded on
+// their own, possibly in parallel, and linked together at the end.
+struct FnCode {
+    const AstTree* tree;
+    AstRef fn;
+    Binding* name;
+    ChunkArray vinstrs;
+    ChunkArray postinstrs;
+    ChunkArray vregs;
+    Segment text;
+
+    uint64_t key;                // For the cache.
+    struct CacheEntry* cached;   // Its entry in the cache, or NULL.
+    bool hit;                    // The cached entry is used.
+    char* ir_dump;               // For --dump=ir, or NULL.
+    char* inline_report;         // For --inline-report, or NULL.
+    uint64_t ast_key;            // The part of `key` from its own AST.
+
+    // For inlining into callers, see want_inline_callees.
+    int inline_depth;            // How deep in calls it is inlined.
+    uint32_t inline_size;        // Of inline_ir, or INLINE_UNKNOWN.
+    const IrFn* inline_ir;       // Or NULL if it is too big.
+};
+
+// Inlining.  A call is replaced by a copy of the callee when the callee
+// is no bigger than the call, or when it is small and the caller has
+// not grown by more than its budget yet.  Calls that come with a copy
+// are looked at in the next round.  A function is never inlined into
+// itself.
+#define INLINE_ALWAYS 4    // Instructions, about what a call takes.
+#define INLINE_MAX 24
+#define INLINE_BUDGET 64   // Growth of a caller smaller than this.
+#define INLINE_ROUNDS 3
+
+// Functions with more AST nodes than this are not looked at.  Folding
+// can leave little of a function, so it is far above INLINE_MAX.
+#define INLINE_MAX_AST 2048
+#define INLINE_UNKNOWN UINT32_MAX
+
+// The IR of callees, optimized on its own.  It stays until the end, as
+// callers on any thread may copy it.
+static _Thread_local Mem inline_mem;
+
+static bool
+inline_too_big(const struct FnCode* fc) {
+    return fc->fn - ast_block(fc->tree, fc->fn)->first > INLINE_MAX_AST;
+}
+
+// Sets inline_depth of the functions that fc calls, and of the ones
+// they call as deep as calls are inlined, so their IR is made once
+// before the callers are lowered.
+static void
+want_inline_callees(const struct FnCode* fc, int depth) {
+    const AstTree* t = fc->tree;
+    for (AstRef a = ast_block(t, fc->fn)->first; a < fc->fn; a++) {
+        if (ast_type(t, a) != AST_CALL) {
+            continue;
+        }
+        struct FnCode* callee = ast_name(t, a)->binding->code;
+        if (callee->inline_depth >= depth) {
+            continue;
+        }
+        callee->inline_depth = depth;
+        if (depth > 1 && !inline_too_big(callee)) {
+            want_inline_callees(callee, depth - 1);
+        }
+    }
+}
+
+static void
+inline_ir_job(void* fns, size_t i) {
+    struct FnCode* fc = &((struct FnCode*)fns)[i];
+    fc->inline_size = INLINE_UNKNOWN;
+    if (fc->inline_depth == 0 || inline_too_big(fc)) {
+        return;
+    }
+    MemMark scratch = mem_mark(&scratch_mem);
+    MemMark mark = mem_mark(&inline_mem);
+    IrFn* ir = compile_ast_fn(fc->tree, fc->fn, &inline_mem);
+    ir_check(ir, "build");
+    ir_optimize(ir);
+    fc->inline_size = ir_code_size(ir);
+    if (fc->inline_size <= INLINE_MAX) {
+        fc->inline_ir = ir;
+    } else {
+        mem_release(&inline_mem, mark);
+    }
+    mem_release(&scratch_mem, scratch);
+}
+
+// Writes the decisions to `report` if it is not NULL.
+static void
+inline_calls(IrFn* fn, FILE* report) {
+    uint32_t size = ir_code_size(fn);
+    uint32_t budget = size > INLINE_BUDGET ? size : INLINE_BUDGET;
+    uint32_t grown = 0;
+    Str caller = sym_str(fn->name->name);
+    // Instructions from this id on are new since the last round.
+    uint32_t first_new = 0;
+    for (int round = 0; round < INLINE_ROUNDS; round++) {
+        // Inlining changes the blocks, so the calls are found first.
+        uint32_t n_calls = 0;
+        for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+            for (IrInstr* i = fn->blocks[bi]->first; i; i = i->next) {
+                n_calls += i->op == IR_CALL && i->id >= first_new;
             }
+        }
+        if (n_calls == 0) {
             break;
-        case RV64_RI64:
-            if (instr->ri64.rd->state != VREG_USED) {
+        }
+        IrInstr** calls = mem_alloc_array(&scratch_mem, IrInstr*, n_calls);
+        n_calls = 0;
+        for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+            for (IrInstr* i = fn->blocks[bi]->first; i; i = i->next) {
+                if (i->op == IR_CALL && i->id >= first_new) {
+                    calls[n_calls] = i;
+                    n_calls++;
+                }
+            }
+        }
+        first_new = fn->n_ids;
+        for (uint32_t c = 0; c < n_calls; c++) {
+            const Binding* b = calls[c]->binding;
+            Str callee = sym_str(b->name);
+            if (report) {
+                fprintf(report, "%.*s: call to %.*s: ", (int)caller.len,
+                        caller.data, (int)callee.len, callee.data);
+            }
+            if (b == fn->name) {
+                if (report) {
+                    fprintf(report, "kept, recursive\n");
+                }
                 continue;
             }
-            fprintf(stderr, "RV64_RI64 rd:%d, imm:%ld\n", instr->ri64.rd->state, instr->ri64.imm);
-            enum reg reg = use_free_reg();
-            vreg_set_state_exact(instr->ri64.rd, reg);
-            break;
+            const struct FnCode* ce = b->code;
+            if (ce->inline_size == INLINE_UNKNOWN) {
+                if (report) {
+                    fprintf(report, "kept, over %u AST nodes\n",
+                            INLINE_MAX_AST);
+                }
+                continue;
+            }
+            if (ce->inline_size > INLINE_MAX) {
+                if (report) {
+                    fprintf(report, "kept, size %u is over %u\n",
+                            ce->inline_size, INLINE_MAX);
+                }
+                continue;
+            }
+            if (ce->inline_size > INLINE_ALWAYS
+                && grown + ce->inline_size > budget) {
+                if (report) {
+                    fprintf(report, "kept, size %u is over the budget, "
+                            "%u of %u left\n", ce->inline_size,
+                            budget - grown, budget);
+                }
+                continue;
+            }
+            if (report) {
+                fprintf(report, "inlined, size %u\n", ce->inline_size);
+            }
+            ir_inline_call(fn, calls[c], ce->inline_ir);
+            grown += ce->inline_size;
         }
+        ir_remove_unreachable(fn);
+        ir_check(fn, "inline");
     }
 }
 
 static void
-compile_instrs() {
-    for (size_t i = 0; i < n_vinstrs; i++) {
-        Rv64Instr *instr = &vinstrs[i];
-        instr->offset = seg_text.len;
+lower_fn_job(void* fns, size_t i) {
+    struct FnCode* fc = &((struct FnCode*)fns)[i];
+    vinstrs = (ChunkArray){.elem_size = sizeof (Rv64Instr), .mem = &fn_mem};
+    postinstrs = (ChunkArray){.elem_size = sizeof (Rv64Instr), .mem = &fn_mem};
+    reset_vregs();
+    MemMark mark = mem_mark(&scratch_mem);
+    IrFn* fn = compile_ast_fn(fc->tree, fc->fn, &scratch_mem);
+    ir_check(fn, "build");
+    FILE* report = NULL;
+    if (options.inline_report) {
+        free(fc->inline_report);
+        size_t size;
+        report = open_memstream(&fc->inline_report, &size);
+        if (report == NULL) {
+            perror("open_memstream");
+            abort();
+        }
+    }
+    inline_calls(fn, report);
+    if (report) {
+        fclose(report);
+    }
+    ir_optimize(fn);
+    if (dumping(DUMP_IR)) {
+        // A function whose cache entry turns out not to fit is
+        // lowered again.
+        free(fc->ir_dump);
+        size_t size;
+        FILE* f = open_memstream(&fc->ir_dump, &size);
+        if (f == NULL) {
+            perror("open_memstream");
+            abort();
+        }
+        ir_print_fn(f, fn);
+        fclose(f);
+    }
+    select_instrs(fn);
+    mem_release(&scratch_mem, mark);
+    fc->vinstrs = vinstrs;
+    fc->postinstrs = postinstrs;
+    fc->vregs = vregs;
+}
+
+// What parsing one file results in.
+struct ParsedFile {
+    struct File* file;
+    AstTree tree;
+    ChunkArray bindings;
+    ChunkArray calls;
+    bool ok;    // False if an error was reported.
+};
+
+// Returns the functions of all files in source order.
+static struct FnCode*
+compile_ast_root(const struct ParsedFile* files, size_t n_files,
+                 size_t* n_fns) {
+    size_t n = 0;
+    for (size_t i = 0; i < n_files; i++) {
+        const AstTree* t = &files[i].tree;
+        if (t->root != AST_NONE) {
+            n += ast_block(t, t->root)->n_children;
+        }
+    }
+    struct FnCode* fns = mem_alloc_zero(&default_mem, n * sizeof *fns,
+                                        _Alignof(struct FnCode));
+    n = 0;
+    for (size_t i = 0; i < n_files; i++) {
+        const AstTree* t = &files[i].tree;
+        if (t->root == AST_NONE) {
+            continue;
+        }
+        ast_for_children(a, t, ast_block(t, t->root)) {
+            switch (ast_type(t, a)) {
+            case AST_FN: {
+                fns[n].tree = t;
+                fns[n].fn = a;
+                fns[n].name = ast_block(t, a)->name;
+                fns[n].name->code = &fns[n];
+                n++;
+            } break;
+            // Compiled where they are used.
+            case AST_VAR:
+                break;
+            // Not compiled.
+            case AST_RET:
+            case AST_CALL:
+                break;
+            // These do not belong in the root.
+            case AST_ROOT:
+            case AST_NUM:
+            case AST_LABEL:
+            case AST_OPER:
+            case AST_IF:
+            case AST_WHILE:
+            case AST_EXIT:
+            case AST_ASSIGN:
+                abort();
+                break;
+            }
+        }
+    }
+    *n_fns = n;
+    return fns;
+}
+
+#include "regalloc.c"
+
+static void
+rv64_encode_instr(Segment* text, Rv64Instr* instr) {
+    switch (instr->type) {
+    case RV64_R:
+        assert(instr->r.rd->state == VREG_EXACT);
+        assert(instr->r.rs1->state == VREG_EXACT);
+        assert(instr->r.rs2->state == VREG_EXACT);
+        instr->r.fn(text,
+                    instr->r.rd->reg,
+                    instr->r.rs1->reg,
+                    instr->r.rs2->reg);
+        break;
+    case RV64_I:
+        assert(instr->i.rd->state == VREG_EXACT);
+        assert(instr->i.rs1->state == VREG_EXACT);
+        instr->i.fn(text,
+                    instr->i.rd->reg,
+                    instr->i.rs1->reg,
+                    instr->i.imm);
+        break;
+    case RV64_RI64:
+        assert(instr->ri64.rd->state == VREG_EXACT);
+        instr->ri64.fn(text,
+                       instr->ri64.rd->reg,
+                       instr->ri64.imm);
+        break;
+    case RV64_B:
+        assert(instr->b.rs1->state == VREG_EXACT);
+        assert(instr->b.rs2->state == VREG_EXACT);
+        instr->b.fn(text,
+                    instr->b.rs1->reg,
+                    instr->b.rs2->reg,
+                    instr->b.imm);
+        break;
+    case RV64_S:
+        assert(instr->s.rs1->state == VREG_EXACT);
+        assert(instr->s.rs2->state == VREG_EXACT);
+        instr->s.fn(text,
+                    instr->s.rs1->reg,
+                    instr->s.rs2->reg,
+                    instr->s.imm);
+        break;
+    case RV64_J:
+        instr->j.fn(text, instr->j.imm);
+        break;
+    case RV64_NONE:
+        instr->none.fn(text);
+        break;
+    case ASSIGN: {
+        Vreg* rs = instr->assign.val;
+        Vreg* rd = instr->assign.dest;
+        assert(rd->state == VREG_EXACT);
+        if (rs->state == VREG_STATIC) {
+            rv64_write_li(text, rd->reg, rs->val);
+        } else if (rs->state == VREG_EXACT) {
+            assert(rs->reg == rd->reg);
+        }
+    } break;
+    case PATCH:
+        rv64_patch(text, instr->patch.instr, instr->patch.target->offset);
+        break;
+    default:
+        break;
+    }
+}
+
+// Encodes the instructions of one function into its own text.
+static void
+compile_instrs(struct FnCode* fc) {
+    size_t max_size = options.target == TARGET_X86_64 ? X86_MAX_INSTR_SIZE
+                                                      : RV64_MAX_INSTR_SIZE;
+    init_seg_mem(&fc->text, ".text",
+                 fc->vinstrs.len * max_size + 1, &fn_mem);
+    seg_reserve(&fc->text, fc->vinstrs.len * max_size);
+    for (size_t i = 0; i < fc->vinstrs.len; i++) {
+        Rv64Instr *instr = chunk_array_at(&fc->vinstrs, i);
+        instr->offset = fc->text.len;
+        if (instr->type == FN_START) {
+            vreg_set_state_mem_addr(instr->fn_start.binding->last_vreg,
+                                    &fc->text, fc->text.len);
+        } else if (options.target == TARGET_X86_64) {
+            x86_encode_instr(&fc->text, instr);
+        } else {
+            rv64_encode_instr(&fc->text, instr);
+        }
+    }
+}
+
+// Patches a jump, branch or call to go to target.
+static void
+patch_instr(Segment* seg, Rv64Instr* instr, size_t target) {
+    if (options.target == TARGET_X86_64) {
+        x86_patch(seg, instr, target);
+    } else {
+        rv64_patch(seg, instr, target);
+    }
+}
+
+// The instructions of a compiled function, with their offsets in its
+// text.
+static void
+print_vinstrs(FILE* f, const struct FnCode* fc) {
+    Str name = sym_str(fc->name->name);
+    fprintf(f, "fn %.*s%s\n", (int)name.len, name.data,
+            fc->hit ? " (cached)" : "");
+    for (size_t i = 0; !fc->hit && i < fc->vinstrs.len; i++) {
+        const Rv64Instr* instr = chunk_array_at(&fc->vinstrs, i);
+        fprintf(f, "  %6zx  ", instr->offset);
         switch (instr->type) {
         case RV64_R:
-            fprintf(stderr, "VINSTR: RV64_R %d, %d, %d\n", instr->r.rd->reg, instr->r.rs1->reg, instr->r.rs2->reg);
-            assert(instr->r.rd->state == VREG_EXACT);
-            assert(instr->r.rs1->state == VREG_EXACT);
-            assert(instr->r.rs2->state == VREG_EXACT);
-            instr->r.fn(&seg_text,
-                        instr->r.rd->reg,
-                        instr->r.rs1->reg,
-                        instr->r.rs2->reg);
+            fprintf(f, "RV64_R x%d, x%d, x%d\n", instr->r.rd->reg,
+                    instr->r.rs1->reg, instr->r.rs2->reg);
             break;
         case RV64_I:
-            fprintf(stderr, "VINSTR: RV64_I %d, %d, %ld\n", instr->i.rd->reg, instr->i.rs1->reg, instr->i.imm);
-            assert(instr->i.rd->state == VREG_EXACT);
-            assert(instr->i.rs1->state == VREG_EXACT);
-            instr->i.fn(&seg_text,
-                        instr->i.rd->reg,
-                        instr->i.rs1->reg,
-                        instr->i.imm);
+            fprintf(f, "RV64_I x%d, x%d, %ld\n", instr->i.rd->reg,
+                    instr->i.rs1->reg, instr->i.imm);
             break;
         case RV64_RI64:
-            fprintf(stderr, "VINSTR: RV64_RI64 %d %ld\n", instr->ri64.rd->reg, instr->ri64.imm);
-            assert(instr->ri64.rd->state == VREG_EXACT);
-            instr->ri64.fn(&seg_text,
-                           instr->ri64.rd->reg,
-                           instr->ri64.imm);
+            fprintf(f, "RV64_RI64 x%d, %lu\n", instr->ri64.rd->reg,
+                    instr->ri64.imm);
             break;
         case RV64_B:
-            fprintf(stderr, "VINSTR: RV64_B %d, %d, %d\n",
-                    instr->b.rs1->reg, instr->b.rs2->reg, instr->b.imm);
-            assert(instr->b.rs1->state == VREG_EXACT);
-            assert(instr->b.rs2->state == VREG_EXACT);
-            instr->b.fn(&seg_text,
-                        instr->b.rs1->reg,
-                        instr->b.rs2->reg,
-                        instr->b.imm);
+            fprintf(f, "RV64_B x%d, x%d, %ld\n", instr->b.rs1->reg,
+                    instr->b.rs2->reg, (int64_t)instr->b.imm);
+            break;
+        case RV64_S:
+            fprintf(f, "RV64_S x%d, x%d, %ld\n", instr->s.rs1->reg,
+                    instr->s.rs2->reg, instr->s.imm);
             break;
         case RV64_J:
-            fprintf(stderr, "VINSTR: RV64_J %d\n", instr->j.imm);
-            instr->j.fn(&seg_text, instr->j.imm);
+            fprintf(f, "RV64_J %d\n", instr->j.imm);
             break;
         case RV64_NONE:
-            fprintf(stderr, "VINSTR: RV64_NONE\n");
-            instr->none.fn(&seg_text);
+            fprintf(f, "RV64_NONE\n");
             break;
         case FN_START:
-            fprintf(stderr, "VINSTR: FN_START\n");
-            vreg_set_state_mem_addr(instr->fn_start.binding->last_vreg, &seg_text, seg_text.len);
+            fprintf(f, "FN_START\n");
+            break;
+        case FN_LEAVE:
+            fprintf(f, "FN_LEAVE\n");
             break;
         case ASSIGN:
-            fprintf(stderr, "VINSTR: ASSIGN\n");
-            Vreg* rs = instr->assign.val;
-            Vreg* rd = instr->assign.dest;
-            assert(rd->state == VREG_EXACT);
-            if (rs->state == VREG_STATIC) {
-                rv64_write_li(&seg_text, rd->reg, rs->val);
-            } else if (rs->state == VREG_EXACT) {
-                assert(rs->reg == rd->reg);
-            }
+            fprintf(f, "ASSIGN\n");
             break;
         case PATCH:
-            fprintf(stderr, "VINSTR: PATCH\n");
-            rv64_patch(&seg_text, instr->patch.instr, instr->patch.target->offset);
+            fprintf(f, "PATCH %zx\n", instr->patch.instr->offset);
             break;
         default:
-            fprintf(stderr, "VINSTR: Unknown\n");
+            fprintf(f, "Unknown\n");
             break;
         }
     }
-    for (size_t i = 0; i < n_postinstrs; i++) {
-        Rv64Instr *instr = &postinstrs[i];
-        switch (instr->type) {
-        case PATCH_BINDING:
-            fprintf(stderr, "VINSTR: PATCH_BINDING\n");
-            Vreg* r = instr->patch_binding.binding->last_vreg;
-            assert(r->state == VREG_MEM_ADDR);
-            uint32_t off = r->loc.offset;
-            rv64_patch(&seg_text, instr->patch_binding.instr, off);
-            break;
+    for (size_t i = 0; i < fc->postinstrs.len; i++) {
+        const Rv64Instr* instr = chunk_array_at(&fc->postinstrs, i);
+        if (instr->type == PATCH_BINDING) {
+            Str callee = sym_str(instr->patch_binding.binding->name);
+            fprintf(f, "  %6zx  PATCH_BINDING %.*s\n",
+                    instr->patch_binding.instr->offset,
+                    (int)callee.len, callee.data);
         }
     }
 }
 
+#include "cache.c"
+
 static void
-compile(struct File* file) {
+cache_key_job(void* fns, size_t i) {
+    struct FnCode* fc = &((struct FnCode*)fns)[i];
+    fc->ast_key = fn_cache_key(fc->tree, fc->fn);
+}
+
+// After the keys of all functions' own ASTs are there.
+static void
+cache_lookup_job(void* fns, size_t i) {
+    struct FnCode* fc = &((struct FnCode*)fns)[i];
+    fc->key = fc->ast_key;
+    hash_callees(&fc->key, fc, INLINE_ROUNDS);
+    fc->cached = cache_load(fc->key);
+}
+
+static void
+lower_uncached_fn_job(void* fns, size_t i) {
+    if (((struct FnCode*)fns)[i].cached == NULL) {
+        lower_fn_job(fns, i);
+    }
+}
+
+// Lowers the functions that are not in the cache.
+static void
+lower_fns(struct FnCode* fns, size_t n_fns) {
+    if (!options.no_cache) {
+        run_parallel(n_fns, cache_key_job, fns);
+        run_parallel(n_fns, cache_lookup_job, fns);
+    }
+    for (size_t i = 0; i < n_fns; i++) {
+        if (fns[i].cached == NULL) {
+            want_inline_callees(&fns[i], INLINE_ROUNDS);
+        }
+    }
+    run_parallel(n_fns, inline_ir_job, fns);
+    run_parallel(n_fns, lower_uncached_fn_job, fns);
+}
+
+static void
+determine_vregs_job(void* fns, size_t i) {
+    struct FnCode* fc = &((struct FnCode*)fns)[i];
+    if (fc->cached == NULL) {
+        allocate_vregs(fc);
+    }
+}
+
+// Decides the registers of the functions that are not in the cache,
+// and takes the others from there.  Registers are not shared between
+// functions, so an entry fits wherever the function is.
+static void
+determine_fn_vregs(struct FnCode* fns, size_t n_fns) {
+    run_parallel(n_fns, determine_vregs_job, fns);
+    for (size_t i = 0; i < n_fns; i++) {
+        struct FnCode* fc = &fns[i];
+        if (fc->cached) {
+            cache_apply(fc, fc->cached);
+            fc->hit = true;
+            cache_stats.hits++;
+        } else {
+            cache_stats.misses++;
+        }
+    }
+}
+
+static void
+compile_instrs_job(void* fns, size_t i) {
+    struct FnCode* fc = &((struct FnCode*)fns)[i];
+    if (fc->hit) {
+        return;
+    }
+    compile_instrs(fc);
+    if (!options.no_cache) {
+        cache_store(fc);
+    }
+}
+
+// Puts the text of all functions in seg_text, in source order, and
+// patches the calls between them.
+static void
+link_fns(struct FnCode* fns, size_t n_fns) {
+    for (size_t f = 0; f < n_fns; f++) {
+        struct FnCode* fc = &fns[f];
+        if (options.target == TARGET_X86_64) {
+            seg_pad(&seg_text, X86_FN_ALIGN, X86_FN_PAD);
+        } else {
+            seg_pad(&seg_text, RV64_FN_ALIGN, 0);
+        }
+        size_t base = emit_bytes(&seg_text, fc->text.data, fc->text.len);
+        Vreg* v = fc->name->last_vreg;
+        vreg_set_state_mem_addr(v, &seg_text, base + v->loc.offset);
+        for (size_t i = 0; i < fc->postinstrs.len; i++) {
+            Rv64Instr* instr = chunk_array_at(&fc->postinstrs, i);
+            instr->patch_binding.instr->offset += base;
+        }
+    }
+    for (size_t f = 0; f < n_fns; f++) {
+        struct FnCode* fc = &fns[f];
+        for (size_t i = 0; i < fc->postinstrs.len; i++) {
+            Rv64Instr *instr = chunk_array_at(&fc->postinstrs, i);
+            switch (instr->type) {
+            case PATCH_BINDING: {
+                Vreg* r = instr->patch_binding.binding->last_vreg;
+                assert(r->state == VREG_MEM_ADDR);
+                uint32_t off = r->loc.offset;
+                patch_instr(&seg_text, instr->patch_binding.instr, off);
+            } break;
+            }
+        }
+    }
+}
+
+// The blocks that are open in the file being parsed, innermost last.
+// A block is added to the tree when it is closed, after everything in
+// it, so that the tree is in post-order.
+struct OpenBlock {
+    enum AstType type;
+    AstRef first;  // The first node in the block.
+    AstRef head;
+    Binding* name;
+    size_t stmts;  // Where its statements start in open_stmts.
+};
+
+static _Thread_local struct OpenBlock* open_blocks;
+static _Thread_local size_t n_open_blocks;
+static _Thread_local size_t cap_open_blocks;
+
+// The statements of all open blocks, outermost first.
+static _Thread_local AstRef* open_stmts;
+static _Thread_local size_t n_open_stmts;
+static _Thread_local size_t cap_open_stmts;
+
+static void
+add_stmt(AstRef a) {
+    if (n_open_stmts == cap_open_stmts) {
+        open_stmts = grow_array(open_stmts, &cap_open_stmts,
+                                sizeof *open_stmts);
+    }
+    open_stmts[n_open_stmts] = a;
+    n_open_stmts++;
+}
+
+static void
+open_block(enum AstType type, AstRef first, AstRef head, Binding* name) {
+    if (n_open_blocks == cap_open_blocks) {
+        open_blocks = grow_array(open_blocks, &cap_open_blocks,
+                                 sizeof *open_blocks);
+    }
+    open_blocks[n_open_blocks] = (struct OpenBlock){
+        .type = type,
+        .first = first,
+        .head = head,
+        .name = name,
+        .stmts = n_open_stmts,
+    };
+    n_open_blocks++;
+}
+
+// Adds the innermost block to the tree, as a statement of the block
+// around it or as the root.
+static AstRef
+close_block(AstTree* t) {
+    assert(n_open_blocks > 0);
+    n_open_blocks--;
+    const struct OpenBlock* ob = &open_blocks[n_open_blocks];
+    AstRef a = ast_new_block(t, ob->type, ob->first, ob->head, ob->name,
+                             &open_stmts[ob->stmts],
+                             n_open_stmts - ob->stmts);
+    n_open_stmts = ob->stmts;
+    if (ob->type == AST_FN) {
+        ob->name->decl = a;
+    }
+    if (n_open_blocks > 0) {
+        add_stmt(a);
+    } else {
+        t->root = a;
+    }
+    return a;
+}
+
+// Parses one file into its own AST.  This only touches state that is
+// per thread, apart from interning names, so several files can be
+// parsed at the same time.
+static void
+parse_file(struct ParsedFile* parsed) {
+    struct File* file = parsed->file;
+    AstTree* tree = &parsed->tree;
+    bindings = (ChunkArray){.elem_size = sizeof (Binding), .mem = &ast_mem};
+    calls = (ChunkArray){.elem_size = sizeof (AstRef), .mem = &ast_mem};
+    push_scope();
+    open_block(AST_ROOT, 0, AST_NONE, NULL);
+
+    // The tokens are only needed while parsing.
+    MemMark mark = mem_mark(&scratch_mem);
+    TokenList tokens = {0};
     State state = {
         .file = file,
+        .tree = tree,
     };
-    // Will be filled in by later function calls.
-    Ast* result = NULL;
-
-    Ast ast_root = {0};
-    Ast* block = &ast_root;
-
-    init_seg(&seg_text, ".text", 0x20b0);
-    init_seg(&seg_data, ".data", 0x3000);
-
-    add_type(STR("void"), 0);
-    add_type(STR("bool"), 1);
-    add_type(STR("i8"), 1);
-    add_type(STR("u8"), 1);
-    add_type(STR("i16"), 2);
-    add_type(STR("u16"), 2);
-    add_type(STR("i32"), 4);
-    add_type(STR("u32"), 4);
-    add_type(STR("i64"), 8);
-    add_type(STR("u64"), 8);
-    add_type(STR("isize"), sizeof (size_t));
-    add_type(STR("usize"), sizeof (size_t));
-
-    Binding* inside_function = NULL;
-
-    while (state.offset < state.file->size) {
+    if (!lex_file(file, &tokens, &scratch_mem)) {
+        state.failed = true;
+        ast_tree_init(tree, 1);
+        goto after_loop;
+    }
+    // Every node but the root has a token of its own.
+    ast_tree_init(tree, tokens.len);
+    state.tokens = tokens.tokens;
+    state.offset = tokens.tokens[0].offset;
+
+    while (!at_eof(&state)) {
         bool end_of_statement = false;
+        size_t start = state.offset;
+        Sym name;
 
-        if (read_label(&state, &result)) {
-            if (str_eq(result->label.name, STR("if"))) {
-                Ast* rd = compile_expr(&state);
+        if (read_label(&state, &name)) {
+            if (name == SYM_IF) {
+                AstRef first = tree->n_nodes;
+                AstRef rd = compile_expr(&state);
                 if (read_char(&state, '{')) {
-                    block = ast_add(block, ast_new_if(rd));
+                    push_scope();
+                    open_block(AST_IF, first, rd, NULL);
                     end_of_statement = true;
                 }
-            } else if (str_eq(result->label.name, STR("while"))) {
-                Ast* rd = compile_expr(&state);
+            } else if (name == SYM_WHILE) {
+                AstRef first = tree->n_nodes;
+                AstRef rd = compile_expr(&state);
                 if (read_char(&state, '{')) {
-                    block = ast_add(block, ast_new_while(rd));
+                    push_scope();
+                    open_block(AST_WHILE, first, rd, NULL);
                     end_of_statement = true;
                 }
-            } else if (str_eq(result->label.name, STR("exit"))) {
-                Ast* val = compile_expr(&state);
+            } else if (name == SYM_EXIT) {
+                AstRef val = compile_expr(&state);
                 if (read_char(&state, ';')) {
-                    ast_add(block, ast_new_exit(val));
+                    add_stmt(ast_new_exit(tree, val));
                     end_of_statement = true;
                 }
-            } else if (str_eq(result->label.name, STR("return"))) {
-                Ast* val = compile_expr(&state);
+            } else if (name == SYM_RETURN) {
+                AstRef val = compile_expr(&state);
                 if (read_char(&state, ';')) {
-                    ast_add(block, ast_new_ret(val));
+                    add_stmt(ast_new_ret(tree, val));
                     end_of_statement = true;
                 }
             } else {
-                Str name = result->label.name;
-                if (read_label(&state, &result)) {
-                    Str type = result->label.name;
-                    Ast* expr_value = compile_expr(&state);
-                    if (expr_value) {
+                Sym type;
+                if (read_label(&state, &type)) {
+                    AstRef expr_value = compile_expr(&state);
+                    if (expr_value != AST_NONE) {
                         if (read_char(&state, ';')) {
                             const Type* t = get_type(type);
-                            Vreg* r = alloc_vreg_ast();
-                            Binding* b = add_binding(name, t, r);
-                            r->ast = expr_value;
-                            r->binding = b;
-
-                            ast_add(block, ast_new_var(expr_value, b));
+                            Binding* b = add_binding(name, t, NULL);
+                            b->decl = ast_new_var(tree, expr_value, b);
+                            add_stmt(b->decl);
                             end_of_statement = true;
                         }
                     } else if (read_char(&state, '(')) {
                         if (read_char(&state, ')')) {
                             if (read_char(&state, '{')) {
                                 const Type* t = get_type(type);
-                                Vreg* r = alloc_vreg_mem();
-                                Binding* b = add_binding(name, t, r);
-                                r->binding = b;
-                                inside_function = b;
-                                block = ast_add(block, ast_new_fn(b));
+                                Binding* b = add_binding(name, t, NULL);
+                                push_scope();
+                                open_block(AST_FN, tree->n_nodes, AST_NONE, b);
                                 end_of_statement = true;
                             }
                         }
                     }
                 } else if (read_char(&state, '=')) {
-                    Ast* rd = compile_expr(&state);
+                    AstRef rd = compile_expr(&state);
                     if (read_char(&state, ';')) {
                         Binding* b = get_binding(name);
-                        ast_add(block, ast_new_assign(b, rd));
+                        if (b == NULL) {
+                            state.offset = start;
+                            print_error("Unknown variable", &state);
+                        } else if (b->global) {
+                            // Globals are compiled where they are used,
+                            // as the expression they are declared with.
+                            state.offset = start;
+                            print_error("Can not assign to a global",
+                                        &state);
+                        } else {
+                            add_stmt(ast_new_assign(tree, b, rd));
+                        }
                         end_of_statement = true;
                     }
                 }
             }
-        } else if (block && read_char(&state, '}')) {
-            switch (block->type) {
+        } else if (read_char(&state, '}')) {
+            switch (open_blocks[n_open_blocks - 1].type) {
             case AST_IF:
-                block = block->if_block.block.parent;
-                break;
             case AST_WHILE:
-                block = block->while_block.block.parent;
-                break;
             case AST_FN:
-                block = block->fn_block.block.parent;
-                inside_function = NULL;
                 break;
             default:
                 print_error("Too many `}`", &state);
                 goto after_loop;
             }
+            close_block(tree);
+            pop_scope();
             end_of_statement = true;
         }
 
-        skip_whitespace(&state);
+        state.offset = peek_token(&state)->offset;
         if (!end_of_statement) {
             print_error("Syntax error", &state);
             break;
@@ -843,58 +2312,328 @@ compile(struct File* file) {
 
 after_loop:
 
-    compile_ast_root(&ast_root);
-    fprintf(stderr, "\nAst:\n");
-    print_ast(&ast_root);
+    // Blocks that were not closed end with the file.
+    while (n_open_blocks > 0) {
+        close_block(tree);
+    }
+    while (n_scopes > 0) {
+        pop_scope();
+    }
+    mem_release(&scratch_mem, mark);
+    parsed->ok = !state.failed;
+    parsed->bindings = bindings;
+    parsed->calls = calls;
+}
+
+static void
+parse_file_job(void* files, size_t i) {
+    parse_file(&((struct ParsedFile*)files)[i]);
+}
+
+// Gives the bindings of all files their vregs and resolves the calls.
+// Everything is done in file order so the result does not depend on
+// how the parsing was scheduled.
+static bool
+merge_files(struct ParsedFile* files, size_t n_files) {
+    bool ok = true;
+    for (size_t i = 0; i < n_files; i++) {
+        const AstTree* t = &files[i].tree;
+        ChunkArray* bs = &files[i].bindings;
+        for (size_t j = 0; j < bs->len; j++) {
+            Binding* b = chunk_array_at(bs, j);
+            Vreg* r;
+            if (ast_type(t, b->decl) == AST_FN) {
+                r = alloc_vreg_mem();
+                if (get_function(b->name)) {
+                    Str name = sym_str(b->name);
+                    fprintf(stderr, "%s: Function `%.*s` is defined twice\n",
+                            files[i].file->name, (int)name.len, name.data);
+                    ok = false;
+                }
+                binding_map_set(&functions, b->name, b);
+            } else {
+                r = alloc_vreg_ast();
+                r->ast = ast_var(t, b->decl)->val;
+            }
+            r->binding = b;
+            b->last_vreg = r;
+        }
+    }
+    for (size_t i = 0; i < n_files; i++) {
+        const AstTree* t = &files[i].tree;
+        ChunkArray* cs = &files[i].calls;
+        for (size_t j = 0; j < cs->len; j++) {
+            struct AstName* call = ast_name(t, *(AstRef*)chunk_array_at(cs, j));
+            call->binding = get_function(call->name);
+            if (call->binding == NULL) {
+                Str name = sym_str(call->name);
+                fprintf(stderr, "%s: Unknown function `%.*s`\n",
+                        files[i].file->name, (int)name.len, name.data);
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+// Compiles the files and writes the executable, or runs it with --run.
+// Returns the exit status of the program when it is run, 1 if the
+// files have errors and 0 otherwise.
+static int
+compile(struct File* files, size_t n_files) {
+    sym_pool_init();
+    init_vregs();
+    if (options.target == TARGET_X86_64) {
+        // x86-64 Linux does not map anything below 64K, and the text
+        // must be at its file offset in its page.
+        init_seg(&seg_text, ".text", 0x4000b0, 0x100000);
+        init_seg(&seg_data, ".data", 0x4000000, 0x100000);
+    } else {
+        init_seg(&seg_text, ".text", 0x20b0, 0x100000);
+        init_seg(&seg_data, ".data", 0x3000, 0x100000);
+    }
+
+    add_type(SYM_VOID, 0, false);
+    add_type(SYM_BOOL, 1, false);
+    add_type(SYM_I8, 1, true);
+    add_type(SYM_U8, 1, false);
+    add_type(SYM_I16, 2, true);
+    add_type(SYM_U16, 2, false);
+    add_type(SYM_I32, 4, true);
+    add_type(SYM_U32, 4, false);
+    add_type(SYM_I64, 8, true);
+    add_type(SYM_U64, 8, false);
+    add_type(SYM_ISIZE, sizeof (size_t), true);
+    add_type(SYM_USIZE, sizeof (size_t), false);
+
+    struct ParsedFile* parsed = mem_alloc_zero(
+        &default_mem, n_files * sizeof *parsed, _Alignof(struct ParsedFile));
+    for (size_t i = 0; i < n_files; i++) {
+        parsed[i].file = &files[i];
+    }
+    phase_begin(PHASE_PARSE);
+    run_parallel(n_files, parse_file_job, parsed);
+    bool ok = merge_files(parsed, n_files);
+    for (size_t i = 0; i < n_files; i++) {
+        ok = ok && parsed[i].ok;
+    }
+    phase_end(PHASE_PARSE);
+    if (!ok) {
+        return 1;
+    }
+    if (dumping(DUMP_AST)) {
+        dump_begin("Ast");
+        for (size_t i = 0; i < n_files; i++) {
+            print_ast(dump_out, &parsed[i].tree);
+        }
+        dump_end();
+    }
+
+    if (!options.no_cache && !cache_init()) {
+        options.no_cache = true;
+    }
+    phase_begin(PHASE_COMPILE_AST_ROOT);
+    size_t n_fns;
+    struct FnCode* fns = compile_ast_root(parsed, n_files, &n_fns);
+    lower_fns(fns, n_fns);
+    phase_end(PHASE_COMPILE_AST_ROOT);
+
+    if (dumping(DUMP_IR)) {
+        dump_begin("IR");
+        for (size_t i = 0; i < n_fns; i++) {
+            if (fns[i].ir_dump) {
+                fputs(fns[i].ir_dump, dump_out);
+            } else {
+                Str name = sym_str(fns[i].name->name);
+                fprintf(dump_out, "fn %.*s (cached)\n", (int)name.len,
+                        name.data);
+            }
+        }
+        dump_end();
+    }
+    if (options.inline_report) {
+        for (size_t i = 0; i < n_fns; i++) {
+            if (fns[i].inline_report) {
+                fputs(fns[i].inline_report, stderr);
+            }
+        }
+    }
+
+    phase_begin(PHASE_DETERMINE_VREGS);
+    determine_fn_vregs(fns, n_fns);
+    phase_end(PHASE_DETERMINE_VREGS);
+    phase_begin(PHASE_COMPILE_INSTRS);
+    run_parallel(n_fns, compile_instrs_job, fns);
+    phase_end(PHASE_COMPILE_INSTRS);
+    if (dumping(DUMP_VINSTR)) {
+        dump_begin("Instructions");
+        for (size_t i = 0; i < n_fns; i++) {
+            print_vinstrs(dump_out, &fns[i]);
+        }
+        dump_end();
+    }
+    phase_begin(PHASE_LINK);
+    size_t call_main = 0;
+    if (options.target == TARGET_X86_64) {
+        call_main = x86_write_start(&seg_text, options.run);
+    }
+    link_fns(fns, n_fns);
+    const Binding* mainfn = get_function(SYM_MAIN);
+    if (options.target == TARGET_X86_64 && mainfn) {
+        x86_write_rel32(&seg_text, call_main, mainfn->last_vreg->loc.offset);
+    }
+    phase_end(PHASE_LINK);
+    for (size_t i = 0; i < n_fns; i++) {
+        if (fns[i].cached) {
+            free_cache_entry(fns[i].cached);
+        }
+    }
+    if (!options.no_cache) {
+        cache_evict(options.cache_size);
+        if (options.cache_stats) {
+            print_cache_stats();
+        }
+    }
 
-    determine_vregs();
-    compile_instrs();
+    if (dumping(DUMP_DATA)) {
+        dump_begin("Data segment");
+        print_segment(dump_out, &seg_data);
+        dump_end();
+    }
+    if (dumping(DUMP_TEXT)) {
+        dump_begin("Text segment");
+        print_segment(dump_out, &seg_text);
+        dump_end();
+    }
+    if (dumping(DUMP_BINDINGS)) {
+        dump_begin("Bindings");
+        for (size_t i = 0; i < n_files; i++) {
+            print_bindings(dump_out, &parsed[i].bindings);
+        }
+        dump_end();
+    }
 
-    fprintf(stderr, "\nData segment:\n");
-    print_segment(&seg_data);
-    fprintf(stderr, "\nText segment:\n");
-    print_segment(&seg_text);
-    fprintf(stderr, "\nBindings:\n");
-    print_bindings();
+    int status = 0;
+    if (options.run && mainfn == NULL) {
+        fprintf(stderr, "No main function.\n");
+        status = 1;
+    } else if (options.run) {
+        phase_begin(PHASE_RUN);
+        status = x86_run(&seg_text);
+        phase_end(PHASE_RUN);
+    } else {
+        phase_begin(PHASE_WRITE_ELF);
+        write_elf_file("a");
+        phase_end(PHASE_WRITE_ELF);
+    }
+    if (options.mem_stats) {
+        print_mem_stats();
+    }
+    return status;
+}
 
-    write_elf_file("a");
+// Returns false if the option is not known.
+static bool
+parse_option(const char* arg) {
+    if (strcmp(arg, "--no-cache") == 0) {
+        options.no_cache = true;
+    } else if (strcmp(arg, "--cache-stats") == 0) {
+        options.cache_stats = true;
+    } else if (strcmp(arg, "--huge-pages") == 0) {
+        options.huge_pages = true;
+    } else if (strcmp(arg, "--mem-stats") == 0) {
+        options.mem_stats = true;
+    } else if (strcmp(arg, "--time-report") == 0) {
+        options.time_report = true;
+    } else if (strncmp(arg, "--time-trace=", 13) == 0 && arg[13]) {
+        options.time_trace = arg + 13;
+    } else if (strncmp(arg, "--dump=", 7) == 0) {
+        return parse_dump_kinds(arg + 7);
+    } else if (strncmp(arg, "--dump-file=", 12) == 0 && arg[12]) {
+        options.dump_file = arg + 12;
+    } else if (strcmp(arg, "--target=rv64") == 0) {
+        options.target = TARGET_RV64;
+    } else if (strcmp(arg, "--target=x86-64") == 0) {
+        options.target = TARGET_X86_64;
+    } else if (strcmp(arg, "--run") == 0) {
+        options.run = true;
+    } else if (strcmp(arg, "--verify-ir") == 0) {
+        options.verify_ir = true;
+    } else if (strcmp(arg, "--inline-report") == 0) {
+        options.inline_report = true;
+    } else if (strncmp(arg, "--cache-size=", 13) == 0) {
+        char* end;
+        unsigned long mib = strtoul(arg + 13, &end, 10);
+        if (*end != '\0' || end == arg + 13) {
+            return false;
+        }
+        options.cache_size = (size_t)mib << 20;
+    } else {
+        return false;
+    }
+    return true;
 }
 
 int
 main(int argc, char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Please specify filename\n");
+    size_t n_files = 0;
+    struct File* files = calloc(argc, sizeof *files);
+    enum FileLoad* loads = calloc(argc, sizeof *loads);
+    if (files == NULL || loads == NULL) {
+        perror("calloc");
         return 1;
     }
-    const char* filename = argv[1];
-    int fd = open(filename, O_RDONLY);
-    if (fd == -1) {
-        fprintf(stderr, "Could not open file %s\n", filename);
-        perror("open");
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] == '-'
+            && !parse_option(argv[i])) {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (options.time_report || options.time_trace) {
+        timing_init();
+    }
+    if (options.run) {
+#if defined(__x86_64__)
+        options.target = TARGET_X86_64;
+#else
+        fprintf(stderr, "--run needs an x86-64 host\n");
         return 1;
+#endif
     }
-    off_t size_off = lseek(fd, 0, SEEK_END);
-    if (size_off == (off_t)-1) {
-        fprintf(stderr, "Could not seek in the sourcefile."
-                        "Is it a regular file?\n");
-        perror("lseek");
-        close(fd);
+    if (options.dump && !dump_open()) {
         return 1;
     }
-    size_t size = size_off;
-    void* mem = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    if (mem == MAP_FAILED) {
-        fprintf(stderr, "Could not map the source file to memory.\n");
-        perror("mmap");
+    phase_begin(PHASE_LOAD);
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] == '-') {
+            continue;
+        }
+        if (!load_file(argv[i], &files[n_files], &loads[n_files])) {
+            return 1;
+        }
+        n_files++;
+    }
+    phase_end(PHASE_LOAD);
+    if (n_files == 0) {
+        fprintf(stderr, "Please specify filename\n");
         return 1;
     }
-    struct File file = {
-        .name = filename,
-        .content = (char*)mem,
-        .size = size,
-    };
-    compile(&file);
-    munmap(file.content, file.size);
-    return 0;
+    int status = compile(files, n_files);
+    if (!dump_close()) {
+        perror("dump");
+        return 1;
+    }
+    if (options.time_report) {
+        print_time_report();
+    }
+    if (options.time_trace && !write_time_trace(options.time_trace)) {
+        return 1;
+    }
+    for (size_t i = 0; i < n_files; i++) {
+        unload_file(&files[i], loads[i]);
+    }
+    free(files);
+    free(loads);
+    return status;
 }
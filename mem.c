@@ -1,46 +1,336 @@
-struct MemHeader {
-    size_t size;
-    size_t top;
+// An arena.  Memory is taken from the system in segments that are
+// chained together, and every segment is at least twice as big as the
+// one before it so a big input needs few system calls.
+struct MemSegment {
+    struct MemSegment* prev;
+    size_t size;   // Including this header.
+    size_t top;    // Offset of the first free byte.
+    size_t dirty;  // Bytes before this may have been used before.
 };
-typedef struct MemHeader MemHeader;
+typedef struct MemSegment MemSegment;
 
 struct Mem {
-    MemHeader* last;
+    MemSegment* last;
+    MemSegment* spare;  // Kept by mem_release and mem_reset for reuse.
+    size_t next_size;
+
+    size_t n_segments;
+    size_t bytes_mapped;
+    size_t bytes_used;
+    size_t peak_used;
 };
 typedef struct Mem Mem;
 
-struct Mem default_mem;
+// Where to go back to with mem_release.
+struct MemMark {
+    MemSegment* seg;
+    size_t top;
+    size_t bytes_used;
+};
+typedef struct MemMark MemMark;
 
-static MemHeader*
-mem_new_segment(Mem* mem, size_t space_needed) {
-    space_needed += sizeof (MemHeader);
-    size_t size = space_needed > 4096 ? space_needed : 4096;
+// All arenas together, since some of them belong to threads that are
+// gone when the statistics are printed.
+struct MemTotals {
+    atomic_size_t n_mmaps;
+    atomic_size_t n_munmaps;
+    atomic_size_t bytes_mapped;
+    atomic_size_t peak_mapped;
+};
+
+static struct MemTotals mem_totals;
+
+// Bytes allocated from arenas by this thread and not yet added to
+// mem_allocated_flushed.  Kept per thread so allocating stays cheap.
+static _Thread_local size_t mem_thread_allocated;
+static atomic_size_t mem_allocated_flushed;
+
+// For allocations that live until the program is compiled.
+static Mem default_mem;
+
+// For temporary allocations on the thread, with mem_mark and
+// mem_release.
+static _Thread_local Mem scratch_mem;
+
+#define MEM_MIN_SEGMENT ((size_t)64 << 10)
+#define MEM_MAX_SEGMENT ((size_t)64 << 20)
+#define MEM_HUGE_PAGE ((size_t)2 << 20)
+#define MEM_ALIGN _Alignof(max_align_t)
+
+static size_t
+align_up(size_t x, size_t align) {
+    return (x + align - 1) & ~(align - 1);
+}
+
+static void*
+mem_map(size_t size) {
     int prot = PROT_READ | PROT_WRITE;
-    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
-    void* ptr = mmap(NULL, size, prot, flags, -1, 0);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    void* ptr = MAP_FAILED;
+    // Huge pages are only used when asked for, since most of a segment
+    // may never be touched and a huge page is backed as a whole.
+    if (options.huge_pages && size % MEM_HUGE_PAGE == 0) {
+        // Without MAP_NORESERVE this fails when there are not enough
+        // huge pages, instead of faulting later.
+        int huge = (flags & ~MAP_NORESERVE) | MAP_HUGETLB;
+        ptr = mmap(NULL, size, prot, huge, -1, 0);
+        if (ptr == MAP_FAILED) {
+            ptr = mmap(NULL, size, prot, flags, -1, 0);
+            if (ptr != MAP_FAILED) {
+                madvise(ptr, size, MADV_HUGEPAGE);
+            }
+        }
+    } else {
+        ptr = mmap(NULL, size, prot, flags, -1, 0);
+    }
     if (ptr == MAP_FAILED) {
         perror("mmap");
+        abort();
     }
-    MemHeader* h = (MemHeader*)ptr;
-    *h = (MemHeader){
-        .size = size,
-        .top = 0,
-    };
-    mem->last = h;
-    return h;
+    mem_totals.n_mmaps++;
+    size_t mapped = mem_totals.bytes_mapped += size;
+    size_t peak = mem_totals.peak_mapped;
+    while (mapped > peak
+           && !atomic_compare_exchange_weak(&mem_totals.peak_mapped,
+                                            &peak, mapped)) {
+    }
+    return ptr;
 }
 
-#define mem_alloc(mem, type) ((type*)mem_alloc_size(mem, sizeof (type)))
+static void
+mem_unmap(Mem* mem, MemSegment* seg) {
+    mem->n_segments--;
+    mem->bytes_mapped -= seg->size;
+    mem_totals.n_munmaps++;
+    mem_totals.bytes_mapped -= seg->size;
+    munmap(seg, seg->size);
+}
+
+// Makes seg the spare segment if it is bigger than the one there is.
+static void
+mem_keep_spare(Mem* mem, MemSegment* seg) {
+    if (mem->spare && mem->spare->size >= seg->size) {
+        mem_unmap(mem, seg);
+        return;
+    }
+    if (mem->spare) {
+        mem_unmap(mem, mem->spare);
+    }
+    seg->dirty = seg->dirty > seg->top ? seg->dirty : seg->top;
+    seg->top = sizeof (MemSegment);
+    mem->spare = seg;
+}
+
+static MemSegment*
+mem_new_segment(Mem* mem, size_t space_needed) {
+    size_t needed = sizeof (MemSegment) + space_needed;
+    MemSegment* seg = mem->spare;
+    if (seg && seg->size >= needed) {
+        mem->spare = NULL;
+    } else {
+        size_t size = mem->next_size ? mem->next_size : MEM_MIN_SEGMENT;
+        if (size < needed) {
+            size = needed;
+        }
+        if (size >= MEM_HUGE_PAGE) {
+            size = align_up(size, MEM_HUGE_PAGE);
+        } else {
+            size = align_up(size, 4096);
+        }
+        seg = mem_map(size);
+        *seg = (MemSegment){
+            .size = size,
+            .top = sizeof (MemSegment),
+            .dirty = sizeof (MemSegment),
+        };
+        mem->n_segments++;
+        mem->bytes_mapped += size;
+        if (size < MEM_MAX_SEGMENT) {
+            mem->next_size = size * 2;
+        }
+    }
+    seg->prev = mem->last;
+    mem->last = seg;
+    return seg;
+}
+
+// `align` must be a power of two.
+static void*
+mem_alloc_align(Mem* mem, size_t size, size_t align) {
+    MemSegment* seg = mem->last;
+    size_t start = 0;
+    if (seg) {
+        uintptr_t base = (uintptr_t)seg;
+        start = align_up(base + seg->top, align) - base;
+    }
+    if (seg == NULL || start + size > seg->size) {
+        seg = mem_new_segment(mem, size + align);
+        uintptr_t base = (uintptr_t)seg;
+        start = align_up(base + seg->top, align) - base;
+    }
+    mem->bytes_used += start + size - seg->top;
+    mem_thread_allocated += start + size - seg->top;
+    if (mem->bytes_used > mem->peak_used) {
+        mem->peak_used = mem->bytes_used;
+    }
+    seg->top = start + size;
+    return (char*)seg + start;
+}
+
+#define mem_alloc(mem, type) \
+    ((type*)mem_alloc_align(mem, sizeof (type), _Alignof(type)))
+
+#define mem_alloc_array(mem, type, n) \
+    ((type*)mem_alloc_align(mem, (n) * sizeof (type), _Alignof(type)))
 
 static void*
 mem_alloc_size(Mem* mem, size_t size) {
-    if (mem->last == NULL) {
-        mem_new_segment(mem, size);
+    return mem_alloc_align(mem, size, MEM_ALIGN);
+}
+
+// Fresh memory from the system is already zero, so only what has been
+// used before needs to be cleared.
+static void*
+mem_alloc_zero(Mem* mem, size_t size, size_t align) {
+    char* p = mem_alloc_align(mem, size, align);
+    MemSegment* seg = mem->last;
+    size_t start = p - (char*)seg;
+    if (start < seg->dirty) {
+        size_t end = seg->dirty < start + size ? seg->dirty : start + size;
+        memset(p, 0, end - start);
+    }
+    return p;
+}
+
+static MemMark
+mem_mark(const Mem* mem) {
+    return (MemMark){
+        .seg = mem->last,
+        .top = mem->last ? mem->last->top : 0,
+        .bytes_used = mem->bytes_used,
+    };
+}
+
+// Frees everything that was allocated after the mark was made.
+static void
+mem_release(Mem* mem, MemMark mark) {
+    while (mem->last != mark.seg) {
+        MemSegment* seg = mem->last;
+        mem->last = seg->prev;
+        mem_keep_spare(mem, seg);
     }
-    if (mem->last->top + size >= mem->last->size) {
-        mem_new_segment(mem, size);
+    if (mark.seg) {
+        if (mark.seg->top > mark.seg->dirty) {
+            mark.seg->dirty = mark.seg->top;
+        }
+        mark.seg->top = mark.top;
     }
-    void* ptr = (char*)mem->last + sizeof (MemHeader) + mem->last->top;
-    mem->last->top += size;
-    return ptr;
+    mem->bytes_used = mark.bytes_used;
+}
+
+// Frees everything but keeps the biggest segment for what comes next.
+static void
+mem_reset(Mem* mem) {
+    mem_release(mem, (MemMark){0});
+}
+
+// Gives all memory back to the system.
+static void
+mem_free(Mem* mem) {
+    mem_reset(mem);
+    if (mem->spare) {
+        mem_unmap(mem, mem->spare);
+    }
+    *mem = (Mem){0};
+}
+
+// Must be called by a thread before it ends.
+static void
+mem_flush_allocated() {
+    mem_allocated_flushed += mem_thread_allocated;
+    mem_thread_allocated = 0;
+}
+
+// Bytes allocated from all arenas so far, by this thread and by
+// threads that have flushed.
+static size_t
+mem_allocated() {
+    return mem_allocated_flushed + mem_thread_allocated;
+}
+
+static void
+print_mem_stats() {
+    fprintf(stderr, "memory: %zu mmaps, %zu munmaps, %zu bytes mapped, "
+            "peak %zu\n",
+            (size_t)mem_totals.n_mmaps, (size_t)mem_totals.n_munmaps,
+            (size_t)mem_totals.bytes_mapped, (size_t)mem_totals.peak_mapped);
+    fprintf(stderr, "default arena: %zu segments, %zu bytes used of %zu, "
+            "peak %zu\n",
+            default_mem.n_segments, default_mem.bytes_used,
+            default_mem.bytes_mapped, default_mem.peak_used);
+}
+
+// Doubles the capacity of a realloc:ed array.
+static void*
+grow_array(void* arr, size_t* cap, size_t elem_size) {
+    size_t new_cap = *cap ? *cap * 2 : 64;
+    void* p = realloc(arr, new_cap * elem_size);
+    if (p == NULL) {
+        perror("realloc");
+        abort();
+    }
+    *cap = new_cap;
+    return p;
+}
+
+// An array that grows by adding fixed size chunks, so pointers to its
+// elements stay valid when it grows.  New elements are zeroed.  The
+// chunks are taken from `mem` if it is set and from malloc otherwise.
+#define CHUNK_LEN 1024
+
+struct ChunkArray {
+    size_t elem_size;
+    Mem* mem;
+    size_t len;
+    char** chunks;
+    size_t n_chunks;
+    size_t cap_chunks;
+};
+typedef struct ChunkArray ChunkArray;
+
+static void*
+chunk_array_at(const ChunkArray* a, size_t i) {
+    return a->chunks[i / CHUNK_LEN] + (i % CHUNK_LEN) * a->elem_size;
+}
+
+// Returns where element number `len` is or will be stored.
+static void*
+chunk_array_next(ChunkArray* a) {
+    if (a->len == a->n_chunks * CHUNK_LEN) {
+        if (a->n_chunks == a->cap_chunks) {
+            a->chunks = grow_array(a->chunks, &a->cap_chunks,
+                                   sizeof *a->chunks);
+        }
+        char* chunk;
+        if (a->mem) {
+            chunk = mem_alloc_zero(a->mem, CHUNK_LEN * a->elem_size,
+                                   MEM_ALIGN);
+        } else {
+            chunk = calloc(CHUNK_LEN, a->elem_size);
+        }
+        if (chunk == NULL) {
+            perror("calloc");
+            abort();
+        }
+        a->chunks[a->n_chunks] = chunk;
+        a->n_chunks++;
+    }
+    return chunk_array_at(a, a->len);
+}
+
+static void*
+chunk_array_add(ChunkArray* a) {
+    void* p = chunk_array_next(a);
+    a->len++;
+    return p;
 }
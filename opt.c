@@ -0,0 +1,795 @@
+// Passes over the IR of a function, run by ir_optimize between building
+// the IR and selecting instructions.
+
+// Runs ir_verify after a pass when it is asked for with --verify-ir.
+static void
+ir_check(IrFn* fn, const char* after) {
+    if (options.verify_ir) {
+        ir_verify(fn, after);
+    }
+}
+
+// Takes away operand p of the phi.  The later ones move down, and they
+// are linked again since the uses are in lists by address.
+static void
+ir_remove_phi_arg(IrInstr* phi, uint32_t p) {
+    for (uint32_t k = p; k < phi->n_args; k++) {
+        IrInstr* next = k + 1 < phi->n_args ? ir_arg(phi, k + 1) : NULL;
+        ir_use_unlink(&phi->args[k]);
+        if (next) {
+            ir_use_link(&phi->args[k], next);
+        }
+    }
+    phi->n_args--;
+}
+
+// Removes the edge from `from` to its successor s, and the operands of
+// the phis there that came along it.  The terminator is left as it is.
+static void
+ir_remove_edge(IrFn* fn, IrBlock* from, uint32_t s) {
+    IrBlock* to = from->succs[s];
+    from->n_succs--;
+    for (uint32_t k = s; k < from->n_succs; k++) {
+        from->succs[k] = from->succs[k + 1];
+    }
+    uint32_t p = 0;
+    while (to->preds[p] != from) {
+        p++;
+    }
+    to->n_preds--;
+    for (uint32_t k = p; k < to->n_preds; k++) {
+        to->preds[k] = to->preds[k + 1];
+    }
+    for (IrInstr* phi = to->first; phi && phi->op == IR_PHI;
+         phi = phi->next) {
+        ir_remove_phi_arg(phi, p);
+    }
+    if (to->n_preds == 0) {
+        return;
+    }
+    // Phis that only have one value left are not needed.
+    IrInstr* phi = to->first;
+    while (phi && phi->op == IR_PHI) {
+        IrInstr* next = phi->next;
+        ir_try_remove_trivial_phi(fn, phi);
+        // That may have removed the next one too.
+        while (next && next->block != to) {
+            next = next->next;
+        }
+        phi = next;
+    }
+}
+
+// Turns branches on a known condition into jumps.  Returns whether
+// there were any.
+static bool
+ir_fold_branches(IrFn* fn) {
+    bool changed = false;
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        IrBlock* b = fn->blocks[bi];
+        IrInstr* br = b->last;
+        if (br->op != IR_BRANCH || ir_arg(br, 0)->op != IR_CONST) {
+            continue;
+        }
+        uint32_t taken = ir_arg(br, 0)->imm ? 0 : 1;
+        ir_remove_edge(fn, b, 1 - taken);
+        ir_remove_instr(br);
+        ir_append(b, ir_new_instr(fn, IR_JUMP, 0));
+        changed = true;
+    }
+    return changed;
+}
+
+// Removes the blocks that can not be reached from the entry.
+static void
+ir_remove_unreachable(IrFn* fn) {
+    ir_compute_order(fn);
+    if (fn->n_rpo == fn->n_blocks) {
+        return;
+    }
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        IrBlock* b = fn->blocks[bi];
+        if (b->order != IR_NO_ORDER) {
+            continue;
+        }
+        while (b->n_succs) {
+            ir_remove_edge(fn, b, 0);
+        }
+    }
+    // What is left uses nothing in the blocks that are removed.
+    uint32_t n = 0;
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        IrBlock* b = fn->blocks[bi];
+        if (b->order != IR_NO_ORDER) {
+            fn->blocks[n] = b;
+            n++;
+            continue;
+        }
+        for (IrInstr* i = b->first; i; i = i->next) {
+            for (uint32_t k = 0; k < i->n_args; k++) {
+                if (i->args[k].def) {
+                    ir_use_unlink(&i->args[k]);
+                }
+            }
+            i->block = NULL;
+        }
+    }
+    fn->n_blocks = n;
+}
+
+// Puts a block together with the one before it where that is its only
+// predecessor and it is the only successor there.
+static void
+ir_merge_blocks(IrFn* fn) {
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        IrBlock* b = fn->blocks[bi];
+        while (b->last->op == IR_JUMP && b->succs[0] != b
+               && b->succs[0]->n_preds == 1) {
+            IrBlock* s = b->succs[0];
+            while (s->first && s->first->op == IR_PHI) {
+                ir_try_remove_trivial_phi(fn, s->first);
+            }
+            ir_remove_instr(b->last);
+            for (IrInstr* i = s->first; i; i = i->next) {
+                i->block = b;
+            }
+            if (s->first) {
+                s->first->prev = b->last;
+                if (b->last) {
+                    b->last->next = s->first;
+                } else {
+                    b->first = s->first;
+                }
+                b->last = s->last;
+            }
+            b->n_succs = s->n_succs;
+            for (uint32_t k = 0; k < s->n_succs; k++) {
+                IrBlock* t = s->succs[k];
+                b->succs[k] = t;
+                for (uint32_t p = 0; p < t->n_preds; p++) {
+                    if (t->preds[p] == s) {
+                        t->preds[p] = b;
+                    }
+                }
+            }
+            // Out of the layout.
+            uint32_t n = 0;
+            for (uint32_t k = 0; k < fn->n_blocks; k++) {
+                if (fn->blocks[k] != s) {
+                    fn->blocks[n] = fn->blocks[k];
+                    n++;
+                }
+            }
+            fn->n_blocks = n;
+            if (n <= bi || fn->blocks[bi] != b) {
+                // s was laid out before b.
+                bi--;
+            }
+        }
+    }
+}
+
+static void
+ir_simplify_cfg(IrFn* fn) {
+    if (ir_fold_branches(fn)) {
+        ir_remove_unreachable(fn);
+    }
+    ir_merge_blocks(fn);
+}
+
+// Removes the instructions whose values are never used, also where
+// they are only used by each other, like a variable that is changed in
+// a loop and never read after it.
+static void
+ir_dce(IrFn* fn) {
+    uint32_t n_words = (fn->n_ids + 63) / 64;
+    uint64_t* live = mem_alloc_zero(fn->mem, n_words * sizeof (uint64_t),
+                                    _Alignof(uint64_t));
+    IrInstr** work = NULL;
+    uint32_t n_work = 0;
+    uint32_t cap_work = 0;
+    // What has effects is needed, and then what that uses.
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        for (IrInstr* i = fn->blocks[bi]->first; i; i = i->next) {
+            if (i->op != IR_CALL && !ir_is_terminator(i)) {
+                continue;
+            }
+            if (n_work == cap_work) {
+                work = ir_grow_array(fn->mem, work, &cap_work, sizeof *work);
+            }
+            work[n_work] = i;
+            n_work++;
+            ir_set_bit(live, i->id);
+        }
+    }
+    while (n_work > 0) {
+        n_work--;
+        IrInstr* i = work[n_work];
+        for (uint32_t k = 0; k < i->n_args; k++) {
+            IrInstr* def = ir_arg(i, k);
+            if (ir_bit(live, def->id)) {
+                continue;
+            }
+            ir_set_bit(live, def->id);
+            if (n_work == cap_work) {
+                work = ir_grow_array(fn->mem, work, &cap_work, sizeof *work);
+            }
+            work[n_work] = def;
+            n_work++;
+        }
+    }
+    // The dead ones may use each other, so their operands are all let
+    // go of before they are removed.
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        for (IrInstr* i = fn->blocks[bi]->first; i; i = i->next) {
+            for (uint32_t k = 0; !ir_bit(live, i->id) && k < i->n_args; k++) {
+                ir_use_unlink(&i->args[k]);
+            }
+        }
+    }
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        IrInstr* i = fn->blocks[bi]->first;
+        while (i) {
+            IrInstr* next = i->next;
+            if (!ir_bit(live, i->id)) {
+                ir_remove_instr(i);
+            }
+            i = next;
+        }
+    }
+}
+
+// An instruction that a later one with the same value can be replaced
+// with, in ir_gvn.
+struct GvnEntry {
+    IrInstr* instr;
+    struct GvnEntry* next;
+};
+
+static inline bool
+ir_is_commutative(enum IrOp op) {
+    return op == IR_ADD || op == IR_MUL;
+}
+
+static uint32_t
+ir_value_hash(const IrInstr* i) {
+    uint64_t h = i->op * 0x9e3779b97f4a7c15u ^ i->imm;
+    if (i->op == IR_PHI) {
+        h = h * 31 + i->block->id;
+    }
+    for (uint32_t k = 0; k < i->n_args; k++) {
+        h = h * 0x100000001b3u ^ ir_arg(i, k)->id;
+    }
+    return (uint32_t)(h ^ h >> 32);
+}
+
+// Whether the two always have the same value.  Phis have it when they
+// are in the same block and have the same operands.
+static bool
+ir_same_value(const IrInstr* a, const IrInstr* b) {
+    if (a->op != b->op || a->imm != b->imm || a->n_args != b->n_args
+        || (a->op == IR_PHI && a->block != b->block)) {
+        return false;
+    }
+    for (uint32_t k = 0; k < a->n_args; k++) {
+        if (ir_arg(a, k) != ir_arg(b, k)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Turns an operation on constants into a constant, with the same 64-bit
+// arithmetic as the instructions it would be selected to.  Returns
+// whether it did.
+static bool
+ir_fold_const(IrInstr* i) {
+    if (i->n_args == 0 || i->n_args > 2 || i->op == IR_PHI) {
+        return false;
+    }
+    for (uint32_t k = 0; k < i->n_args; k++) {
+        if (ir_arg(i, k)->op != IR_CONST) {
+            return false;
+        }
+    }
+    uint64_t x = ir_arg(i, 0)->imm;
+    uint64_t y = i->n_args > 1 ? ir_arg(i, 1)->imm : 0;
+    switch (i->op) {
+    case IR_ADD:
+        i->imm = x + y;
+        break;
+    case IR_SUB:
+        i->imm = x - y;
+        break;
+    case IR_MUL:
+        i->imm = x * y;
+        break;
+    case IR_LT:
+        i->imm = (int64_t)x < (int64_t)y;
+        break;
+    case IR_LTU:
+        i->imm = x < y;
+        break;
+    case IR_SEXT:
+    case IR_ZEXT:
+        i->imm = wrap_bits(x, i->imm, i->op == IR_SEXT);
+        break;
+    default:
+        return false;
+    }
+    for (uint32_t k = 0; k < i->n_args; k++) {
+        ir_use_unlink(&i->args[k]);
+    }
+    i->op = IR_CONST;
+    i->n_args = 0;
+    return true;
+}
+
+// Global value numbering.  The blocks are gone through in reverse
+// post-order, so the operands of an instruction have been replaced by
+// the first instruction with their value before it is looked at, apart
+// from phi operands along back edges.  An instruction is replaced by
+// an earlier one with the same value if that one dominates it.
+// Operations on constants, which inlining brings, are folded first.
+static void
+ir_gvn(IrFn* fn) {
+    ir_compute_doms(fn);
+    uint32_t n_buckets = 64;
+    while (n_buckets < fn->n_ids) {
+        n_buckets *= 2;
+    }
+    struct GvnEntry** buckets = mem_alloc_zero(
+        fn->mem, n_buckets * sizeof *buckets, _Alignof(struct GvnEntry*));
+    for (uint32_t bi = 0; bi < fn->n_rpo; bi++) {
+        IrInstr* i = fn->rpo[bi]->first;
+        while (i) {
+            IrInstr* next = i->next;
+            if (i->op == IR_CALL || ir_is_terminator(i)) {
+                i = next;
+                continue;
+            }
+            ir_fold_const(i);
+            if (ir_is_commutative(i->op)
+                && ir_arg(i, 0)->id > ir_arg(i, 1)->id) {
+                IrInstr* l = ir_arg(i, 0);
+                ir_set_arg(i, 0, ir_arg(i, 1));
+                ir_set_arg(i, 1, l);
+            }
+            struct GvnEntry** bucket =
+                &buckets[ir_value_hash(i) & (n_buckets - 1)];
+            struct GvnEntry* e = *bucket;
+            while (e && !(ir_same_value(e->instr, i)
+                          && ir_dominates(e->instr->block, i->block))) {
+                e = e->next;
+            }
+            if (e) {
+                ir_replace_uses(i, e->instr);
+                ir_remove_instr(i);
+            } else {
+                e = mem_alloc(fn->mem, struct GvnEntry);
+                *e = (struct GvnEntry){i, *bucket};
+                *bucket = e;
+            }
+            i = next;
+        }
+    }
+}
+
+// Puts the block in the layout right before `before`.
+static void
+ir_insert_block_before(IrFn* fn, IrBlock* b, IrBlock* before) {
+    ir_append_block(fn, b);
+    uint32_t k = fn->n_blocks - 1;
+    while (fn->blocks[k - 1] != before) {
+        fn->blocks[k] = fn->blocks[k - 1];
+        k--;
+    }
+    fn->blocks[k] = before;
+    fn->blocks[k - 1] = b;
+}
+
+// The block that the loop with head h is entered from, made if it is
+// not there yet, or NULL if the loop is entered from more than one.
+// `body` has the blocks of the loop.
+static IrBlock*
+ir_preheader(IrFn* fn, IrBlock* h, const uint64_t* body) {
+    uint32_t outside = 0;
+    uint32_t n_outside = 0;
+    for (uint32_t p = 0; p < h->n_preds; p++) {
+        if (!ir_bit(body, h->preds[p]->id)) {
+            outside = p;
+            n_outside++;
+        }
+    }
+    if (n_outside != 1) {
+        return NULL;
+    }
+    IrBlock* pred = h->preds[outside];
+    if (pred->n_succs == 1) {
+        return pred;
+    }
+    // The edge is split.  The phis of h keep their operands, as the
+    // new block takes the place of pred.
+    IrBlock* pre = ir_new_block(fn);
+    ir_append(pre, ir_new_instr(fn, IR_JUMP, 0));
+    pre->n_succs = 1;
+    pre->succs[0] = h;
+    pre->preds = mem_alloc_array(fn->mem, IrBlock*, 1);
+    pre->preds[0] = pred;
+    pre->n_preds = 1;
+    pre->cap_preds = 1;
+    pred->succs[pred->succs[0] == h ? 0 : 1] = pre;
+    h->preds[outside] = pre;
+    ir_insert_block_before(fn, pre, h);
+    return pre;
+}
+
+// Whether the value is computed outside the loop.
+static inline bool
+ir_outside(const IrInstr* i, const uint64_t* body) {
+    return !ir_bit(body, i->block->id);
+}
+
+// Sets the bits of the blocks that reach a back edge of the loop with
+// head h without going through h, and clears all others.  `work` needs
+// room for every block.
+static void
+ir_loop_body(IrBlock* h, uint64_t* body, uint32_t n_words, IrBlock** work) {
+    memset(body, 0, n_words * sizeof (uint64_t));
+    uint32_t n_work = 0;
+    ir_set_bit(body, h->id);
+    for (uint32_t p = 0; p < h->n_preds; p++) {
+        IrBlock* t = h->preds[p];
+        if (ir_dominates(h, t) && !ir_bit(body, t->id)) {
+            ir_set_bit(body, t->id);
+            work[n_work++] = t;
+        }
+    }
+    while (n_work > 0) {
+        IrBlock* b = work[--n_work];
+        for (uint32_t p = 0; p < b->n_preds; p++) {
+            IrBlock* pred = b->preds[p];
+            if (!ir_bit(body, pred->id)) {
+                ir_set_bit(body, pred->id);
+                work[n_work++] = pred;
+            }
+        }
+    }
+}
+
+// Moves what is computed the same way on every round of a loop to
+// before the loop.  Only instructions without side effects are moved,
+// and none of them can trap, so it does not matter if they would not
+// have been run at all.  Constants that are used in the loop are kept
+// in a register from there, so they are not loaded on every round.
+//
+// Inner loops are done first, so what is moved out of one can be moved
+// further out of the loop around it.  All preheaders are made before
+// anything is moved, so the dominators only have to be found again
+// once: a preheader sits on an edge into a head and does not change
+// which of the other blocks dominate each other.
+static void
+ir_licm(IrFn* fn) {
+    ir_compute_doms(fn);
+    // The heads of loops, in reverse post-order, so the inner loops
+    // are last.
+    IrBlock** heads = mem_alloc_array(fn->mem, IrBlock*, fn->n_rpo);
+    uint32_t n_heads = 0;
+    for (uint32_t bi = 0; bi < fn->n_rpo; bi++) {
+        IrBlock* h = fn->rpo[bi];
+        for (uint32_t p = 0; p < h->n_preds; p++) {
+            if (ir_dominates(h, h->preds[p])) {
+                heads[n_heads++] = h;
+                break;
+            }
+        }
+    }
+    if (n_heads == 0) {
+        return;
+    }
+    // Every preheader takes two ids, for the block and its jump.
+    uint32_t n_words = (fn->n_ids + 2 * n_heads + 63) / 64;
+    uint64_t* body = mem_alloc_array(fn->mem, uint64_t, n_words);
+    IrBlock** work = mem_alloc_array(fn->mem, IrBlock*,
+                                     fn->n_blocks + n_heads);
+    IrBlock** pres = mem_alloc_array(fn->mem, IrBlock*, n_heads);
+    for (uint32_t hi = n_heads; hi-- > 0;) {
+        ir_loop_body(heads[hi], body, n_words, work);
+        pres[hi] = ir_preheader(fn, heads[hi], body);
+    }
+    ir_compute_doms(fn);
+    for (uint32_t hi = n_heads; hi-- > 0;) {
+        IrBlock* h = heads[hi];
+        IrBlock* pre = pres[hi];
+        if (pre == NULL) {
+            continue;
+        }
+        ir_loop_body(h, body, n_words, work);
+        // Operands come before their uses in reverse post-order, apart
+        // from phis, which are not moved.
+        for (uint32_t bi = h->order; bi < fn->n_rpo; bi++) {
+            IrBlock* b = fn->rpo[bi];
+            if (!ir_bit(body, b->id)) {
+                continue;
+            }
+            IrInstr* i = b->first;
+            while (i) {
+                IrInstr* next = i->next;
+                bool invariant = i->op != IR_PHI && i->op != IR_CALL
+                                 && !ir_is_terminator(i);
+                for (uint32_t k = 0; invariant && k < i->n_args; k++) {
+                    invariant = ir_outside(ir_arg(i, k), body);
+                }
+                if (invariant) {
+                    ir_move_before(i, pre->last);
+                }
+                i = next;
+            }
+        }
+        for (IrInstr* i = pre->first; i; i = i->next) {
+            if (i->op != IR_CONST || i->in_reg) {
+                continue;
+            }
+            for (IrUse* u = i->uses; u; u = u->next) {
+                enum IrOp op = u->user->op;
+                if (!ir_outside(u->user, body) && op != IR_PHI
+                    && !ir_is_terminator(u->user)
+                    && !ir_const_in_code(u->user, i)) {
+                    i->in_reg = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Whether the instruction before the jump at the end of b is a call,
+// apart from constants that have no code.
+static bool
+ir_jumps_after_call(const IrBlock* b) {
+    if (b->last->op != IR_JUMP) {
+        return false;
+    }
+    const IrInstr* i = b->last->prev;
+    while (i && i->op == IR_CONST && !i->in_reg) {
+        i = i->prev;
+    }
+    return i && i->op == IR_CALL;
+}
+
+// Tail calls.  A block that ends with a call and a jump to a block that
+// only returns gets a return of its own, so that the call is in tail
+// position.  Then calls of the function to itself that it returns
+// right after become jumps back to its start.  Functions have no
+// parameters, so nothing has to be passed along, and the start is moved
+// to a block of its own for the jumps to go to.
+static void
+ir_tail_calls(IrFn* fn) {
+    bool removed = false;
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        IrBlock* b = fn->blocks[bi];
+        if (!ir_jumps_after_call(b)) {
+            continue;
+        }
+        IrBlock* t = b->succs[0];
+        IrInstr* ret = t->first;
+        IrInstr* phi = NULL;
+        if (ret->op == IR_PHI && ret->uses && !ret->uses->next) {
+            phi = ret;
+            ret = ret->next;
+        }
+        if (ret->op != IR_RET
+            || (phi && (ret->n_args == 0 || ir_arg(ret, 0) != phi))) {
+            continue;
+        }
+        IrInstr* val = ret->n_args ? ir_arg(ret, 0) : NULL;
+        if (phi) {
+            uint32_t p = 0;
+            while (t->preds[p] != b) {
+                p++;
+            }
+            val = ir_arg(phi, p);
+        }
+        ir_remove_instr(b->last);
+        ir_remove_edge(fn, b, 0);
+        ir_add_ret(fn, b, val);
+        removed |= t->n_preds == 0;
+    }
+    if (removed) {
+        ir_remove_unreachable(fn);
+    }
+
+    IrBlock* start = fn->blocks[0];
+    IrBlock* entry = NULL;
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        IrBlock* b = fn->blocks[bi];
+        IrInstr* call = ir_tail_call(b->last);
+        if (call == NULL || call->binding != fn->name) {
+            continue;
+        }
+        if (entry == NULL) {
+            entry = ir_new_block(fn);
+            ir_add_jump(fn, entry, start);
+        }
+        ir_remove_instr(b->last);
+        ir_remove_instr(call);
+        ir_add_jump(fn, b, start);
+    }
+    if (entry) {
+        ir_insert_block_before(fn, entry, start);
+    }
+}
+
+// The number of instructions the function is selected to, about.
+static uint32_t
+ir_code_size(const IrFn* fn) {
+    uint32_t size = 0;
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        for (IrInstr* i = fn->blocks[bi]->first; i; i = i->next) {
+            if (i->op != IR_PHI && (ir_has_value(i) || ir_is_terminator(i))) {
+                size++;
+            }
+        }
+    }
+    return size;
+}
+
+// Replaces the call with a copy of the body of `callee`.  Its returns
+// become jumps to a new block with the code after the call, and the
+// value they return takes the place of the call.  If the callee never
+// returns, the code after the call can not be reached, and
+// ir_remove_unreachable has to be run.
+static void
+ir_inline_call(IrFn* fn, IrInstr* call, const IrFn* callee) {
+    IrBlock* b = call->block;
+    IrBlock* after = ir_new_block(fn);
+    after->first = call->next;
+    after->last = b->last;
+    after->first->prev = NULL;
+    for (IrInstr* i = after->first; i; i = i->next) {
+        i->block = after;
+    }
+    call->next = NULL;
+    b->last = call;
+    after->n_succs = b->n_succs;
+    for (uint32_t s = 0; s < b->n_succs; s++) {
+        IrBlock* t = b->succs[s];
+        after->succs[s] = t;
+        for (uint32_t p = 0; p < t->n_preds; p++) {
+            if (t->preds[p] == b) {
+                t->preds[p] = after;
+            }
+        }
+    }
+    b->n_succs = 0;
+
+    // The copies, by id in the callee.  The operands are set once all
+    // instructions are there, since a phi may use a later one.
+    IrBlock** blocks = mem_alloc_array(fn->mem, IrBlock*, callee->n_ids);
+    IrInstr** instrs = mem_alloc_array(fn->mem, IrInstr*, callee->n_ids);
+    IrBlock** rets = mem_alloc_array(fn->mem, IrBlock*, callee->n_blocks);
+    IrInstr** vals = mem_alloc_array(fn->mem, IrInstr*, callee->n_blocks);
+    uint32_t n_rets = 0;
+    for (uint32_t bi = 0; bi < callee->n_blocks; bi++) {
+        IrBlock* cb = callee->blocks[bi];
+        IrBlock* nb = ir_new_block(fn);
+        blocks[cb->id] = nb;
+        for (IrInstr* ci = cb->first; ci; ci = ci->next) {
+            IrInstr* ni;
+            if (ci->op == IR_RET) {
+                if (ci->n_args == 0) {
+                    // Falls off the end, which has no value.
+                    vals[n_rets] = ir_add_const(fn, nb, 0);
+                } else {
+                    vals[n_rets] = NULL;  // Set below.
+                }
+                rets[n_rets] = nb;
+                n_rets++;
+                ni = ir_new_instr(fn, IR_JUMP, 0);
+            } else {
+                ni = ir_new_instr(fn, ci->op, ci->n_args);
+                ni->imm = ci->imm;
+                ni->in_reg = ci->in_reg;
+                ni->binding = ci->binding;
+            }
+            instrs[ci->id] = ni;
+            ir_append(nb, ni);
+        }
+    }
+    for (uint32_t bi = 0; bi < callee->n_blocks; bi++) {
+        IrBlock* cb = callee->blocks[bi];
+        IrBlock* nb = blocks[cb->id];
+        nb->preds = mem_alloc_array(fn->mem, IrBlock*, cb->n_preds + 1);
+        nb->cap_preds = cb->n_preds + 1;
+        nb->n_preds = cb->n_preds;
+        for (uint32_t p = 0; p < cb->n_preds; p++) {
+            nb->preds[p] = blocks[cb->preds[p]->id];
+        }
+        nb->n_succs = cb->n_succs;
+        for (uint32_t s = 0; s < cb->n_succs; s++) {
+            nb->succs[s] = blocks[cb->succs[s]->id];
+        }
+        for (IrInstr* ci = cb->first; ci; ci = ci->next) {
+            if (ci->op == IR_RET) {
+                if (ci->n_args) {
+                    for (uint32_t r = 0; r < n_rets; r++) {
+                        if (rets[r] == nb) {
+                            vals[r] = instrs[ir_arg(ci, 0)->id];
+                        }
+                    }
+                }
+                nb->succs[0] = after;
+                nb->n_succs = 1;
+                continue;
+            }
+            for (uint32_t k = 0; k < ci->n_args; k++) {
+                ir_set_arg(instrs[ci->id], k, instrs[ir_arg(ci, k)->id]);
+            }
+        }
+    }
+    after->preds = rets;
+    after->n_preds = n_rets;
+    after->cap_preds = callee->n_blocks;
+
+    if (call->uses) {
+        IrInstr* result;
+        if (n_rets == 0) {
+            // Never returned from.
+            result = ir_add_const(fn, b, 0);
+        } else if (n_rets == 1) {
+            result = vals[0];
+        } else {
+            result = ir_add_phi(fn, after, NULL);
+            for (uint32_t r = 0; r < n_rets; r++) {
+                ir_add_arg(fn, result, vals[r]);
+            }
+        }
+        ir_replace_uses(call, result);
+    }
+    IrBlock* entry = blocks[callee->blocks[0]->id];
+    assert(entry->n_preds == 0);
+    ir_remove_instr(call);
+    ir_add_jump(fn, b, entry);
+
+    // The copies go right after b, and then the code after the call.
+    IrBlock** layout = mem_alloc_array(fn->mem, IrBlock*,
+                                       fn->n_blocks + callee->n_blocks + 1);
+    uint32_t n = 0;
+    for (uint32_t bi = 0; bi < fn->n_blocks; bi++) {
+        layout[n++] = fn->blocks[bi];
+        if (fn->blocks[bi] != b) {
+            continue;
+        }
+        for (uint32_t ci = 0; ci < callee->n_blocks; ci++) {
+            layout[n++] = blocks[callee->blocks[ci]->id];
+        }
+        layout[n++] = after;
+    }
+    fn->blocks = layout;
+    fn->n_blocks = n;
+    fn->cap_blocks = n;
+}
+
+// The passes, in order.  The IR is checked after each one with
+// --verify-ir.
+static void
+ir_optimize(IrFn* fn) {
+    ir_tail_calls(fn);
+    ir_check(fn, "tail_calls");
+    ir_gvn(fn);
+    ir_check(fn, "gvn");
+    ir_simplify_cfg(fn);
+    ir_check(fn, "simplify_cfg");
+    ir_dce(fn);
+    ir_check(fn, "dce");
+    ir_licm(fn);
+    ir_check(fn, "licm");
+    // What is moved out of different loops may be the same, and
+    // inlined code may fold to branches on constants.
+    ir_gvn(fn);
+    ir_check(fn, "gvn");
+    ir_simplify_cfg(fn);
+    ir_check(fn, "simplify_cfg");
+    ir_dce(fn);
+    ir_check(fn, "dce");
+}
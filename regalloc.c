@@ -0,0 +1,636 @@
+// Register allocation for one function, by linear scan over the live
+// intervals of its vregs.
+//
+// The instructions are numbered in the order they are laid out, and
+// the interval of a vreg goes from the first to the last instruction
+// where it is live.  Liveness is found on the blocks of the
+// instructions, so a value that is live around a loop covers all of
+// the loop.  The intervals get registers in the order they start.  One
+// that is live across a call gets a callee-saved register; the others
+// get a temporary if there is one, so that leaf functions do not have
+// to save anything.  x0 to x4 are never given out, and neither are a0
+// and a7, which calls, returns and system calls use.
+//
+// When there are not enough registers, the interval that ends last is
+// spilled, constants before other values.  A spilled constant is
+// loaded again where it is used, and other values get a slot in the
+// frame, by another scan, so values that are not live at the same time
+// share one.  Two temporaries are kept back then, to load them into.
+
+// In the order they are tried.
+static const enum reg ra_order[] = {
+    REG_T0, REG_T1, REG_T2, REG_A1, REG_A2, REG_A3, REG_A4, REG_A5,
+    REG_A6, REG_T3, REG_T4, REG_T5, REG_T6,
+    REG_S0, REG_S1, REG_S2, REG_S2 + 1, REG_S2 + 2, REG_S2 + 3,
+    REG_S2 + 4, REG_S2 + 5, REG_S2 + 6, REG_S2 + 7, REG_S2 + 8, REG_S11,
+};
+
+#define RA_SAVED_REGS \
+    ((1u << REG_S0) | (1u << REG_S1) | (((1u << 10) - 1) << REG_S2))
+
+// For loading spilled values.
+static const enum reg ra_scratch[2] = {REG_T5, REG_T6};
+
+// The largest frame that addi can make.  A bigger one is made with li
+// into a scratch register.
+#define RA_MAX_FRAME 2032
+
+// Whether the offset fits into the immediate of ld, sd or addi.
+static inline bool
+ra_fits_imm(int64_t imm) {
+    return imm >= -2048 && imm < 2048;
+}
+
+struct RaInterval {
+    Vreg* vreg;
+    uint32_t start;
+    uint32_t end;
+    uint32_t n_defs;
+    Rv64Instr* def;     // The last one.
+    bool across_call;
+    enum reg reg;       // Or REG_ZERO if it is spilled.
+    uint32_t slot;      // In the frame, if it is spilled.
+};
+
+struct RaBlock {
+    uint32_t first;
+    uint32_t last;
+    uint32_t succs[2];
+    uint32_t n_succs;
+    // Bit sets of interval indices.
+    uint64_t* use;      // Read before they are written in the block.
+    uint64_t* def;
+    uint64_t* live_in;
+    uint64_t* live_out;
+};
+
+// Where the vregs of an instruction are, so that they can be replaced.
+struct RaOperands {
+    Vreg** uses[2];
+    uint32_t n_uses;
+    Vreg** def;
+};
+
+static struct RaOperands
+ra_operands(Rv64Instr* instr) {
+    struct RaOperands o = {0};
+    switch (instr->type) {
+    case RV64_R:
+        o = (struct RaOperands){{&instr->r.rs1, &instr->r.rs2}, 2,
+                                &instr->r.rd};
+        break;
+    case RV64_I:
+        o = (struct RaOperands){{&instr->i.rs1}, 1, &instr->i.rd};
+        break;
+    case RV64_RI64:
+        o.def = &instr->ri64.rd;
+        break;
+    case RV64_B:
+        o = (struct RaOperands){{&instr->b.rs1, &instr->b.rs2}, 2, NULL};
+        break;
+    case RV64_S:
+        o = (struct RaOperands){{&instr->s.rs1, &instr->s.rs2}, 2, NULL};
+        break;
+    default:
+        break;
+    }
+    return o;
+}
+
+static bool
+ra_ends_block(const Rv64Instr* instr) {
+    return instr->type == RV64_B || instr->type == RV64_J
+        || (instr->type == RV64_I && instr->i.fn == rv64_write_jalr);
+}
+
+static bool
+ra_remat(const struct RaInterval* iv) {
+    return iv->n_defs == 1 && iv->def->type == RV64_RI64;
+}
+
+static void
+ra_extend(struct RaInterval* iv, uint32_t pos) {
+    if (pos < iv->start) {
+        iv->start = pos;
+    }
+    if (pos > iv->end) {
+        iv->end = pos;
+    }
+}
+
+// Whether a is better to spill than b.
+static bool
+ra_spill_before(const struct RaInterval* a, const struct RaInterval* b) {
+    if (ra_remat(a) != ra_remat(b)) {
+        return ra_remat(a);
+    }
+    return a->end > b->end;
+}
+
+static int
+cmp_ra_start(const void* a, const void* b) {
+    const struct RaInterval* x = *(const struct RaInterval**)a;
+    const struct RaInterval* y = *(const struct RaInterval**)b;
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->vreg->index < y->vreg->index ? -1 : 1;
+}
+
+// Gives the intervals, sorted by start, registers from `pool`.  Returns
+// whether any had to be spilled.
+static bool
+ra_scan(struct RaInterval** order, uint32_t n, uint32_t pool) {
+    struct RaInterval** active = mem_alloc_array(&scratch_mem,
+                                                 struct RaInterval*, n);
+    uint32_t n_active = 0;
+    uint32_t free = pool;
+    bool spilled = false;
+    for (uint32_t i = 0; i < n; i++) {
+        struct RaInterval* cur = order[i];
+        // Active intervals are sorted by end.  One that ends where cur
+        // starts is read by the instruction that writes cur, so they
+        // can share the register.
+        uint32_t k = 0;
+        while (k < n_active && active[k]->end <= cur->start) {
+            free |= 1u << active[k]->reg;
+            k++;
+        }
+        n_active -= k;
+        memmove(active, active + k, n_active * sizeof *active);
+        uint32_t allowed = cur->across_call ? free & RA_SAVED_REGS : free;
+        cur->reg = REG_ZERO;
+        for (size_t r = 0; r < ARR_LEN(ra_order); r++) {
+            if ((allowed >> ra_order[r]) & 1) {
+                cur->reg = ra_order[r];
+                break;
+            }
+        }
+        if (cur->reg == REG_ZERO) {
+            spilled = true;
+            uint32_t victim = n_active;
+            for (uint32_t a = 0; a < n_active; a++) {
+                if (cur->across_call
+                    && !((RA_SAVED_REGS >> active[a]->reg) & 1)) {
+                    continue;
+                }
+                if (ra_spill_before(active[a], victim == n_active
+                                               ? cur : active[victim])) {
+                    victim = a;
+                }
+            }
+            if (victim == n_active) {
+                continue;
+            }
+            cur->reg = active[victim]->reg;
+            active[victim]->reg = REG_ZERO;
+            n_active--;
+            memmove(active + victim, active + victim + 1,
+                    (n_active - victim) * sizeof *active);
+        } else {
+            free &= ~(1u << cur->reg);
+        }
+        k = n_active;
+        while (k > 0 && active[k - 1]->end > cur->end) {
+            active[k] = active[k - 1];
+            k--;
+        }
+        active[k] = cur;
+        n_active++;
+    }
+    return spilled;
+}
+
+// Gives the spilled intervals that are not constants, sorted by start,
+// slots from 0 up.  A slot is free again once its interval has ended.
+// Returns the number of slots.
+static uint32_t
+ra_scan_slots(struct RaInterval** order, uint32_t n) {
+    struct RaInterval** active = mem_alloc_array(&scratch_mem,
+                                                 struct RaInterval*, n);
+    uint32_t* free = mem_alloc_array(&scratch_mem, uint32_t, n);
+    uint32_t n_active = 0;
+    uint32_t n_free = 0;
+    uint32_t n_slots = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        struct RaInterval* cur = order[i];
+        if (cur->reg != REG_ZERO || ra_remat(cur)) {
+            continue;
+        }
+        // As with registers, the slot of an interval that ends where
+        // cur starts is read before cur is written.
+        uint32_t k = 0;
+        while (k < n_active && active[k]->end <= cur->start) {
+            free[n_free++] = active[k]->slot;
+            k++;
+        }
+        n_active -= k;
+        memmove(active, active + k, n_active * sizeof *active);
+        cur->slot = n_free > 0 ? free[--n_free] : n_slots++;
+        k = n_active;
+        while (k > 0 && active[k - 1]->end > cur->end) {
+            active[k] = active[k - 1];
+            k--;
+        }
+        active[k] = cur;
+        n_active++;
+    }
+    return n_slots;
+}
+
+// The frame of a function, from sp up: the saved registers, ra and the
+// spill slots.  The registers come first so that they are always in
+// reach of ld and sd.
+struct RaFrame {
+    ChunkArray* out;
+    Vreg* regs;         // A VREG_EXACT vreg for each register.
+    uint32_t size;
+    uint32_t saved;     // Callee-saved registers that are used.
+    uint32_t slots_at;
+    bool save_ra;
+};
+
+static Rv64Instr*
+ra_add(struct RaFrame* f, Rv64Instr instr) {
+    Rv64Instr* i = chunk_array_add(f->out);
+    *i = instr;
+    return i;
+}
+
+static void
+ra_add_i(struct RaFrame* f, Rv64FnI fn, enum reg rd, enum reg rs1,
+         int64_t imm) {
+    ra_add(f, (Rv64Instr){
+        .type = RV64_I,
+        .i = {fn, &f->regs[rd], &f->regs[rs1], imm},
+    });
+}
+
+static void
+ra_add_sd(struct RaFrame* f, enum reg rs1, enum reg rs2, int64_t imm) {
+    ra_add(f, (Rv64Instr){
+        .type = RV64_S,
+        .s = {rv64_write_sd, &f->regs[rs1], &f->regs[rs2], imm},
+    });
+}
+
+// Puts sp + at into rd, for a slot that ld and sd can not reach.
+static void
+ra_add_slot_addr(struct RaFrame* f, enum reg rd, uint32_t at) {
+    ra_add(f, (Rv64Instr){
+        .type = RV64_RI64,
+        .ri64 = {rv64_write_li, &f->regs[rd], at},
+    });
+    ra_add(f, (Rv64Instr){
+        .type = RV64_R,
+        .r = {rv64_write_add, &f->regs[rd], &f->regs[REG_SP], &f->regs[rd]},
+    });
+}
+
+static void
+ra_add_load(struct RaFrame* f, enum reg rd, uint32_t at) {
+    if (ra_fits_imm(at)) {
+        ra_add_i(f, rv64_write_ld, rd, REG_SP, at);
+    } else {
+        ra_add_slot_addr(f, rd, at);
+        ra_add_i(f, rv64_write_ld, rd, rd, 0);
+    }
+}
+
+// `tmp` is for the address if the slot is far away.
+static void
+ra_add_store(struct RaFrame* f, enum reg rs2, uint32_t at, enum reg tmp) {
+    if (ra_fits_imm(at)) {
+        ra_add_sd(f, REG_SP, rs2, at);
+    } else {
+        ra_add_slot_addr(f, tmp, at);
+        ra_add_sd(f, tmp, rs2, 0);
+    }
+}
+
+// Adds n to sp.  Only a frame with spill slots is too big for addi, and
+// the scratch registers are free then.
+static void
+ra_add_move_sp(struct RaFrame* f, int64_t n) {
+    if (ra_fits_imm(n)) {
+        ra_add_i(f, rv64_write_addi, REG_SP, REG_SP, n);
+        return;
+    }
+    ra_add(f, (Rv64Instr){
+        .type = RV64_RI64,
+        .ri64 = {rv64_write_li, &f->regs[ra_scratch[0]], n},
+    });
+    ra_add(f, (Rv64Instr){
+        .type = RV64_R,
+        .r = {rv64_write_add, &f->regs[REG_SP], &f->regs[REG_SP],
+              &f->regs[ra_scratch[0]]},
+    });
+}
+
+static void
+ra_add_prologue(struct RaFrame* f) {
+    if (f->size == 0) {
+        return;
+    }
+    ra_add_move_sp(f, -(int64_t)f->size);
+    uint32_t at = 0;
+    for (enum reg r = 0; r < 32; r++) {
+        if ((f->saved >> r) & 1) {
+            ra_add_sd(f, REG_SP, r, at);
+            at += 8;
+        }
+    }
+    if (f->save_ra) {
+        ra_add_sd(f, REG_SP, REG_RA, at);
+    }
+}
+
+static void
+ra_add_epilogue(struct RaFrame* f) {
+    if (f->size == 0) {
+        return;
+    }
+    uint32_t at = 0;
+    for (enum reg r = 0; r < 32; r++) {
+        if ((f->saved >> r) & 1) {
+            ra_add_i(f, rv64_write_ld, r, REG_SP, at);
+            at += 8;
+        }
+    }
+    if (f->save_ra) {
+        ra_add_i(f, rv64_write_ld, REG_RA, REG_SP, at);
+    }
+    ra_add_move_sp(f, f->size);
+}
+
+// Decides where the vregs of the function are, and puts the code for
+// the frame and for the spilled values into its instructions.
+static void
+allocate_vregs(struct FnCode* fc) {
+    MemMark mark = mem_mark(&scratch_mem);
+    uint32_t n = fc->vinstrs.len;
+    // The offset is the index until the instructions are encoded.
+    for (uint32_t i = 0; i < n; i++) {
+        ((Rv64Instr*)chunk_array_at(&fc->vinstrs, i))->offset = i;
+    }
+
+    // The intervals, and where the blocks start.
+    uint32_t* iv_of = mem_alloc_array(&scratch_mem, uint32_t, fc->vregs.len);
+    memset(iv_of, 0xff, fc->vregs.len * sizeof *iv_of);
+    struct RaInterval* ivs = mem_alloc_array(&scratch_mem, struct RaInterval,
+                                             fc->vregs.len);
+    uint32_t n_ivs = 0;
+    uint32_t* targets = mem_alloc_array(&scratch_mem, uint32_t, n);
+    memset(targets, 0xff, n * sizeof *targets);
+    bool* leader = mem_alloc_zero(&scratch_mem, (n + 1) * sizeof (bool),
+                                  _Alignof(bool));
+    // The number of calls before each instruction.
+    uint32_t* calls_before = mem_alloc_array(&scratch_mem, uint32_t, n + 1);
+    uint32_t n_calls = 0;
+    leader[0] = true;
+    for (uint32_t i = 0; i < n; i++) {
+        Rv64Instr* instr = chunk_array_at(&fc->vinstrs, i);
+        calls_before[i] = n_calls;
+        struct RaOperands o = ra_operands(instr);
+        for (uint32_t k = 0; k <= o.n_uses; k++) {
+            Vreg** p = k < o.n_uses ? o.uses[k] : o.def;
+            if (p == NULL || (*p)->state != VREG_USED) {
+                continue;
+            }
+            if (iv_of[(*p)->index] == UINT32_MAX) {
+                iv_of[(*p)->index] = n_ivs;
+                ivs[n_ivs] = (struct RaInterval){
+                    .vreg = *p,
+                    .start = UINT32_MAX,
+                };
+                n_ivs++;
+            }
+            struct RaInterval* iv = &ivs[iv_of[(*p)->index]];
+            ra_extend(iv, i);
+            if (p == o.def) {
+                iv->n_defs++;
+                iv->def = instr;
+            }
+        }
+        if (instr->type == PATCH) {
+            size_t t = instr->patch.target->offset;
+            targets[instr->patch.instr->offset] = t;
+            leader[t < n ? t : n] = true;
+        }
+        if (ra_ends_block(instr)) {
+            leader[i + 1] = true;
+        }
+        if (instr->type == RV64_J && instr->j.fn == rv64_write_call_unknown) {
+            n_calls++;
+        }
+    }
+    calls_before[n] = n_calls;
+
+    uint32_t n_blocks = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        n_blocks += leader[i];
+    }
+    struct RaBlock* blocks = mem_alloc_array(&scratch_mem, struct RaBlock,
+                                             n_blocks);
+    uint32_t* block_of = mem_alloc_array(&scratch_mem, uint32_t, n);
+    uint32_t n_words = (n_ivs + 63) / 64;
+    for (uint32_t i = 0, b = 0; i < n; i++) {
+        if (leader[i] && i > 0) {
+            b++;
+        }
+        if (leader[i]) {
+            blocks[b] = (struct RaBlock){
+                .first = i,
+                .use = mem_alloc_zero(&scratch_mem, n_words * 8, 8),
+                .def = mem_alloc_zero(&scratch_mem, n_words * 8, 8),
+                .live_in = mem_alloc_zero(&scratch_mem, n_words * 8, 8),
+                .live_out = mem_alloc_zero(&scratch_mem, n_words * 8, 8),
+            };
+        }
+        blocks[b].last = i;
+        block_of[i] = b;
+    }
+    for (uint32_t b = 0; b < n_blocks; b++) {
+        struct RaBlock* blk = &blocks[b];
+        const Rv64Instr* last = chunk_array_at(&fc->vinstrs, blk->last);
+        bool falls = true;
+        bool jump = last->type == RV64_J
+                    && last->j.fn == rv64_write_jump_unknown;
+        if (last->type == RV64_B || jump) {
+            // A jump with no target here goes to another function.
+            if (targets[blk->last] < n) {
+                blk->succs[blk->n_succs++] = block_of[targets[blk->last]];
+            }
+            falls = last->type == RV64_B;
+        } else if (last->type == RV64_I && last->i.fn == rv64_write_jalr) {
+            falls = false;
+        }
+        if (falls && blk->last + 1 < n) {
+            blk->succs[blk->n_succs++] = b + 1;
+        }
+        for (uint32_t i = blk->first; i <= blk->last; i++) {
+            struct RaOperands o = ra_operands(chunk_array_at(&fc->vinstrs, i));
+            for (uint32_t k = 0; k < o.n_uses; k++) {
+                Vreg* v = *o.uses[k];
+                if (v->state == VREG_USED
+                    && !ir_bit(blk->def, iv_of[v->index])) {
+                    ir_set_bit(blk->use, iv_of[v->index]);
+                }
+            }
+            if (o.def && (*o.def)->state == VREG_USED) {
+                ir_set_bit(blk->def, iv_of[(*o.def)->index]);
+            }
+        }
+    }
+    uint64_t* live = mem_alloc_array(&scratch_mem, uint64_t, n_words);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t b = n_blocks; b-- > 0;) {
+            struct RaBlock* blk = &blocks[b];
+            memset(live, 0, n_words * sizeof *live);
+            for (uint32_t s = 0; s < blk->n_succs; s++) {
+                for (uint32_t w = 0; w < n_words; w++) {
+                    live[w] |= blocks[blk->succs[s]].live_in[w];
+                }
+            }
+            memcpy(blk->live_out, live, n_words * sizeof *live);
+            for (uint32_t w = 0; w < n_words; w++) {
+                live[w] = blk->use[w] | (live[w] & ~blk->def[w]);
+            }
+            if (memcmp(live, blk->live_in, n_words * sizeof *live) != 0) {
+                memcpy(blk->live_in, live, n_words * sizeof *live);
+                changed = true;
+            }
+        }
+    }
+    for (uint32_t b = 0; b < n_blocks; b++) {
+        for (uint32_t w = 0; w < n_words; w++) {
+            for (uint64_t in = blocks[b].live_in[w]; in; in &= in - 1) {
+                ra_extend(&ivs[w * 64 + __builtin_ctzll(in)], blocks[b].first);
+            }
+            for (uint64_t out = blocks[b].live_out[w]; out; out &= out - 1) {
+                ra_extend(&ivs[w * 64 + __builtin_ctzll(out)], blocks[b].last);
+            }
+        }
+    }
+
+    struct RaInterval** order = mem_alloc_array(&scratch_mem,
+                                                struct RaInterval*, n_ivs);
+    for (uint32_t i = 0; i < n_ivs; i++) {
+        struct RaInterval* iv = &ivs[i];
+        iv->across_call = calls_before[iv->end] > calls_before[iv->start + 1];
+        order[i] = iv;
+    }
+    qsort(order, n_ivs, sizeof *order, cmp_ra_start);
+    uint32_t pool = 0;
+    for (size_t r = 0; r < ARR_LEN(ra_order); r++) {
+        pool |= 1u << ra_order[r];
+    }
+    bool spilled = ra_scan(order, n_ivs, pool);
+    if (spilled) {
+        pool &= ~(1u << ra_scratch[0] | 1u << ra_scratch[1]);
+        ra_scan(order, n_ivs, pool);
+    }
+
+    ChunkArray out = {.elem_size = sizeof (Rv64Instr), .mem = &fn_mem};
+    struct RaFrame f = {
+        .out = &out,
+        .regs = mem_alloc_zero(&fn_mem, 32 * sizeof (Vreg), _Alignof(Vreg)),
+        .save_ra = n_calls > 0,
+    };
+    for (enum reg r = 0; r < 32; r++) {
+        f.regs[r] = (Vreg){.state = VREG_EXACT, .reg = r};
+    }
+    uint32_t n_slots = spilled ? ra_scan_slots(order, n_ivs) : 0;
+    for (uint32_t i = 0; i < n_ivs; i++) {
+        if (ivs[i].reg != REG_ZERO) {
+            f.saved |= (RA_SAVED_REGS >> ivs[i].reg & 1) << ivs[i].reg;
+        }
+    }
+    f.slots_at = 8 * (__builtin_popcount(f.saved) + f.save_ra);
+    f.size = (f.slots_at + 8 * n_slots + 15) & ~15u;
+    assert(f.size <= RA_MAX_FRAME || spilled);
+    for (uint32_t i = 0; i < n_ivs; i++) {
+        struct RaInterval* iv = &ivs[i];
+        if (iv->reg != REG_ZERO) {
+            vreg_set_state_exact(iv->vreg, iv->reg);
+        } else if (ra_remat(iv)) {
+            iv->vreg->state = VREG_STATIC;
+            iv->vreg->val = iv->def->ri64.imm;
+        } else {
+            iv->vreg->state = VREG_STACK;
+            iv->vreg->slot = f.slots_at + 8 * iv->slot;
+        }
+    }
+
+    // Where the code for each instruction starts in the new ones, and
+    // where the instruction itself is.
+    uint32_t* start_of = mem_alloc_array(&scratch_mem, uint32_t, n + 1);
+    uint32_t* self_of = mem_alloc_array(&scratch_mem, uint32_t, n + 1);
+    for (uint32_t i = 0; i < n; i++) {
+        Rv64Instr in = *(Rv64Instr*)chunk_array_at(&fc->vinstrs, i);
+        start_of[i] = out.len;
+        self_of[i] = out.len;
+        if (in.type == FN_START) {
+            ra_add(&f, in);
+            ra_add_prologue(&f);
+            continue;
+        } else if (in.type == FN_LEAVE) {
+            ra_add_epilogue(&f);
+            continue;
+        }
+        struct RaOperands o = ra_operands(&in);
+        if (in.type == RV64_RI64 && in.ri64.rd->state == VREG_STATIC) {
+            // Loaded where it is used instead.
+            continue;
+        }
+        Vreg* first_use = o.n_uses ? *o.uses[0] : NULL;
+        for (uint32_t k = 0; k < o.n_uses; k++) {
+            Vreg* v = *o.uses[k];
+            enum reg s = ra_scratch[k];
+            if (k == 1 && v == first_use) {
+                *o.uses[1] = *o.uses[0];
+                continue;
+            } else if (v->state == VREG_STACK) {
+                ra_add_load(&f, s, v->slot);
+            } else if (v->state == VREG_STATIC) {
+                ra_add(&f, (Rv64Instr){
+                    .type = RV64_RI64,
+                    .ri64 = {rv64_write_li, &f.regs[s], v->val},
+                });
+            } else {
+                continue;
+            }
+            *o.uses[k] = &f.regs[s];
+        }
+        Vreg* spill = NULL;
+        if (o.def && (*o.def)->state == VREG_STACK) {
+            spill = *o.def;
+            *o.def = &f.regs[ra_scratch[0]];
+        }
+        self_of[i] = out.len;
+        ra_add(&f, in);
+        if (spill) {
+            ra_add_store(&f, ra_scratch[0], spill->slot, ra_scratch[1]);
+        }
+    }
+    start_of[n] = out.len;
+    self_of[n] = out.len;
+    for (size_t i = 0; i < out.len; i++) {
+        Rv64Instr* p = chunk_array_at(&out, i);
+        if (p->type == PATCH) {
+            size_t t = p->patch.target->offset;
+            p->patch.instr = chunk_array_at(&out,
+                                            self_of[p->patch.instr->offset]);
+            p->patch.target = chunk_array_at(&out, start_of[t < n ? t : n]);
+        }
+    }
+    for (size_t i = 0; i < fc->postinstrs.len; i++) {
+        Rv64Instr* p = chunk_array_at(&fc->postinstrs, i);
+        p->patch_binding.instr =
+            chunk_array_at(&out, self_of[p->patch_binding.instr->offset]);
+    }
+    fc->vinstrs = out;
+    mem_release(&scratch_mem, mark);
+}
@@ -1,10 +1,13 @@
 enum reg {
     REG_ZERO = 0,
     REG_RA = 1,
+    REG_SP = 2,
 
     REG_T0 = 5,
     REG_T1 = 6,
     REG_T2 = 7,
+    REG_S0 = 8,
+    REG_S1 = 9,
 
     REG_A0 = 10,
     REG_A1 = 11,
@@ -14,6 +17,8 @@ enum reg {
     REG_A5 = 15,
     REG_A6 = 16,
     REG_A7 = 17,
+    REG_S2 = 18,
+    REG_S11 = 27,
 
     REG_T3 = 28,
     REG_T4 = 29,
@@ -21,43 +26,6 @@ enum reg {
     REG_T6 = 31,
 };
 
-static uint32_t used_regs;
-
-static enum reg
-use_free_reg() {
-    for (size_t i = 1; i < 32; i++) {
-        if (!((used_regs >> i) & 1)) {
-            used_regs |= 1 << i;
-            return i;
-        }
-    }
-    abort();
-}
-
-static void
-unuse_reg(enum reg reg) {
-    used_regs &= ~(1 << reg);
-}
-
-struct Vreg;
-struct RegAllocInfo {
-    enum reg reg;
-    struct Vreg* used_in;
-};
-
-static const char*
-reg_name(enum reg r) {
-    static const char* names[] = {
-        "zero", "ra", "sp",  "gp",  "tp", "t0", "t1", "t2",
-        "fp",   "s1", "a0",  "a1",  "a2", "a3", "a4", "a5",
-        "a6",   "a7", "s2",  "s3",  "s4", "s5", "s6", "s7",
-        "s8",   "s9", "s10", "s11", "t3", "t4", "t5", "t6",
-    };
-    assert(r < ARR_LEN(names));
-    assert(r >= 0);
-    return names[r];
-}
-
 enum VregState {
     VREG_UNUSED,
     VREG_AST,
@@ -66,6 +34,7 @@ enum VregState {
     VREG_STATIC,   // Value known at compile time.
     VREG_MEM,      // The value is in memory at unknown address.
     VREG_MEM_ADDR, // The value is in memory and has an address.
+    VREG_STACK,    // Spilled to the function's frame.
 };
 
 // Variable register.  This is not any specific register.  It doesn't
@@ -73,77 +42,120 @@ enum VregState {
 struct Vreg {
     enum VregState state;
     union {
-        const Ast* ast;  // VREG_AST
+        AstRef ast;      // VREG_AST, in the tree of the function.
         enum reg reg;    // VREG_EXACT
-        const Ast* val;  // VREG_STATIC
+        uint64_t val;    // VREG_STATIC
         Location loc;    // VREG_MEM_ADDR
+        int32_t slot;    // VREG_STACK, offset from sp.
     };
     Binding* binding;
+    size_t index;  // Position in vregs.
 };
 typedef struct Vreg Vreg;
 
-#define MAX_VREGS 100
-static Vreg vregs[MAX_VREGS] = {
-    {
-        .state = VREG_EXACT,
-        .reg = REG_ZERO,
-    },
-};
+// Every thread that generates code has its own vregs.
+static _Thread_local ChunkArray vregs = {.elem_size = sizeof (Vreg)};
+
+// The vregs, instructions and text of the functions that are lowered
+// and encoded on this thread.  They are kept until the program is
+// linked.
+static _Thread_local Mem fn_mem;
+
+// No vreg before this index is unused.
+static _Thread_local size_t first_free_vreg_hint;
+
+// The vreg with the lowest index that is VREG_EXACT for each register
+// or NULL if there is none.
+static _Thread_local Vreg* exact_vregs[32];
+
+static Vreg*
+vreg_at(size_t i) {
+    return chunk_array_at(&vregs, i);
+}
 
-static size_t
-find_first_free_vreg_index() {
-    for (size_t i = 0; i < MAX_VREGS; i++) {
-        if (vregs[i].state == VREG_UNUSED) {
-            return i;
+static Vreg*
+alloc_vreg_any() {
+    for (size_t i = first_free_vreg_hint; i < vregs.len; i++) {
+        Vreg* v = vreg_at(i);
+        if (v->state == VREG_UNUSED) {
+            first_free_vreg_hint = i + 1;
+            return v;
         }
     }
-    abort();
+    Vreg* v = chunk_array_add(&vregs);
+    v->index = vregs.len - 1;
+    first_free_vreg_hint = vregs.len;
+    return v;
+}
+
+static void
+vreg_set_state_exact(Vreg* v, enum reg reg) {
+    v->state = VREG_EXACT;
+    v->reg = reg;
+    Vreg* first = exact_vregs[reg];
+    if (first == NULL || v->index < first->index) {
+        exact_vregs[reg] = v;
+    }
+}
+
+static void
+init_vregs() {
+    Vreg* zero = alloc_vreg_any();
+    vreg_set_state_exact(zero, REG_ZERO);
+}
+
+// Starts a new set of vregs.  The old vregs stay valid.
+static void
+reset_vregs() {
+    vregs = (ChunkArray){.elem_size = sizeof (Vreg), .mem = &fn_mem};
+    first_free_vreg_hint = 0;
+    memset(exact_vregs, 0, sizeof exact_vregs);
+    init_vregs();
 }
 
 static Vreg*
 alloc_vreg() {
-    Vreg* v = &vregs[find_first_free_vreg_index()];
+    Vreg* v = alloc_vreg_any();
     v->state = VREG_USED;
     return v;
 }
 
 static Vreg*
 alloc_vreg_mem() {
-    Vreg* v = &vregs[find_first_free_vreg_index()];
+    Vreg* v = alloc_vreg_any();
     v->state = VREG_MEM;
     return v;
 }
 
 static Vreg*
 alloc_vreg_ast() {
-    Vreg* v = &vregs[find_first_free_vreg_index()];
+    Vreg* v = alloc_vreg_any();
     v->state = VREG_AST;
     return v;
 }
 
 static Vreg*
 alloc_this_reg_assume_unused(enum reg r) {
-    Vreg* v = &vregs[find_first_free_vreg_index()];
-    v->state = VREG_EXACT;
-    v->reg = r;
+    Vreg* v = alloc_vreg_any();
+    vreg_set_state_exact(v, r);
     return v;
 }
 
 // Returns the vreg that has allocated this specific reg or NULL.
 static Vreg*
 get_used_reg(enum reg r) {
-    for (size_t i = 0; i < MAX_VREGS; i++) {
-        if (vregs[i].state == VREG_EXACT && vregs[i].reg == r) {
-            return &vregs[i];
-        }
-    }
-    return NULL;
+    return exact_vregs[r];
 }
 
 static Vreg*
 move_vreg(Vreg* r) {
     Vreg* new_vreg = alloc_vreg();
+    size_t index = new_vreg->index;
     *new_vreg = *r;
+    new_vreg->index = index;
+    if (new_vreg->state == VREG_EXACT) {
+        vreg_set_state_exact(new_vreg, new_vreg->reg);
+    }
     return new_vreg;
 }
 
@@ -162,18 +174,7 @@ alloc_this_reg(enum reg r) {
 
 static Vreg*
 get_vreg_zero() {
-    return &vregs[0];
-}
-
-static void
-free_vreg(Vreg* v) {
-    v->state = VREG_UNUSED;
-}
-
-static void
-vreg_set_state_exact(Vreg* v, enum reg reg) {
-    v->state = VREG_EXACT;
-    v->reg = reg;
+    return vreg_at(0);
 }
 
 static void
@@ -0,0 +1,977 @@
+// l-run: runs the RISC-V executables that the compiler writes, on any
+// Linux host.
+//
+// Guest code is decoded once into blocks of predecoded instructions
+// that end at the first jump, branch or ecall.  Each decoded
+// instruction holds the address of the code that executes it, so the
+// interpreter jumps straight from one instruction to the next, and a
+// block remembers the blocks it jumped to last so that most jumps do
+// not have to look anything up.
+//
+// Supports RV64I, M and C and the Linux system calls that programs of
+// the compiler make.  See run/README.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+
+// Guest addresses are offsets into one host mapping.  The stack is at
+// the top of it.
+#define GUEST_MEM_SIZE ((uint64_t)1 << 30)
+#define GUEST_STACK_SIZE ((uint64_t)8 << 20)
+
+#define MAX_BLOCK_OPS 64
+
+enum OpKind {
+    // Instructions that go on to the next one.
+    OP_LI,  // rd = imm.  Also LUI and AUIPC, whose value is known.
+    OP_ADDI,
+    OP_SLTI,
+    OP_SLTIU,
+    OP_XORI,
+    OP_ORI,
+    OP_ANDI,
+    OP_SLLI,
+    OP_SRLI,
+    OP_SRAI,
+    OP_ADDIW,
+    OP_SLLIW,
+    OP_SRLIW,
+    OP_SRAIW,
+    OP_ADD,
+    OP_SUB,
+    OP_SLL,
+    OP_SLT,
+    OP_SLTU,
+    OP_XOR,
+    OP_SRL,
+    OP_SRA,
+    OP_OR,
+    OP_AND,
+    OP_ADDW,
+    OP_SUBW,
+    OP_SLLW,
+    OP_SRLW,
+    OP_SRAW,
+    OP_MUL,
+    OP_MULH,
+    OP_MULHSU,
+    OP_MULHU,
+    OP_DIV,
+    OP_DIVU,
+    OP_REM,
+    OP_REMU,
+    OP_MULW,
+    OP_DIVW,
+    OP_DIVUW,
+    OP_REMW,
+    OP_REMUW,
+    OP_LB,
+    OP_LH,
+    OP_LW,
+    OP_LD,
+    OP_LBU,
+    OP_LHU,
+    OP_LWU,
+    OP_SB,
+    OP_SH,
+    OP_SW,
+    OP_SD,
+    OP_NOP,
+
+    // Instructions that end a block.
+    OP_BEQ,
+    OP_BNE,
+    OP_BLT,
+    OP_BGE,
+    OP_BLTU,
+    OP_BGEU,
+    OP_JAL,
+    OP_JALR,
+    OP_ECALL,
+    OP_EBREAK,
+    OP_FENCE_I,
+    OP_ILLEGAL,
+    OP_FETCH_FAULT,
+    OP_FALL_THROUGH,  // The block is full.
+    N_OP_KINDS,
+};
+
+// Writes to x0 go to this register instead, so that x0 stays 0.
+#define REG_SINK 32
+
+struct Op {
+    const void* code;  // Where the interpreter executes it.
+    int64_t imm;       // Absolute target for branches and JAL.
+    uint64_t pc;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t len;       // 2 or 4.
+    uint8_t kind;
+};
+
+struct Block {
+    uint64_t pc;
+    uint32_t n_ops;
+    // The blocks that were jumped to: [0] is the next instruction and
+    // [1] the target of a branch or jump.
+    struct Block* next[2];
+    struct Op ops[];
+};
+
+struct Cpu {
+    uint64_t x[33];  // REG_SINK is the last one.
+    uint64_t pc;
+    uint8_t* mem;
+    uint64_t brk;
+    uint64_t brk_start;
+
+    // Open addressing, keyed by pc.
+    struct Block** blocks;
+    size_t cap_blocks;
+    size_t n_blocks;
+
+    uint64_t n_instrs;
+    bool stats;
+};
+
+static bool
+in_guest(uint64_t addr, uint64_t size) {
+    return addr <= GUEST_MEM_SIZE && size <= GUEST_MEM_SIZE - addr;
+}
+
+static int64_t
+sext(uint64_t x, int bits) {
+    return (int64_t)(x << (64 - bits)) >> (64 - bits);
+}
+
+static uint32_t
+bits(uint32_t x, int hi, int lo) {
+    return (x >> lo) & ((1u << (hi - lo + 1)) - 1);
+}
+
+static void
+set_op(struct Op* op, enum OpKind kind, int rd, int rs1, int rs2,
+       int64_t imm) {
+    op->kind = kind;
+    op->rd = rd == 0 ? REG_SINK : rd;
+    op->rs1 = rs1;
+    op->rs2 = rs2;
+    op->imm = imm;
+}
+
+// Decodes a 32-bit instruction.
+static void
+decode32(uint32_t in, struct Op* op) {
+    int rd = bits(in, 11, 7);
+    int rs1 = bits(in, 19, 15);
+    int rs2 = bits(in, 24, 20);
+    int f3 = bits(in, 14, 12);
+    int f7 = bits(in, 31, 25);
+    int64_t imm_i = sext(in >> 20, 12);
+    int64_t imm_s = sext((bits(in, 31, 25) << 5) | bits(in, 11, 7), 12);
+    int64_t imm_b = sext((bits(in, 31, 31) << 12) | (bits(in, 7, 7) << 11)
+                         | (bits(in, 30, 25) << 5) | (bits(in, 11, 8) << 1),
+                         13);
+    int64_t imm_u = sext(in & 0xfffff000, 32);
+    int64_t imm_j = sext((bits(in, 31, 31) << 20) | (bits(in, 19, 12) << 12)
+                         | (bits(in, 20, 20) << 11) | (bits(in, 30, 21) << 1),
+                         21);
+    set_op(op, OP_ILLEGAL, 0, 0, 0, 0);
+    switch (bits(in, 6, 0)) {
+    case 0x37:  // LUI
+        set_op(op, OP_LI, rd, 0, 0, imm_u);
+        break;
+    case 0x17:  // AUIPC
+        set_op(op, OP_LI, rd, 0, 0, op->pc + imm_u);
+        break;
+    case 0x6f:
+        set_op(op, OP_JAL, rd, 0, 0, op->pc + imm_j);
+        break;
+    case 0x67:
+        if (f3 == 0) {
+            set_op(op, OP_JALR, rd, rs1, 0, imm_i);
+        }
+        break;
+    case 0x63: {
+        static const enum OpKind kinds[8] = {
+            OP_BEQ, OP_BNE, OP_ILLEGAL, OP_ILLEGAL,
+            OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+        };
+        set_op(op, kinds[f3], 0, rs1, rs2, op->pc + imm_b);
+    } break;
+    case 0x03: {
+        static const enum OpKind kinds[8] = {
+            OP_LB, OP_LH, OP_LW, OP_LD, OP_LBU, OP_LHU, OP_LWU, OP_ILLEGAL,
+        };
+        set_op(op, kinds[f3], rd, rs1, 0, imm_i);
+    } break;
+    case 0x23: {
+        static const enum OpKind kinds[8] = {
+            OP_SB, OP_SH, OP_SW, OP_SD,
+            OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL,
+        };
+        set_op(op, kinds[f3], 0, rs1, rs2, imm_s);
+    } break;
+    case 0x13: {
+        static const enum OpKind kinds[8] = {
+            OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU,
+            OP_XORI, OP_SRLI, OP_ORI, OP_ANDI,
+        };
+        enum OpKind k = kinds[f3];
+        int64_t imm = imm_i;
+        if (f3 == 1 || f3 == 5) {
+            imm = bits(in, 25, 20);
+            int f6 = bits(in, 31, 26);
+            if (f3 == 5 && f6 == 0x10) {
+                k = OP_SRAI;
+            } else if (f6 != 0) {
+                k = OP_ILLEGAL;
+            }
+        }
+        set_op(op, k, rd, rs1, 0, imm);
+    } break;
+    case 0x1b:
+        if (f3 == 0) {
+            set_op(op, OP_ADDIW, rd, rs1, 0, imm_i);
+        } else if (f3 == 1 && f7 == 0) {
+            set_op(op, OP_SLLIW, rd, rs1, 0, rs2);
+        } else if (f3 == 5 && f7 == 0) {
+            set_op(op, OP_SRLIW, rd, rs1, 0, rs2);
+        } else if (f3 == 5 && f7 == 0x20) {
+            set_op(op, OP_SRAIW, rd, rs1, 0, rs2);
+        }
+        break;
+    case 0x33: {
+        static const enum OpKind base[8] = {
+            OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND,
+        };
+        static const enum OpKind muldiv[8] = {
+            OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU,
+            OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+        };
+        enum OpKind k = OP_ILLEGAL;
+        if (f7 == 0) {
+            k = base[f3];
+        } else if (f7 == 1) {
+            k = muldiv[f3];
+        } else if (f7 == 0x20 && f3 == 0) {
+            k = OP_SUB;
+        } else if (f7 == 0x20 && f3 == 5) {
+            k = OP_SRA;
+        }
+        set_op(op, k, rd, rs1, rs2, 0);
+    } break;
+    case 0x3b: {
+        enum OpKind k = OP_ILLEGAL;
+        if (f7 == 0) {
+            k = f3 == 0 ? OP_ADDW : f3 == 1 ? OP_SLLW : f3 == 5 ? OP_SRLW
+                                                               : OP_ILLEGAL;
+        } else if (f7 == 0x20) {
+            k = f3 == 0 ? OP_SUBW : f3 == 5 ? OP_SRAW : OP_ILLEGAL;
+        } else if (f7 == 1) {
+            static const enum OpKind kinds[8] = {
+                OP_MULW, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL,
+                OP_DIVW, OP_DIVUW, OP_REMW, OP_REMUW,
+            };
+            k = kinds[f3];
+        }
+        set_op(op, k, rd, rs1, rs2, 0);
+    } break;
+    case 0x0f:  // FENCE and FENCE.I
+        set_op(op, f3 == 1 ? OP_FENCE_I : OP_NOP, 0, 0, 0, 0);
+        break;
+    case 0x73:
+        if (in == 0x00000073) {
+            set_op(op, OP_ECALL, 0, 0, 0, 0);
+        } else if (in == 0x00100073) {
+            set_op(op, OP_EBREAK, 0, 0, 0, 0);
+        }
+        break;
+    }
+}
+
+// Decodes a compressed instruction into the one it stands for.
+static void
+decode16(uint32_t in, struct Op* op) {
+    int f3 = bits(in, 15, 13);
+    int rd = bits(in, 11, 7);   // Also rs1.
+    int rs2 = bits(in, 6, 2);
+    int rdp = 8 + bits(in, 4, 2);  // rd' and rs2'
+    int rs1p = 8 + bits(in, 9, 7);
+    int64_t imm6 = sext((bits(in, 12, 12) << 5) | bits(in, 6, 2), 6);
+    uint32_t shamt = (bits(in, 12, 12) << 5) | bits(in, 6, 2);
+    set_op(op, OP_ILLEGAL, 0, 0, 0, 0);
+    switch ((bits(in, 1, 0) << 3) | f3) {
+    case 000: {  // C.ADDI4SPN
+        uint32_t imm = (bits(in, 12, 11) << 4) | (bits(in, 10, 7) << 6)
+                       | (bits(in, 6, 6) << 2) | (bits(in, 5, 5) << 3);
+        if (imm != 0) {
+            set_op(op, OP_ADDI, rdp, 2, 0, imm);
+        }
+    } break;
+    case 002:  // C.LW
+        set_op(op, OP_LW, rdp, rs1p, 0,
+               (bits(in, 12, 10) << 3) | (bits(in, 6, 6) << 2)
+               | (bits(in, 5, 5) << 6));
+        break;
+    case 003:  // C.LD
+        set_op(op, OP_LD, rdp, rs1p, 0,
+               (bits(in, 12, 10) << 3) | (bits(in, 6, 5) << 6));
+        break;
+    case 006:  // C.SW
+        set_op(op, OP_SW, 0, rs1p, rdp,
+               (bits(in, 12, 10) << 3) | (bits(in, 6, 6) << 2)
+               | (bits(in, 5, 5) << 6));
+        break;
+    case 007:  // C.SD
+        set_op(op, OP_SD, 0, rs1p, rdp,
+               (bits(in, 12, 10) << 3) | (bits(in, 6, 5) << 6));
+        break;
+    case 010:  // C.ADDI
+        set_op(op, OP_ADDI, rd, rd, 0, imm6);
+        break;
+    case 011:  // C.ADDIW
+        if (rd != 0) {
+            set_op(op, OP_ADDIW, rd, rd, 0, imm6);
+        }
+        break;
+    case 012:  // C.LI
+        set_op(op, OP_ADDI, rd, 0, 0, imm6);
+        break;
+    case 013:
+        if (rd == 2) {  // C.ADDI16SP
+            int64_t imm = sext((bits(in, 12, 12) << 9) | (bits(in, 6, 6) << 4)
+                               | (bits(in, 5, 5) << 6) | (bits(in, 4, 3) << 7)
+                               | (bits(in, 2, 2) << 5), 10);
+            if (imm != 0) {
+                set_op(op, OP_ADDI, 2, 2, 0, imm);
+            }
+        } else if (imm6 != 0) {  // C.LUI
+            set_op(op, OP_LI, rd, 0, 0, imm6 << 12);
+        }
+        break;
+    case 014:
+        switch (bits(in, 11, 10)) {
+        case 0:
+            set_op(op, OP_SRLI, rs1p, rs1p, 0, shamt);
+            break;
+        case 1:
+            set_op(op, OP_SRAI, rs1p, rs1p, 0, shamt);
+            break;
+        case 2:
+            set_op(op, OP_ANDI, rs1p, rs1p, 0, imm6);
+            break;
+        case 3: {
+            static const enum OpKind kinds[8] = {
+                OP_SUB, OP_XOR, OP_OR, OP_AND,
+                OP_SUBW, OP_ADDW, OP_ILLEGAL, OP_ILLEGAL,
+            };
+            int k = (bits(in, 12, 12) << 2) | bits(in, 6, 5);
+            set_op(op, kinds[k], rs1p, rs1p, rdp, 0);
+        } break;
+        }
+        break;
+    case 015:  // C.J
+        set_op(op, OP_JAL, 0, 0, 0,
+               op->pc + sext((bits(in, 12, 12) << 11) | (bits(in, 11, 11) << 4)
+                             | (bits(in, 10, 9) << 8) | (bits(in, 8, 8) << 10)
+                             | (bits(in, 7, 7) << 6) | (bits(in, 6, 6) << 7)
+                             | (bits(in, 5, 3) << 1) | (bits(in, 2, 2) << 5),
+                             12));
+        break;
+    case 016:  // C.BEQZ
+    case 017: {  // C.BNEZ
+        int64_t off = sext((bits(in, 12, 12) << 8) | (bits(in, 11, 10) << 3)
+                           | (bits(in, 6, 5) << 6) | (bits(in, 4, 3) << 1)
+                           | (bits(in, 2, 2) << 5), 9);
+        set_op(op, f3 == 6 ? OP_BEQ : OP_BNE, 0, rs1p, 0, op->pc + off);
+    } break;
+    case 020:  // C.SLLI
+        set_op(op, OP_SLLI, rd, rd, 0, shamt);
+        break;
+    case 022:  // C.LWSP
+        if (rd != 0) {
+            set_op(op, OP_LW, rd, 2, 0,
+                   (bits(in, 12, 12) << 5) | (bits(in, 6, 4) << 2)
+                   | (bits(in, 3, 2) << 6));
+        }
+        break;
+    case 023:  // C.LDSP
+        if (rd != 0) {
+            set_op(op, OP_LD, rd, 2, 0,
+                   (bits(in, 12, 12) << 5) | (bits(in, 6, 5) << 3)
+                   | (bits(in, 4, 2) << 6));
+        }
+        break;
+    case 024:
+        if (bits(in, 12, 12) == 0) {
+            if (rs2 == 0 && rd != 0) {  // C.JR
+                set_op(op, OP_JALR, 0, rd, 0, 0);
+            } else if (rs2 != 0) {  // C.MV
+                set_op(op, OP_ADD, rd, 0, rs2, 0);
+            }
+        } else if (rd == 0 && rs2 == 0) {
+            set_op(op, OP_EBREAK, 0, 0, 0, 0);
+        } else if (rs2 == 0) {  // C.JALR
+            set_op(op, OP_JALR, 1, rd, 0, 0);
+        } else {  // C.ADD
+            set_op(op, OP_ADD, rd, rd, rs2, 0);
+        }
+        break;
+    case 026:  // C.SWSP
+        set_op(op, OP_SW, 0, 2, rs2,
+               (bits(in, 12, 9) << 2) | (bits(in, 8, 7) << 6));
+        break;
+    case 027:  // C.SDSP
+        set_op(op, OP_SD, 0, 2, rs2,
+               (bits(in, 12, 10) << 3) | (bits(in, 9, 7) << 6));
+        break;
+    }
+}
+
+static bool
+ends_block(enum OpKind kind) {
+    return kind >= OP_BEQ;
+}
+
+// Decodes the block at pc.  code has the address of the code of each
+// kind of op.
+static struct Block*
+decode_block(struct Cpu* cpu, uint64_t pc, const void* const* code) {
+    struct Op ops[MAX_BLOCK_OPS];
+    uint32_t n = 0;
+    for (;;) {
+        struct Op* op = &ops[n];
+        *op = (struct Op){.pc = pc};
+        uint16_t lo;
+        uint16_t hi;
+        if (pc % 2 != 0 || !in_guest(pc, 2)) {
+            set_op(op, OP_FETCH_FAULT, 0, 0, 0, 0);
+        } else if (memcpy(&lo, cpu->mem + pc, 2), (lo & 3) != 3) {
+            op->len = 2;
+            decode16(lo, op);
+        } else if (!in_guest(pc + 2, 2)) {
+            set_op(op, OP_FETCH_FAULT, 0, 0, 0, 0);
+        } else {
+            memcpy(&hi, cpu->mem + pc + 2, 2);
+            op->len = 4;
+            decode32(lo | (uint32_t)hi << 16, op);
+        }
+        pc += op->len;
+        n++;
+        if (ends_block(op->kind)) {
+            break;
+        }
+        if (n == MAX_BLOCK_OPS - 1) {
+            ops[n] = (struct Op){.pc = pc};
+            set_op(&ops[n], OP_FALL_THROUGH, 0, 0, 0, 0);
+            n++;
+            break;
+        }
+    }
+    struct Block* b = malloc(sizeof *b + n * sizeof *ops);
+    if (b == NULL) {
+        perror("malloc");
+        abort();
+    }
+    *b = (struct Block){.pc = ops[0].pc, .n_ops = n};
+    for (uint32_t i = 0; i < n; i++) {
+        b->ops[i] = ops[i];
+        b->ops[i].code = code[ops[i].kind];
+    }
+    return b;
+}
+
+static size_t
+block_slot(uint64_t pc, size_t cap) {
+    return ((pc >> 1) * 0x9e3779b97f4a7c15u) >> 32 & (cap - 1);
+}
+
+static void
+grow_blocks(struct Cpu* cpu) {
+    size_t cap = cpu->cap_blocks ? cpu->cap_blocks * 2 : 1024;
+    struct Block** blocks = calloc(cap, sizeof *blocks);
+    if (blocks == NULL) {
+        perror("calloc");
+        abort();
+    }
+    for (size_t i = 0; i < cpu->cap_blocks; i++) {
+        struct Block* b = cpu->blocks[i];
+        if (b) {
+            size_t j = block_slot(b->pc, cap);
+            while (blocks[j]) {
+                j = (j + 1) & (cap - 1);
+            }
+            blocks[j] = b;
+        }
+    }
+    free(cpu->blocks);
+    cpu->blocks = blocks;
+    cpu->cap_blocks = cap;
+}
+
+static struct Block*
+get_block(struct Cpu* cpu, uint64_t pc, const void* const* code) {
+    if ((cpu->n_blocks + 1) * 2 > cpu->cap_blocks) {
+        grow_blocks(cpu);
+    }
+    size_t mask = cpu->cap_blocks - 1;
+    size_t i = block_slot(pc, cpu->cap_blocks);
+    for (; cpu->blocks[i]; i = (i + 1) & mask) {
+        if (cpu->blocks[i]->pc == pc) {
+            return cpu->blocks[i];
+        }
+    }
+    struct Block* b = decode_block(cpu, pc, code);
+    cpu->blocks[i] = b;
+    cpu->n_blocks++;
+    return b;
+}
+
+// For FENCE.I, after the guest has written code.
+static void
+flush_blocks(struct Cpu* cpu) {
+    for (size_t i = 0; i < cpu->cap_blocks; i++) {
+        free(cpu->blocks[i]);
+        cpu->blocks[i] = NULL;
+    }
+    cpu->n_blocks = 0;
+}
+
+// Returns the value of the system call, or sets *exit_status if the
+// guest exits.
+static uint64_t
+guest_syscall(struct Cpu* cpu, bool* exited, int* exit_status) {
+    uint64_t* a = &cpu->x[10];
+    switch (cpu->x[17]) {
+    case 93:  // exit
+    case 94:  // exit_group
+        *exited = true;
+        *exit_status = a[0] & 0xff;
+        return 0;
+    case 63:  // read
+    case 64: {  // write
+        if (!in_guest(a[1], a[2])) {
+            return -EFAULT;
+        }
+        ssize_t n = cpu->x[17] == 63 ? read(a[0], cpu->mem + a[1], a[2])
+                                     : write(a[0], cpu->mem + a[1], a[2]);
+        return n < 0 ? -errno : n;
+    }
+    case 214:  // brk
+        if (a[0] >= cpu->brk_start
+            && a[0] <= GUEST_MEM_SIZE - GUEST_STACK_SIZE) {
+            cpu->brk = a[0];
+        }
+        return cpu->brk;
+    default:
+        return -ENOSYS;
+    }
+}
+
+static int
+fault(const char* what, uint64_t pc, int sig) {
+    fprintf(stderr, "l-run: %s at pc 0x%lx\n", what, pc);
+    return 128 + sig;
+}
+
+// Runs the guest until it exits.  Returns its exit status, or 128 plus
+// a signal number if it faults.
+static int
+run(struct Cpu* cpu) {
+    static const void* const code[N_OP_KINDS] = {
+        [OP_LI] = &&op_li,
+        [OP_ADDI] = &&op_addi,
+        [OP_SLTI] = &&op_slti,
+        [OP_SLTIU] = &&op_sltiu,
+        [OP_XORI] = &&op_xori,
+        [OP_ORI] = &&op_ori,
+        [OP_ANDI] = &&op_andi,
+        [OP_SLLI] = &&op_slli,
+        [OP_SRLI] = &&op_srli,
+        [OP_SRAI] = &&op_srai,
+        [OP_ADDIW] = &&op_addiw,
+        [OP_SLLIW] = &&op_slliw,
+        [OP_SRLIW] = &&op_srliw,
+        [OP_SRAIW] = &&op_sraiw,
+        [OP_ADD] = &&op_add,
+        [OP_SUB] = &&op_sub,
+        [OP_SLL] = &&op_sll,
+        [OP_SLT] = &&op_slt,
+        [OP_SLTU] = &&op_sltu,
+        [OP_XOR] = &&op_xor,
+        [OP_SRL] = &&op_srl,
+        [OP_SRA] = &&op_sra,
+        [OP_OR] = &&op_or,
+        [OP_AND] = &&op_and,
+        [OP_ADDW] = &&op_addw,
+        [OP_SUBW] = &&op_subw,
+        [OP_SLLW] = &&op_sllw,
+        [OP_SRLW] = &&op_srlw,
+        [OP_SRAW] = &&op_sraw,
+        [OP_MUL] = &&op_mul,
+        [OP_MULH] = &&op_mulh,
+        [OP_MULHSU] = &&op_mulhsu,
+        [OP_MULHU] = &&op_mulhu,
+        [OP_DIV] = &&op_div,
+        [OP_DIVU] = &&op_divu,
+        [OP_REM] = &&op_rem,
+        [OP_REMU] = &&op_remu,
+        [OP_MULW] = &&op_mulw,
+        [OP_DIVW] = &&op_divw,
+        [OP_DIVUW] = &&op_divuw,
+        [OP_REMW] = &&op_remw,
+        [OP_REMUW] = &&op_remuw,
+        [OP_LB] = &&op_lb,
+        [OP_LH] = &&op_lh,
+        [OP_LW] = &&op_lw,
+        [OP_LD] = &&op_ld,
+        [OP_LBU] = &&op_lbu,
+        [OP_LHU] = &&op_lhu,
+        [OP_LWU] = &&op_lwu,
+        [OP_SB] = &&op_sb,
+        [OP_SH] = &&op_sh,
+        [OP_SW] = &&op_sw,
+        [OP_SD] = &&op_sd,
+        [OP_NOP] = &&op_nop,
+        [OP_BEQ] = &&op_beq,
+        [OP_BNE] = &&op_bne,
+        [OP_BLT] = &&op_blt,
+        [OP_BGE] = &&op_bge,
+        [OP_BLTU] = &&op_bltu,
+        [OP_BGEU] = &&op_bgeu,
+        [OP_JAL] = &&op_jal,
+        [OP_JALR] = &&op_jalr,
+        [OP_ECALL] = &&op_ecall,
+        [OP_EBREAK] = &&op_ebreak,
+        [OP_FENCE_I] = &&op_fence_i,
+        [OP_ILLEGAL] = &&op_illegal,
+        [OP_FETCH_FAULT] = &&op_fetch_fault,
+        [OP_FALL_THROUGH] = &&op_fall_through,
+    };
+    uint64_t* x = cpu->x;
+    uint8_t* mem = cpu->mem;
+    struct Block* b = get_block(cpu, cpu->pc, code);
+    const struct Op* op;
+    uint64_t addr;
+    uint64_t target;
+    bool exited = false;
+    int exit_status = 0;
+
+#define NEXT() do { op++; goto *op->code; } while (0)
+#define RD x[op->rd]
+#define RS1 x[op->rs1]
+#define RS2 x[op->rs2]
+#define SRS1 ((int64_t)x[op->rs1])
+#define SRS2 ((int64_t)x[op->rs2])
+#define W(v) ((uint64_t)(int64_t)(int32_t)(v))
+// Goes on to the block in b->next[slot], which starts at target.
+#define GOTO_BLOCK(slot, to) do { \
+        target = (to); \
+        struct Block* n = b->next[slot]; \
+        if (n == NULL || n->pc != target) { \
+            n = get_block(cpu, target, code); \
+            b->next[slot] = n; \
+        } \
+        b = n; \
+        goto enter; \
+    } while (0)
+#define LOAD(type) do { \
+        addr = RS1 + op->imm; \
+        if (!in_guest(addr, sizeof (type))) { \
+            goto load_fault; \
+        } \
+        type v; \
+        memcpy(&v, mem + addr, sizeof v); \
+        RD = v; \
+        NEXT(); \
+    } while (0)
+#define STORE(type) do { \
+        addr = RS1 + op->imm; \
+        if (!in_guest(addr, sizeof (type))) { \
+            goto store_fault; \
+        } \
+        type v = RS2; \
+        memcpy(mem + addr, &v, sizeof v); \
+        NEXT(); \
+    } while (0)
+
+enter:
+    cpu->n_instrs += b->n_ops;
+    op = b->ops;
+    goto *op->code;
+
+op_li:     RD = op->imm; NEXT();
+op_addi:   RD = RS1 + op->imm; NEXT();
+op_slti:   RD = SRS1 < op->imm; NEXT();
+op_sltiu:  RD = RS1 < (uint64_t)op->imm; NEXT();
+op_xori:   RD = RS1 ^ op->imm; NEXT();
+op_ori:    RD = RS1 | op->imm; NEXT();
+op_andi:   RD = RS1 & op->imm; NEXT();
+op_slli:   RD = RS1 << op->imm; NEXT();
+op_srli:   RD = RS1 >> op->imm; NEXT();
+op_srai:   RD = SRS1 >> op->imm; NEXT();
+op_addiw:  RD = W(RS1 + op->imm); NEXT();
+op_slliw:  RD = W((uint32_t)RS1 << op->imm); NEXT();
+op_srliw:  RD = W((uint32_t)RS1 >> op->imm); NEXT();
+op_sraiw:  RD = W((int32_t)RS1 >> op->imm); NEXT();
+op_add:    RD = RS1 + RS2; NEXT();
+op_sub:    RD = RS1 - RS2; NEXT();
+op_sll:    RD = RS1 << (RS2 & 63); NEXT();
+op_slt:    RD = SRS1 < SRS2; NEXT();
+op_sltu:   RD = RS1 < RS2; NEXT();
+op_xor:    RD = RS1 ^ RS2; NEXT();
+op_srl:    RD = RS1 >> (RS2 & 63); NEXT();
+op_sra:    RD = SRS1 >> (RS2 & 63); NEXT();
+op_or:     RD = RS1 | RS2; NEXT();
+op_and:    RD = RS1 & RS2; NEXT();
+op_addw:   RD = W(RS1 + RS2); NEXT();
+op_subw:   RD = W(RS1 - RS2); NEXT();
+op_sllw:   RD = W((uint32_t)RS1 << (RS2 & 31)); NEXT();
+op_srlw:   RD = W((uint32_t)RS1 >> (RS2 & 31)); NEXT();
+op_sraw:   RD = W((int32_t)RS1 >> (RS2 & 31)); NEXT();
+op_mul:    RD = RS1 * RS2; NEXT();
+op_mulh:   RD = ((__int128)SRS1 * SRS2) >> 64; NEXT();
+op_mulhsu: RD = ((__int128)SRS1 * (unsigned __int128)RS2) >> 64; NEXT();
+op_mulhu:  RD = ((unsigned __int128)RS1 * RS2) >> 64; NEXT();
+op_div:
+    RD = RS2 == 0 ? UINT64_MAX
+       : SRS1 == INT64_MIN && SRS2 == -1 ? RS1
+       : (uint64_t)(SRS1 / SRS2);
+    NEXT();
+op_divu:   RD = RS2 == 0 ? UINT64_MAX : RS1 / RS2; NEXT();
+op_rem:
+    RD = RS2 == 0 ? RS1
+       : SRS1 == INT64_MIN && SRS2 == -1 ? 0
+       : (uint64_t)(SRS1 % SRS2);
+    NEXT();
+op_remu:   RD = RS2 == 0 ? RS1 : RS1 % RS2; NEXT();
+op_mulw:   RD = W(RS1 * RS2); NEXT();
+op_divw: {
+    int32_t l = RS1;
+    int32_t r = RS2;
+    RD = r == 0 ? UINT64_MAX : l == INT32_MIN && r == -1 ? W(l) : W(l / r);
+    NEXT();
+}
+op_divuw: {
+    uint32_t l = RS1;
+    uint32_t r = RS2;
+    RD = r == 0 ? UINT64_MAX : W(l / r);
+    NEXT();
+}
+op_remw: {
+    int32_t l = RS1;
+    int32_t r = RS2;
+    RD = r == 0 ? W(l) : l == INT32_MIN && r == -1 ? 0 : W(l % r);
+    NEXT();
+}
+op_remuw: {
+    uint32_t l = RS1;
+    uint32_t r = RS2;
+    RD = r == 0 ? W(l) : W(l % r);
+    NEXT();
+}
+op_lb:     LOAD(int8_t);
+op_lh:     LOAD(int16_t);
+op_lw:     LOAD(int32_t);
+op_ld:     LOAD(uint64_t);
+op_lbu:    LOAD(uint8_t);
+op_lhu:    LOAD(uint16_t);
+op_lwu:    LOAD(uint32_t);
+op_sb:     STORE(uint8_t);
+op_sh:     STORE(uint16_t);
+op_sw:     STORE(uint32_t);
+op_sd:     STORE(uint64_t);
+op_nop:    NEXT();
+
+op_beq:
+    if (RS1 == RS2) GOTO_BLOCK(1, op->imm);
+    GOTO_BLOCK(0, op->pc + op->len);
+op_bne:
+    if (RS1 != RS2) GOTO_BLOCK(1, op->imm);
+    GOTO_BLOCK(0, op->pc + op->len);
+op_blt:
+    if (SRS1 < SRS2) GOTO_BLOCK(1, op->imm);
+    GOTO_BLOCK(0, op->pc + op->len);
+op_bge:
+    if (SRS1 >= SRS2) GOTO_BLOCK(1, op->imm);
+    GOTO_BLOCK(0, op->pc + op->len);
+op_bltu:
+    if (RS1 < RS2) GOTO_BLOCK(1, op->imm);
+    GOTO_BLOCK(0, op->pc + op->len);
+op_bgeu:
+    if (RS1 >= RS2) GOTO_BLOCK(1, op->imm);
+    GOTO_BLOCK(0, op->pc + op->len);
+op_jal:
+    RD = op->pc + op->len;
+    GOTO_BLOCK(1, op->imm);
+op_jalr: {
+    // rd may be rs1.
+    uint64_t t = (RS1 + op->imm) & ~(uint64_t)1;
+    RD = op->pc + op->len;
+    GOTO_BLOCK(1, t);
+}
+op_ecall:
+    x[10] = guest_syscall(cpu, &exited, &exit_status);
+    if (exited) {
+        return exit_status;
+    }
+    GOTO_BLOCK(0, op->pc + op->len);
+op_fence_i:
+    // Frees the block that op is in.
+    target = op->pc + op->len;
+    flush_blocks(cpu);
+    b = get_block(cpu, target, code);
+    goto enter;
+op_fall_through:
+    // Not an instruction.
+    cpu->n_instrs--;
+    GOTO_BLOCK(0, op->pc);
+
+op_ebreak:
+    cpu->n_instrs -= b->ops + b->n_ops - op - 1;
+    return fault("ebreak", op->pc, SIGTRAP);
+op_illegal:
+    cpu->n_instrs -= b->ops + b->n_ops - op - 1;
+    return fault("illegal instruction", op->pc, SIGILL);
+op_fetch_fault:
+    cpu->n_instrs -= b->ops + b->n_ops - op;
+    return fault("instruction fetch fault", op->pc, SIGSEGV);
+load_fault:
+    cpu->n_instrs -= b->ops + b->n_ops - op - 1;
+    fprintf(stderr, "l-run: load from 0x%lx\n", addr);
+    return fault("load fault", op->pc, SIGSEGV);
+store_fault:
+    cpu->n_instrs -= b->ops + b->n_ops - op - 1;
+    fprintf(stderr, "l-run: store to 0x%lx\n", addr);
+    return fault("store fault", op->pc, SIGSEGV);
+
+#undef NEXT
+#undef RD
+#undef RS1
+#undef RS2
+#undef SRS1
+#undef SRS2
+#undef W
+#undef GOTO_BLOCK
+#undef LOAD
+#undef STORE
+}
+
+// Copies the PT_LOAD segments of the file into guest memory.
+static bool
+load_elf(struct Cpu* cpu, const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    bool ok = false;
+    Elf64_Ehdr eh;
+    if (fread(&eh, sizeof eh, 1, f) != 1
+        || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0
+        || eh.e_ident[EI_CLASS] != ELFCLASS64
+        || eh.e_ident[EI_DATA] != ELFDATA2LSB
+        || eh.e_machine != EM_RISCV) {
+        fprintf(stderr, "%s: Not a 64-bit RISC-V ELF file\n", path);
+        goto done;
+    }
+    uint64_t end = 0;
+    for (int i = 0; i < eh.e_phnum; i++) {
+        Elf64_Phdr ph;
+        if (fseek(f, eh.e_phoff + i * sizeof ph, SEEK_SET) != 0
+            || fread(&ph, sizeof ph, 1, f) != 1) {
+            fprintf(stderr, "%s: Bad program header\n", path);
+            goto done;
+        }
+        if (ph.p_type != PT_LOAD) {
+            continue;
+        }
+        if (ph.p_filesz > ph.p_memsz
+            || !in_guest(ph.p_vaddr, ph.p_memsz)
+            || ph.p_vaddr + ph.p_memsz > GUEST_MEM_SIZE - GUEST_STACK_SIZE) {
+            fprintf(stderr, "%s: Segment at 0x%lx does not fit\n", path,
+                    ph.p_vaddr);
+            goto done;
+        }
+        if (fseek(f, ph.p_offset, SEEK_SET) != 0
+            || fread(cpu->mem + ph.p_vaddr, 1, ph.p_filesz, f)
+               != ph.p_filesz) {
+            fprintf(stderr, "%s: Segment at 0x%lx is cut short\n", path,
+                    ph.p_vaddr);
+            goto done;
+        }
+        if (ph.p_vaddr + ph.p_memsz > end) {
+            end = ph.p_vaddr + ph.p_memsz;
+        }
+    }
+    cpu->pc = eh.e_entry;
+    cpu->brk_start = (end + 0xfff) & ~(uint64_t)0xfff;
+    cpu->brk = cpu->brk_start;
+    ok = true;
+done:
+    fclose(f);
+    return ok;
+}
+
+static double
+now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char** argv) {
+    struct Cpu cpu = {0};
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            cpu.stats = true;
+        } else if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (i >= argc) {
+        fprintf(stderr, "usage: l-run [--stats] file\n");
+        return 1;
+    }
+    cpu.mem = mmap(NULL, GUEST_MEM_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (cpu.mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (!load_elf(&cpu, argv[i])) {
+        return 1;
+    }
+    // An empty argv, envp and auxv.
+    cpu.x[2] = GUEST_MEM_SIZE - 64;
+
+    double start = now_s();
+    int status = run(&cpu);
+    double secs = now_s() - start;
+    if (cpu.stats) {
+        fprintf(stderr, "instructions  %lu\n", cpu.n_instrs);
+        fprintf(stderr, "blocks        %zu\n", cpu.n_blocks);
+        fprintf(stderr, "time          %.3f ms\n", secs * 1e3);
+        fprintf(stderr, "MIPS          %.1f\n",
+                secs > 0 ? cpu.n_instrs / secs / 1e6 : 0);
+    }
+    return status;
+}
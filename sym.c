@@ -0,0 +1,206 @@
+// Every distinct name in the program is interned once and referred to
+// by a Sym after that, so comparing names is comparing integers.
+typedef uint32_t Sym;
+
+// Keywords and builtin names have fixed symbols.
+enum {
+    SYM_IF,
+    SYM_WHILE,
+    SYM_EXIT,
+    SYM_RETURN,
+    SYM_MAIN,
+    SYM_VOID,
+    SYM_BOOL,
+    SYM_I8,
+    SYM_U8,
+    SYM_I16,
+    SYM_U16,
+    SYM_I32,
+    SYM_U32,
+    SYM_I64,
+    SYM_U64,
+    SYM_ISIZE,
+    SYM_USIZE,
+    N_BUILTIN_SYMS,
+};
+
+// Names are spread over shards that are locked separately, so that
+// files can be lexed on several threads at once.  The top bits of a
+// Sym select the shard and the rest is the index in the shard.
+#define SYM_SHARD_BITS 6
+#define N_SYM_SHARDS (1 << SYM_SHARD_BITS)
+#define SYM_INDEX_BITS (32 - SYM_SHARD_BITS)
+#define SYM_INDEX_MASK ((1u << SYM_INDEX_BITS) - 1)
+
+struct SymShard {
+    pthread_mutex_t lock;
+    Str* strs;       // Indexed by the index part of a Sym.
+    size_t n_strs;
+    size_t cap_strs;
+    uint32_t* table; // Index + 1 per slot, 0 for empty.
+    size_t cap_table;
+    size_t n_table;
+};
+
+// The builtin symbols are the first ones in shard 0.
+static struct SymShard sym_shards[N_SYM_SHARDS];
+
+struct BuiltinSym {
+    Str name;
+    Sym sym;
+};
+
+// The constants make the hash collision free for the builtin names.
+// They have to be searched for again if a builtin name is added.
+#define BUILTIN_SYM_HASH(len, first, last) \
+    (((len) + 12 * (first) + 7 * (last)) & 31)
+
+static const struct BuiltinSym builtin_syms[32] = {
+    [0]  = {STR("return"), SYM_RETURN},
+    [2]  = {STR("main"),   SYM_MAIN},
+    [4]  = {STR("usize"),  SYM_USIZE},
+    [6]  = {STR("u8"),     SYM_U8},
+    [8]  = {STR("void"),   SYM_VOID},
+    [9]  = {STR("i16"),    SYM_I16},
+    [11] = {STR("u64"),    SYM_U64},
+    [12] = {STR("exit"),   SYM_EXIT},
+    [13] = {STR("i32"),    SYM_I32},
+    [16] = {STR("bool"),   SYM_BOOL},
+    [20] = {STR("isize"),  SYM_ISIZE},
+    [22] = {STR("i8"),     SYM_I8},
+    [24] = {STR("if"),     SYM_IF},
+    [25] = {STR("u16"),    SYM_U16},
+    [27] = {STR("i64"),    SYM_I64},
+    [28] = {STR("while"),  SYM_WHILE},
+    [29] = {STR("u32"),    SYM_U32},
+};
+
+// Returns the builtin symbol for s or -1.
+static int64_t
+get_builtin_sym(Str s) {
+    if (s.len == 0) {
+        return -1;
+    }
+    unsigned char first = s.data[0];
+    unsigned char last = s.data[s.len - 1];
+    const struct BuiltinSym* b =
+        &builtin_syms[BUILTIN_SYM_HASH(s.len, first, last)];
+    if (b->name.data && str_eq(b->name, s)) {
+        return b->sym;
+    }
+    return -1;
+}
+
+static uint32_t
+str_hash(Str s) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < s.len; i++) {
+        h = (h ^ (unsigned char)s.data[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void
+sym_shard_grow_table(struct SymShard* sh) {
+    size_t cap = sh->cap_table ? sh->cap_table * 2 : 64;
+    uint32_t* table = calloc(cap, sizeof *table);
+    if (table == NULL) {
+        perror("calloc");
+        abort();
+    }
+    for (size_t i = 0; i < sh->cap_table; i++) {
+        uint32_t slot = sh->table[i];
+        if (slot) {
+            size_t j = str_hash(sh->strs[slot - 1]) & (cap - 1);
+            while (table[j]) {
+                j = (j + 1) & (cap - 1);
+            }
+            table[j] = slot;
+        }
+    }
+    free(sh->table);
+    sh->table = table;
+    sh->cap_table = cap;
+}
+
+static uint32_t
+sym_shard_add_str(struct SymShard* sh, Str s) {
+    if (sh->n_strs == sh->cap_strs) {
+        size_t cap = sh->cap_strs ? sh->cap_strs * 2 : 64;
+        Str* strs = realloc(sh->strs, cap * sizeof *strs);
+        if (strs == NULL) {
+            perror("realloc");
+            abort();
+        }
+        sh->strs = strs;
+        sh->cap_strs = cap;
+    }
+    if (sh->n_strs > SYM_INDEX_MASK) {
+        fprintf(stderr, "Too many names\n");
+        abort();
+    }
+    sh->strs[sh->n_strs] = s;
+    sh->n_strs++;
+    return sh->n_strs - 1;
+}
+
+// Must be called before any other thread uses the symbols.
+static void
+sym_pool_init() {
+    for (size_t i = 0; i < N_SYM_SHARDS; i++) {
+        pthread_mutex_init(&sym_shards[i].lock, NULL);
+        sym_shard_grow_table(&sym_shards[i]);
+    }
+    struct SymShard* sh = &sym_shards[0];
+    for (Sym sym = 0; sym < N_BUILTIN_SYMS; sym++) {
+        sym_shard_add_str(sh, (Str){0});
+    }
+    for (size_t i = 0; i < ARR_LEN(builtin_syms); i++) {
+        if (builtin_syms[i].name.data) {
+            sh->strs[builtin_syms[i].sym] = builtin_syms[i].name;
+        }
+    }
+}
+
+// The string must stay alive for as long as the symbol is used.
+// This is safe to call from several threads at once.
+static Sym
+sym_intern(Str s) {
+    int64_t builtin = get_builtin_sym(s);
+    if (builtin >= 0) {
+        return builtin;
+    }
+    uint32_t h = str_hash(s);
+    uint32_t shard = h >> SYM_INDEX_BITS;
+    struct SymShard* sh = &sym_shards[shard];
+    pthread_mutex_lock(&sh->lock);
+    // Keep the load factor at most 1/2.
+    if ((sh->n_table + 1) * 2 > sh->cap_table) {
+        sym_shard_grow_table(sh);
+    }
+    size_t mask = sh->cap_table - 1;
+    uint32_t index;
+    for (size_t i = h & mask; ; i = (i + 1) & mask) {
+        uint32_t slot = sh->table[i];
+        if (slot == 0) {
+            index = sym_shard_add_str(sh, s);
+            sh->table[i] = index + 1;
+            sh->n_table++;
+            break;
+        }
+        if (str_eq(sh->strs[slot - 1], s)) {
+            index = slot - 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return (shard << SYM_INDEX_BITS) | index;
+}
+
+// Not safe to call while other threads are interning.
+static Str
+sym_str(Sym sym) {
+    const struct SymShard* sh = &sym_shards[sym >> SYM_INDEX_BITS];
+    assert((sym & SYM_INDEX_MASK) < sh->n_strs);
+    return sh->strs[sym & SYM_INDEX_MASK];
+}
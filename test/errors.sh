@@ -0,0 +1,36 @@
+#!/bin/sh
+# Checks that programs with errors are rejected with a message and exit
+# status 1 instead of being compiled.
+#
+# Usage: test/errors.sh [compiler]    (the default is ./a.out)
+
+l=${1:-./a.out}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+fails=0
+n=0
+# One program per line, and the message it has to give.
+while IFS=: read -r msg program; do
+    echo "$program" > "$dir/error.l"
+    "$l" --no-cache --run "$dir/error.l" 2> "$dir/err"
+    got=$?
+    n=$((n + 1))
+    if [ $got != 1 ] || ! grep -q "$msg" "$dir/err"; then
+        echo "$program: exit status $got, $(head -n 1 "$dir/err")"
+        fails=$((fails + 1))
+    fi
+done <<'EOF'
+Syntax error:main void() { exit 3 }
+Too many:main void() { exit 0; } }
+Unknown function:main void() { x i64 f(); exit x; }
+defined twice:main void() { exit 0; } main void() { exit 1; }
+Unknown variable:main void() { exit y; }
+Unknown variable:main void() { x i64 1; exit x + y * 2; }
+Unknown variable:main void() { y = 3; exit 0; }
+Unknown variable:main void() { if 1 { x i64 2; } exit x; }
+assign to a global:g i64 1; main void() { g = 2; exit g; }
+assign to a global:main void() { main = 2; exit 0; }
+EOF
+echo "$n cases, $fails failed"
+[ $fails = 0 ]
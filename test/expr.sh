@@ -0,0 +1,38 @@
+#!/bin/sh
+# Checks how expressions parse, by the exit status of programs that
+# exit with one.  Operators of the same precedence are left-associative,
+# also when operators that bind tighter are in between.
+#
+# Usage: test/expr.sh [compiler]    (the default is ./a.out)
+
+l=${1:-./a.out}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+fails=0
+n=0
+while IFS=: read -r want expr; do
+    echo "main void() { exit $expr; }" > "$dir/expr.l"
+    "$l" --no-cache --run "$dir/expr.l"
+    got=$?
+    n=$((n + 1))
+    if [ "$got" != "$want" ]; then
+        echo "exit $expr: got $got, want $want"
+        fails=$((fails + 1))
+    fi
+done <<EOF
+34:100 - 30 - 20 - 10 - 5 - 1
+14:2 + 3 * 4
+10:2 * 3 + 4
+2:10 - 2 * 3 - 1 - 1
+1:3 < 0 + 1 * 1 < 5
+1:3 < 1 < 5
+0:1 < 2 < 1
+1:5 - 2 * 2 < 4 - 1 * 2 < 2
+25:100 - 5 * 5 * 3
+17:1 + 2 * 3 * 2 + 4
+0:2 * 3 < 2 + 4
+1:2 * 3 < 2 + 4 + 1 - 0 * 9
+EOF
+echo "$n cases, $fails failed"
+[ $fails = 0 ]
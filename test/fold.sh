@@ -0,0 +1,107 @@
+#!/bin/sh
+# Checks that constant folding gives the same results as the code that
+# is generated when nothing is known, and that both wrap values to
+# their type.  Every case is compiled twice: once with x set to a
+# constant, which the folder sees through, and once with x set in a
+# loop that runs once, which it does not.  Both have to exit with what
+# the shell computes for it.
+#
+# Usage: test/fold.sh [compiler]    (the default is ./a.out)
+
+l=${1:-./a.out}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+min=$((-9223372036854775807 - 1))
+
+# wrap value: keeps the low $bits bits of the value and sign extends
+# them if $signed.
+wrap() {
+    if [ $bits = 64 ]; then
+        echo $(($1))
+        return
+    fi
+    w=$(($1 & ((1 << bits) - 1)))
+    if [ $signed = 1 ] && [ $((w >> (bits - 1))) = 1 ]; then
+        w=$((w | -(1 << bits)))
+    fi
+    echo $w
+}
+
+# less a b: 1 if a < b as the type, else 0.
+less() {
+    if [ $signed = 1 ]; then
+        echo $(($1 < $2))
+    else
+        echo $((($1 ^ min) < ($2 ^ min)))
+    fi
+}
+
+# The value of y for x, both wrapped to the type.  Numbers next to x are
+# wrapped too, which only matters for <.
+value() {
+    case $expr in
+    *" < "*)
+        left=$(wrap "$(echo "${expr% < *}" | sed "s/x/($x)/g")")
+        right=$(wrap "${expr#* < }")
+        less $left $right
+        ;;
+    *)
+        wrap "$(echo "$expr" | sed "s/x/($x)/g")"
+        ;;
+    esac
+}
+
+fails=0
+n=0
+for type in u8 i8 u16 i16 u32 i32 u64 i64; do
+    bits=${type#?}
+    case $type in
+    i*) signed=1 ;;
+    *) signed=0 ;;
+    esac
+    for init in 0 1 127 200 255 40000 70000 4000000000 5000000000; do
+        x=$(wrap $init)
+        for expr in "x + 100" "x - 250" "x * 3" "x * x" "0 - x" \
+                    "x + x + x" "x < 50" "x - 1 < 1000"; do
+            y=$(value)
+            for tail in "if y < 50 { exit 1; } exit 2;" "exit y;"; do
+                case $tail in
+                if*) want=$((2 - $(less $y 50))) ;;
+                *) want=$((y & 255)) ;;
+                esac
+                cat > "$dir/folded.l" <<EOF
+main void() {
+    x $type $init;
+    y $type $expr;
+    $tail
+}
+EOF
+                cat > "$dir/unfolded.l" <<EOF
+main void() {
+    x $type 0;
+    n i64 0;
+    while n < 1 {
+        x = $init;
+        n = n + 1;
+    }
+    y $type $expr;
+    $tail
+}
+EOF
+                "$l" --no-cache --run "$dir/folded.l"
+                folded=$?
+                "$l" --no-cache --run "$dir/unfolded.l"
+                unfolded=$?
+                n=$((n + 1))
+                if [ $folded != $want ] || [ $unfolded != $want ]; then
+                    echo "x $type $init; y $type $expr; $tail:" \
+                         "folded $folded, unfolded $unfolded, want $want"
+                    fails=$((fails + 1))
+                fi
+            done
+        done
+    done
+done
+echo "$n cases, $fails failed"
+[ $fails = 0 ]
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Checks that the time and memory to compile grow linearly up to a
+# program of a million statements.  Generated programs of a quarter,
+# half and all of the statements, in functions of 20 statements, are
+# compiled once each.  The time and the peak of memory mapped per
+# statement of the biggest must be at most twice those of the smallest.
+#
+# Usage: test/stress.sh [compiler] [statements]
+#        (the defaults are ./a.out and 1000000)
+
+l=$(realpath "${1:-./a.out}") || exit 1
+stmts=${2:-1000000}
+src=$(dirname "$0")/..
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+# The programs come from the generator of the benchmark.
+cc -O2 -o "$dir/bench" "$src/bench/bench.c" || exit 1
+cd "$dir" || exit 1
+
+printf "%-10s %10s %12s %12s %12s\n" stmts ms ns/stmt "peak KiB" bytes/stmt
+first=
+for part in 4 2 1; do
+    fns=$((stmts / part / 20))
+    [ $fns -ge 1 ] || fns=1
+    n=$((fns * 20))
+    ./bench gen --fns=$fns > case.l || exit 1
+    start=$(date +%s%N)
+    "$l" --no-cache --mem-stats case.l 2> err
+    status=$?
+    end=$(date +%s%N)
+    if [ $status != 0 ]; then
+        echo "$n statements: exit status $status, $(head -n 1 err)"
+        exit 1
+    fi
+    ns=$((end - start))
+    peak=$(sed -n 's/^memory:.* peak \([0-9]*\)$/\1/p' err)
+    printf "%-10d %10d %12d %12d %12d\n" $n $((ns / 1000000)) $((ns / n)) \
+           $((peak / 1024)) $((peak / n))
+    [ -n "$first" ] || first="$n $ns $peak"
+    last="$n $ns $peak"
+done
+
+echo "$first $last" | awk '{
+    time = ($5 / $4) / ($2 / $1)
+    mem = ($6 / $4) / ($3 / $1)
+    ok = time <= 2 && mem <= 2
+    printf "per statement, %d vs %d: time x%.2f, memory x%.2f%s\n",
+           $4, $1, time, mem, ok ? "" : "  NOT LINEAR"
+    exit !ok
+}'
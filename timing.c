@@ -0,0 +1,295 @@
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Measures the phases of a compile for --time-report and --time-trace.
+// Nothing is measured unless one of them is given.
+
+enum Phase {
+    PHASE_LOAD,
+    PHASE_PARSE,
+    PHASE_COMPILE_AST_ROOT,
+    PHASE_DETERMINE_VREGS,
+    PHASE_COMPILE_INSTRS,
+    PHASE_LINK,
+    PHASE_WRITE_ELF,
+    PHASE_RUN,
+    N_PHASES,
+};
+
+static const char* const phase_names[N_PHASES] = {
+    [PHASE_LOAD] = "load",
+    [PHASE_PARSE] = "parse",
+    [PHASE_COMPILE_AST_ROOT] = "compile_ast_root",
+    [PHASE_DETERMINE_VREGS] = "determine_vregs",
+    [PHASE_COMPILE_INSTRS] = "compile_instrs",
+    [PHASE_LINK] = "link",
+    [PHASE_WRITE_ELF] = "write_elf_file",
+    [PHASE_RUN] = "run",
+};
+
+enum PerfCounter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    N_PERF_COUNTERS,
+};
+
+struct PhaseSample {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    size_t arena_bytes;
+    uint64_t perf[N_PERF_COUNTERS];
+};
+
+struct PhaseTimes {
+    struct PhaseSample start;
+    struct PhaseSample total;  // Of all times the phase ran.
+    bool ran;
+};
+
+// A span of time on one thread, for the trace.
+struct TraceEvent {
+    const char* name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint32_t tid;
+    size_t n_jobs;     // For worker spans.
+    int phase;         // Index into phase_times, or -1.
+};
+
+struct Timing {
+    bool on;
+    uint64_t start_ns;
+    int perf_fds[N_PERF_COUNTERS];
+    bool have_perf;
+    enum Phase current;
+    struct PhaseTimes phases[N_PHASES];
+
+    pthread_mutex_t lock;  // For events.
+    struct TraceEvent* events;
+    size_t n_events;
+    size_t cap_events;
+    atomic_uint next_tid;
+};
+
+static struct Timing timing = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .next_tid = 1,
+};
+
+// 0 is the main thread.
+static _Thread_local uint32_t trace_tid;
+static _Thread_local bool has_trace_tid;
+
+static uint64_t
+clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The counters are inherited by the threads that are started later,
+// and their counts are added when they end.  Threads are only running
+// inside run_parallel, so the counts are complete between phases.
+static bool
+open_perf_counters(int* fds) {
+    static const uint64_t configs[N_PERF_COUNTERS] = {
+        [PERF_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+        [PERF_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+        [PERF_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+    };
+    for (size_t i = 0; i < N_PERF_COUNTERS; i++) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof attr,
+            .config = configs[i],
+            .inherit = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[i] == -1) {
+            for (size_t j = 0; j < i; j++) {
+                close(fds[j]);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+timing_init() {
+    timing.on = true;
+    has_trace_tid = true;
+    timing.start_ns = clock_ns(CLOCK_MONOTONIC);
+    timing.have_perf = open_perf_counters(timing.perf_fds);
+}
+
+static void
+take_sample(struct PhaseSample* s) {
+    s->wall_ns = clock_ns(CLOCK_MONOTONIC);
+    s->cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    s->arena_bytes = mem_allocated();
+    for (size_t i = 0; timing.have_perf && i < N_PERF_COUNTERS; i++) {
+        uint64_t count = 0;
+        if (read(timing.perf_fds[i], &count, sizeof count) != sizeof count) {
+            count = 0;
+        }
+        s->perf[i] = count;
+    }
+}
+
+static void
+add_trace_event(struct TraceEvent e) {
+    pthread_mutex_lock(&timing.lock);
+    if (timing.n_events == timing.cap_events) {
+        timing.events = grow_array(timing.events, &timing.cap_events,
+                                   sizeof *timing.events);
+    }
+    timing.events[timing.n_events] = e;
+    timing.n_events++;
+    pthread_mutex_unlock(&timing.lock);
+}
+
+static inline void
+phase_begin(enum Phase phase) {
+    if (!timing.on) {
+        return;
+    }
+    timing.current = phase;
+    take_sample(&timing.phases[phase].start);
+}
+
+static inline void
+phase_end(enum Phase phase) {
+    if (!timing.on) {
+        return;
+    }
+    struct PhaseTimes* p = &timing.phases[phase];
+    struct PhaseSample end;
+    take_sample(&end);
+    p->total.wall_ns += end.wall_ns - p->start.wall_ns;
+    p->total.cpu_ns += end.cpu_ns - p->start.cpu_ns;
+    p->total.arena_bytes += end.arena_bytes - p->start.arena_bytes;
+    for (size_t i = 0; i < N_PERF_COUNTERS; i++) {
+        p->total.perf[i] += end.perf[i] - p->start.perf[i];
+    }
+    p->ran = true;
+    add_trace_event((struct TraceEvent){
+        .name = phase_names[phase],
+        .start_ns = p->start.wall_ns,
+        .end_ns = end.wall_ns,
+        .phase = phase,
+    });
+}
+
+// Called by every thread of run_parallel when it has no more jobs.
+static void
+trace_worker(uint64_t start_ns, size_t n_jobs) {
+    if (!timing.on) {
+        return;
+    }
+    if (!has_trace_tid) {
+        trace_tid = timing.next_tid++;
+        has_trace_tid = true;
+    }
+    add_trace_event((struct TraceEvent){
+        .name = phase_names[timing.current],
+        .start_ns = start_ns,
+        .end_ns = clock_ns(CLOCK_MONOTONIC),
+        .tid = trace_tid,
+        .n_jobs = n_jobs,
+        .phase = -1,
+    });
+}
+
+static void
+print_time_report() {
+    static const char* const perf_names[N_PERF_COUNTERS] = {
+        "cycles", "instrs", "cache-miss",
+    };
+    FILE* f = stderr;
+    fprintf(f, "%-18s %10s %10s %12s", "phase", "wall ms", "cpu ms",
+            "arena KiB");
+    for (size_t i = 0; i < N_PERF_COUNTERS; i++) {
+        fprintf(f, " %14s", perf_names[i]);
+    }
+    fprintf(f, "\n");
+    struct PhaseSample sum = {0};
+    for (size_t p = 0; p < N_PHASES; p++) {
+        const struct PhaseSample* t = &timing.phases[p].total;
+        if (!timing.phases[p].ran) {
+            continue;
+        }
+        sum.wall_ns += t->wall_ns;
+        sum.cpu_ns += t->cpu_ns;
+        sum.arena_bytes += t->arena_bytes;
+        for (size_t i = 0; i < N_PERF_COUNTERS; i++) {
+            sum.perf[i] += t->perf[i];
+        }
+    }
+    for (size_t p = 0; p <= N_PHASES; p++) {
+        const struct PhaseSample* t = &sum;
+        const char* name = "total";
+        if (p < N_PHASES) {
+            if (!timing.phases[p].ran) {
+                continue;
+            }
+            t = &timing.phases[p].total;
+            name = phase_names[p];
+        }
+        fprintf(f, "%-18s %10.3f %10.3f %12.1f", name, t->wall_ns / 1e6,
+                t->cpu_ns / 1e6, t->arena_bytes / 1024.0);
+        for (size_t i = 0; i < N_PERF_COUNTERS; i++) {
+            if (timing.have_perf) {
+                fprintf(f, " %14lu", t->perf[i]);
+            } else {
+                fprintf(f, " %14s", "-");
+            }
+        }
+        fprintf(f, "\n");
+    }
+    if (!timing.have_perf) {
+        fprintf(f, "(perf_event_open is not available)\n");
+    }
+}
+
+// Writes the phases and the work of every thread in the Chrome trace
+// event format.
+static bool
+write_time_trace(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"l\"}}");
+    for (size_t i = 0; i < timing.n_events; i++) {
+        const struct TraceEvent* e = &timing.events[i];
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                "\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                e->name, e->phase >= 0 ? "phase" : "worker", e->tid,
+                (e->start_ns - timing.start_ns) / 1e3,
+                (e->end_ns - e->start_ns) / 1e3);
+        if (e->phase >= 0) {
+            const struct PhaseSample* t = &timing.phases[e->phase].total;
+            fprintf(f, "\"cpu_ms\":%.3f,\"arena_bytes\":%zu",
+                    t->cpu_ns / 1e6, t->arena_bytes);
+            if (timing.have_perf) {
+                fprintf(f, ",\"cycles\":%lu,\"instructions\":%lu,"
+                        "\"cache_misses\":%lu",
+                        t->perf[PERF_CYCLES], t->perf[PERF_INSTRUCTIONS],
+                        t->perf[PERF_CACHE_MISSES]);
+            }
+        } else {
+            fprintf(f, "\"jobs\":%zu", e->n_jobs);
+        }
+        fprintf(f, "}}");
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+}
@@ -1,29 +1,25 @@
-#define MAX_VINSTRS 1000
-static Rv64Instr vinstrs[MAX_VINSTRS];
-static size_t n_vinstrs;
+// The instructions of the function that is being lowered on this thread.
+static _Thread_local ChunkArray vinstrs = {.elem_size = sizeof (Rv64Instr)};
+static _Thread_local ChunkArray postinstrs = {.elem_size = sizeof (Rv64Instr)};
 
-#define MAX_POSTINSTRS 1000
-static Rv64Instr postinstrs[MAX_POSTINSTRS];
-static size_t n_postinstrs;
+// The instruction that the next call to rv64_add will fill in.
+static Rv64Instr*
+next_vinstr() {
+    return chunk_array_next(&vinstrs);
+}
 
 static Rv64Instr*
 rv64_add(Segment* seg, Rv64Instr instr) {
-    if (n_vinstrs >= MAX_VINSTRS) {
-        abort();
-    }
-    vinstrs[n_vinstrs] = instr;
-    n_vinstrs++;
-    return &vinstrs[n_vinstrs - 1];
+    Rv64Instr* i = chunk_array_add(&vinstrs);
+    *i = instr;
+    return i;
 }
 
 static Rv64Instr*
 rv64_add_end(Segment* seg, Rv64Instr instr) {
-    if (n_postinstrs >= MAX_POSTINSTRS) {
-        abort();
-    }
-    postinstrs[n_postinstrs] = instr;
-    n_postinstrs++;
-    return &postinstrs[n_postinstrs - 1];
+    Rv64Instr* i = chunk_array_add(&postinstrs);
+    *i = instr;
+    return i;
 }
 
 enum syscall {
@@ -52,22 +48,7 @@ rv64_add_load(Segment* seg, Vreg* rd, Binding* b) {
 }
 
 static void
-rv64_add_li(Segment* seg, Vreg* rd, const Ast* val) {
-    assert(val->type == AST_NUM);
-    uint64_t imm = val->num.u;
-    Rv64Instr instr = {
-        .type = RV64_RI64,
-        .ri64 = {
-            .fn = rv64_write_li,
-            .rd = rd,
-            .imm = imm,
-        },
-    };
-    rv64_add(seg, instr);
-}
-
-static void
-rv64_add_li_static(Segment* seg, Vreg* rd, uint64_t val) {
+rv64_add_li(Segment* seg, Vreg* rd, uint64_t val) {
     Rv64Instr instr = {
         .type = RV64_RI64,
         .ri64 = {
@@ -104,6 +85,7 @@ into_reg(Segment* seg, Vreg* r) {
         rv64_add_li(seg, dest, r->val);
         break;
     case VREG_UNUSED:
+    case VREG_STACK:
         abort();
         break;
     }
@@ -133,6 +115,7 @@ into_this_reg(Segment* seg, Vreg* r, enum reg into) {
         rv64_add_li(seg, dest, r->val);
         break;
     case VREG_UNUSED:
+    case VREG_STACK:
         abort();
         break;
     }
@@ -154,19 +137,19 @@ static void
 rv64_add_exit(Segment* seg, Vreg* r) {
     Vreg* a0 = into_this_reg(seg, r, REG_A0);
     Vreg* a7 = alloc_this_reg(REG_A7);
-    rv64_add_li_static(seg, a7, SYS_EXIT);
+    rv64_add_li(seg, a7, SYS_EXIT);
     rv64_add_ecall(seg);
 }
 
 static Vreg*
-rv64_add_add(Segment* seg, Vreg* rd, Vreg* l, Vreg* r) {
+rv64_add_r(Segment* seg, Rv64FnR fn, Vreg* rd, Vreg* l, Vreg* r) {
     l = into_reg(seg, l);
     r = into_reg(seg, r);
     rd = into_reg(seg, rd);
     Rv64Instr instr = {
         .type = RV64_R,
         .r = {
-            .fn = rv64_write_add,
+            .fn = fn,
             .rd = rd,
             .rs1 = l,
             .rs2 = r,
@@ -177,23 +160,62 @@ rv64_add_add(Segment* seg, Vreg* rd, Vreg* l, Vreg* r) {
 }
 
 static Vreg*
-rv64_add_sub(Segment* seg, Vreg* rd, Vreg* l, Vreg* r) {
-    l = into_reg(seg, l);
-    r = into_reg(seg, r);
+rv64_add_i(Segment* seg, Rv64FnI fn, Vreg* rd, Vreg* rs, int16_t imm) {
+    rs = into_reg(seg, rs);
     rd = into_reg(seg, rd);
     Rv64Instr instr = {
-        .type = RV64_R,
-        .r = {
-            .fn = rv64_write_sub,
+        .type = RV64_I,
+        .i = {
+            .fn = fn,
             .rd = rd,
-            .rs1 = l,
-            .rs2 = r,
+            .rs1 = rs,
+            .imm = imm,
         },
     };
     rv64_add(seg, instr);
     return rd;
 }
 
+static Vreg*
+rv64_add_add(Segment* seg, Vreg* rd, Vreg* l, Vreg* r) {
+    return rv64_add_r(seg, rv64_write_add, rd, l, r);
+}
+
+static Vreg*
+rv64_add_sub(Segment* seg, Vreg* rd, Vreg* l, Vreg* r) {
+    return rv64_add_r(seg, rv64_write_sub, rd, l, r);
+}
+
+static Vreg*
+rv64_add_mul(Segment* seg, Vreg* rd, Vreg* l, Vreg* r) {
+    return rv64_add_r(seg, rv64_write_mul, rd, l, r);
+}
+
+// rd = l < r, signed or unsigned.
+static Vreg*
+rv64_add_slt(Segment* seg, Vreg* rd, Vreg* l, Vreg* r, bool is_signed) {
+    return rv64_add_r(seg, is_signed ? rv64_write_slt : rv64_write_sltu,
+                      rd, l, r);
+}
+
+static Vreg*
+rv64_add_slti(Segment* seg, Vreg* rd, Vreg* l, int16_t imm, bool is_signed) {
+    return rv64_add_i(seg, is_signed ? rv64_write_slti : rv64_write_sltiu,
+                      rd, l, imm);
+}
+
+static Vreg*
+rv64_add_slli(Segment* seg, Vreg* rd, Vreg* r, int16_t shamt) {
+    return rv64_add_i(seg, rv64_write_slli, rd, r, shamt);
+}
+
+// Shifts right by shamt, filling with the sign bit if `arith`.
+static Vreg*
+rv64_add_srli(Segment* seg, Vreg* rd, Vreg* r, int16_t shamt, bool arith) {
+    return rv64_add_i(seg, arith ? rv64_write_srai : rv64_write_srli,
+                      rd, r, shamt);
+}
+
 static Rv64Instr*
 rv64_add_beqz(Segment* seg, Vreg* cond) {
     cond = into_reg(seg, cond);
@@ -232,8 +254,19 @@ rv64_add_call(Segment* seg, Binding* b) {
     return rv64_add(seg, instr);
 }
 
+// The frame of the function is taken down here, before it returns or
+// jumps to another function.
+static void
+rv64_add_fn_leave(Segment* seg) {
+    Rv64Instr instr = {
+        .type = FN_LEAVE,
+    };
+    rv64_add(seg, instr);
+}
+
 static Rv64Instr*
 rv64_add_ret_void(Segment* seg) {
+    rv64_add_fn_leave(seg);
     Rv64Instr instr = {
         .type = RV64_I,
         .i = {
@@ -249,6 +282,7 @@ rv64_add_ret_void(Segment* seg) {
 static Rv64Instr*
 rv64_add_ret_val(Segment* seg, Vreg* r) {
     r = into_this_reg(seg, r, REG_A0);
+    rv64_add_fn_leave(seg);
     Rv64Instr instr = {
         .type = RV64_I,
         .i = {
@@ -293,15 +327,3 @@ rv64_add_patch_addr_binding(Segment* seg, Rv64Instr* i, Binding* b) {
     };
     rv64_add_end(seg, instr);
 }
-
-static void
-add_assign(Segment* seg, Vreg* dest, Vreg* source) {
-    Rv64Instr instr = {
-        .type = ASSIGN,
-        .assign = {
-            .dest = dest,
-            .val = source,
-        },
-    };
-    rv64_add(seg, instr);
-}
@@ -0,0 +1,469 @@
+#include <errno.h>
+
+// Encodes the instructions as x86-64 machine code instead of RISC-V.
+//
+// The instructions name RISC-V registers, so every one of them gets a
+// home: ra, sp and the first registers that the allocator hands out
+// are kept in x86-64 registers and the rest in slots of a frame that
+// rbx points to.  gp and tp are never used, so their x86-64 registers
+// go to x12 and x13 instead.  x10 is in rdi and x11 in rsi, where the
+// first two arguments of a system call go.  The code only uses
+// relative addresses, so it runs wherever it is mapped.
+//
+// sp (x2, in r13) points to a stack of its own above rsp, since call
+// and ret use rsp for the return addresses.
+
+enum X86Reg {
+    X86_RAX,
+    X86_RCX,
+    X86_RDX,
+    X86_RBX,
+    X86_RSP,
+    X86_RBP,
+    X86_RSI,
+    X86_RDI,
+    X86_R8,
+    X86_R9,
+    X86_R10,
+    X86_R11,
+    X86_R12,
+    X86_R13,
+    X86_R14,
+    X86_R15,
+};
+
+// The x86-64 register of x0 to x13, or -1 for the frame.  rax, rcx
+// and rdx are scratch registers.
+static const int8_t x86_reg_homes[14] = {
+    -1, X86_R12, X86_R13, -1, -1, X86_RBP, X86_R8, X86_R9,
+    X86_R10, X86_R11, X86_RDI, X86_RSI, X86_R14, X86_R15,
+};
+
+// Offset from rbx of the slot of a register that is not kept in an
+// x86-64 register.  They all fit in a signed byte.
+#define X86_SLOT(r) (8 * ((int)(r) - 16))
+// Slots that no register uses.
+#define X86_SLOT_SYSCALL (-128)  // Address of the system call routine.
+#define X86_SLOT_HOST_RSP (-120) // rsp to return to when the program exits.
+// Bytes of the frame below and above rbx.
+#define X86_FRAME_BELOW 128
+#define X86_FRAME_SIZE 264       // Keeps rsp aligned to 16 for --run.
+// Bytes between sp and rsp at the start, for the frames of the
+// functions.
+#define X86_STACK_SIZE (1 << 20)
+
+// The most bytes that x86_encode_instr emits for one instruction.
+#define X86_MAX_INSTR_SIZE 24
+
+// Functions start on a 16-byte boundary, which is what instruction fetch
+// works in.  The padding is int3.
+#define X86_FN_ALIGN 16
+#define X86_FN_PAD '\xcc'
+
+static int
+x86_home(enum reg r) {
+    return r < ARR_LEN(x86_reg_homes) ? x86_reg_homes[r] : -1;
+}
+
+static void
+x86_emit(Segment* seg, const uint8_t* bytes, size_t n) {
+    emit_bytes(seg, bytes, n);
+}
+
+#define X86_EMIT(seg, ...) \
+    x86_emit(seg, (const uint8_t[]){__VA_ARGS__}, \
+             sizeof (const uint8_t[]){__VA_ARGS__})
+
+static void
+x86_emit_imm32(Segment* seg, int32_t imm) {
+    emit_bytes(seg, &imm, sizeof imm);
+}
+
+// REX.W with the high bit of the register in the ModRM r/m field.
+static uint8_t
+x86_rex_b(int h) {
+    return 0x48 | (h >= 8 ? 1 : 0);
+}
+
+static size_t
+x86_load_rax_size(enum reg r) {
+    if (r == REG_ZERO) {
+        return 2;
+    }
+    return x86_home(r) >= 0 ? 3 : 4;
+}
+
+static void
+x86_load_rax(Segment* seg, enum reg r) {
+    int h = x86_home(r);
+    if (r == REG_ZERO) {
+        X86_EMIT(seg, 0x31, 0xc0);  // xor eax, eax
+    } else if (h >= 0) {
+        // mov rax, h
+        X86_EMIT(seg, 0x48 | (h >= 8 ? 4 : 0), 0x89, 0xc0 | (h & 7) << 3);
+    } else {
+        // mov rax, [rbx+d]
+        X86_EMIT(seg, 0x48, 0x8b, 0x43, (uint8_t)X86_SLOT(r));
+    }
+}
+
+static void
+x86_store_rax(Segment* seg, enum reg r) {
+    int h = x86_home(r);
+    if (r == REG_ZERO) {
+        return;
+    } else if (h >= 0) {
+        X86_EMIT(seg, x86_rex_b(h), 0x89, 0xc0 | (h & 7));  // mov h, rax
+    } else {
+        // mov [rbx+d], rax
+        X86_EMIT(seg, 0x48, 0x89, 0x43, (uint8_t)X86_SLOT(r));
+    }
+}
+
+// rax = rax op r, for the ops whose encoding is `op r64, r/m64`.
+static void
+x86_op_rax(Segment* seg, const uint8_t* op, size_t op_len, enum reg r) {
+    int h = x86_home(r);
+    if (h >= 0) {
+        X86_EMIT(seg, x86_rex_b(h));
+        x86_emit(seg, op, op_len);
+        X86_EMIT(seg, 0xc0 | (h & 7));
+    } else {
+        X86_EMIT(seg, 0x48);
+        x86_emit(seg, op, op_len);
+        X86_EMIT(seg, 0x43, (uint8_t)X86_SLOT(r));
+    }
+}
+
+static void
+x86_write_li(Segment* seg, enum reg rd, uint64_t n) {
+    int h = x86_home(rd);
+    if (rd == REG_ZERO) {
+        return;
+    }
+    if ((int64_t)n != (int32_t)n) {
+        X86_EMIT(seg, 0x48, 0xb8);  // movabs rax, n
+        emit_bytes(seg, &n, sizeof n);
+        x86_store_rax(seg, rd);
+    } else if (h >= 0) {
+        X86_EMIT(seg, x86_rex_b(h), 0xc7, 0xc0 | (h & 7));  // mov h, n
+        x86_emit_imm32(seg, n);
+    } else {
+        // mov [rbx+d], n
+        X86_EMIT(seg, 0x48, 0xc7, 0x43, (uint8_t)X86_SLOT(rd));
+        x86_emit_imm32(seg, n);
+    }
+}
+
+// rax = 1 if the last compare was less than, else 0.
+static void
+x86_write_setcc_rax(Segment* seg, bool is_signed) {
+    X86_EMIT(seg, 0x0f, is_signed ? 0x9c : 0x92, 0xc0);  // setl/setb al
+    X86_EMIT(seg, 0x0f, 0xb6, 0xc0);                     // movzx eax, al
+}
+
+static void
+x86_write_i(Segment* seg, Rv64FnI fn, enum reg rd, enum reg rs1,
+            int16_t imm) {
+    x86_load_rax(seg, rs1);
+    if (fn == rv64_write_slli) {
+        X86_EMIT(seg, 0x48, 0xc1, 0xe0, imm);  // shl rax, imm
+    } else if (fn == rv64_write_srli) {
+        X86_EMIT(seg, 0x48, 0xc1, 0xe8, imm);  // shr rax, imm
+    } else if (fn == rv64_write_srai) {
+        X86_EMIT(seg, 0x48, 0xc1, 0xf8, imm);  // sar rax, imm
+    } else if (fn == rv64_write_slti || fn == rv64_write_sltiu) {
+        X86_EMIT(seg, 0x48, 0x3d);  // cmp rax, imm
+        x86_emit_imm32(seg, imm);
+        x86_write_setcc_rax(seg, fn == rv64_write_slti);
+    } else if (fn == rv64_write_addi) {
+        X86_EMIT(seg, 0x48, 0x05);  // add rax, imm
+        x86_emit_imm32(seg, imm);
+    } else if (fn == rv64_write_ld) {
+        X86_EMIT(seg, 0x48, 0x8b, 0x80);  // mov rax, [rax+imm]
+        x86_emit_imm32(seg, imm);
+    } else {
+        abort();
+    }
+    x86_store_rax(seg, rd);
+}
+
+// The value goes through rcx.
+static void
+x86_write_sd(Segment* seg, enum reg rs1, enum reg rs2, int16_t imm) {
+    x86_load_rax(seg, rs2);
+    X86_EMIT(seg, 0x48, 0x89, 0xc1);  // mov rcx, rax
+    x86_load_rax(seg, rs1);
+    X86_EMIT(seg, 0x48, 0x89, 0x88);  // mov [rax+imm], rcx
+    x86_emit_imm32(seg, imm);
+}
+
+static void
+x86_write_r(Segment* seg, Rv64FnR fn, enum reg rd, enum reg rs1,
+            enum reg rs2) {
+    x86_load_rax(seg, rs1);
+    if (fn == rv64_write_add) {
+        if (rs2 != REG_ZERO) {
+            x86_op_rax(seg, (const uint8_t[]){0x03}, 1, rs2);
+        }
+    } else if (fn == rv64_write_sub) {
+        if (rs2 != REG_ZERO) {
+            x86_op_rax(seg, (const uint8_t[]){0x2b}, 1, rs2);
+        }
+    } else if (fn == rv64_write_mul) {
+        if (rs2 == REG_ZERO) {
+            X86_EMIT(seg, 0x31, 0xc0);
+        } else {
+            x86_op_rax(seg, (const uint8_t[]){0x0f, 0xaf}, 2, rs2);
+        }
+    } else if (fn == rv64_write_slt || fn == rv64_write_sltu) {
+        if (rs2 == REG_ZERO) {
+            X86_EMIT(seg, 0x48, 0x83, 0xf8, 0x00);  // cmp rax, 0
+        } else {
+            x86_op_rax(seg, (const uint8_t[]){0x3b}, 1, rs2);  // cmp rax, r
+        }
+        x86_write_setcc_rax(seg, fn == rv64_write_slt);
+    } else {
+        abort();
+    }
+    x86_store_rax(seg, rd);
+}
+
+static void
+x86_write_rel32(Segment* seg, size_t at, size_t target) {
+    int32_t rel = target - (at + 4);
+    memcpy(seg->data + at, &rel, sizeof rel);
+}
+
+// Patches the jump, branch or call of instr to go to target.
+static void
+x86_patch(Segment* seg, Rv64Instr* instr, size_t target) {
+    switch (instr->type) {
+    case RV64_B:
+        // After the test and the 0f 84 of jz.
+        x86_write_rel32(seg, instr->offset
+                        + x86_load_rax_size(instr->b.rs1->reg) + 3 + 2,
+                        target);
+        break;
+    case RV64_J:
+        x86_write_rel32(seg, instr->offset + 1, target);
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+x86_encode_instr(Segment* text, Rv64Instr* instr) {
+    switch (instr->type) {
+    case RV64_R:
+        assert(instr->r.rd->state == VREG_EXACT);
+        assert(instr->r.rs1->state == VREG_EXACT);
+        assert(instr->r.rs2->state == VREG_EXACT);
+        x86_write_r(text, instr->r.fn, instr->r.rd->reg, instr->r.rs1->reg,
+                    instr->r.rs2->reg);
+        break;
+    case RV64_I:
+        assert(instr->i.rd->state == VREG_EXACT);
+        assert(instr->i.rs1->state == VREG_EXACT);
+        if (instr->i.fn != rv64_write_jalr) {
+            x86_write_i(text, instr->i.fn, instr->i.rd->reg,
+                        instr->i.rs1->reg, instr->i.imm);
+            break;
+        }
+        // The only jalr that is made is a return.
+        assert(instr->i.rd->reg == REG_ZERO && instr->i.imm == 0);
+        X86_EMIT(text, 0xc3);  // ret
+        break;
+    case RV64_RI64:
+        assert(instr->ri64.rd->state == VREG_EXACT);
+        assert(instr->ri64.fn == rv64_write_li);
+        x86_write_li(text, instr->ri64.rd->reg, instr->ri64.imm);
+        break;
+    case RV64_B:
+        assert(instr->b.rs1->state == VREG_EXACT);
+        assert(instr->b.fn == rv64_write_beqz_unknown);
+        x86_load_rax(text, instr->b.rs1->reg);
+        X86_EMIT(text, 0x48, 0x85, 0xc0);  // test rax, rax
+        X86_EMIT(text, 0x0f, 0x84);        // jz
+        x86_emit_imm32(text, 0);
+        break;
+    case RV64_S:
+        assert(instr->s.rs1->state == VREG_EXACT);
+        assert(instr->s.rs2->state == VREG_EXACT);
+        assert(instr->s.fn == rv64_write_sd);
+        x86_write_sd(text, instr->s.rs1->reg, instr->s.rs2->reg,
+                     instr->s.imm);
+        break;
+    case RV64_J:
+        if (instr->j.fn == rv64_write_call_unknown) {
+            X86_EMIT(text, 0xe8);  // call
+        } else {
+            assert(instr->j.fn == rv64_write_jump_unknown);
+            X86_EMIT(text, 0xe9);  // jmp
+        }
+        x86_emit_imm32(text, 0);
+        break;
+    case RV64_NONE:
+        assert(instr->none.fn == rv64_write_ecall);
+        X86_EMIT(text, 0xff, 0x53, (uint8_t)X86_SLOT_SYSCALL);  // call [rbx+d]
+        break;
+    case ASSIGN: {
+        Vreg* rs = instr->assign.val;
+        Vreg* rd = instr->assign.dest;
+        assert(rd->state == VREG_EXACT);
+        if (rs->state == VREG_STATIC) {
+            x86_write_li(text, rd->reg, rs->val);
+        } else if (rs->state == VREG_EXACT) {
+            assert(rs->reg == rd->reg);
+        }
+    } break;
+    case PATCH:
+        x86_patch(text, instr->patch.instr, instr->patch.target->offset);
+        break;
+    default:
+        break;
+    }
+}
+
+// Emits a short jump with condition code cc (or an unconditional one
+// if cc is -1) and returns where its offset is, for x86_bind8.
+static size_t
+x86_jump8(Segment* seg, int cc) {
+    if (cc < 0) {
+        X86_EMIT(seg, 0xeb, 0);
+    } else {
+        X86_EMIT(seg, 0x70 | cc, 0);
+    }
+    return seg->len - 1;
+}
+
+// Makes the short jump whose offset is at `at` go to here.
+static void
+x86_bind8(Segment* seg, size_t at) {
+    size_t rel = seg->len - (at + 1);
+    assert(rel < 128);
+    seg->data[at] = rel;
+}
+
+#define X86_CC_E 0x4
+
+// Writes the code that the program starts in, before the functions.
+// It sets up the frame and calls main, and has the routine that the
+// system calls go to.  The RISC-V numbers of exit, exit_group, read
+// and write are translated; other calls return -ENOSYS.
+//
+// If `ret` is true the code is called as `int start(void)` and
+// returns the exit status instead of exiting, for --run.
+//
+// Returns the position of the offset of the call to main, which is
+// patched once main is placed.
+static size_t
+x86_write_start(Segment* seg, bool ret) {
+    // push rbx, rbp, r12, r13, r14, r15
+    X86_EMIT(seg, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+    X86_EMIT(seg, 0x48, 0x81, 0xec);  // sub rsp, X86_FRAME_SIZE
+    x86_emit_imm32(seg, X86_FRAME_SIZE);
+    X86_EMIT(seg, 0x48, 0x8d, 0x9c, 0x24);  // lea rbx, [rsp+X86_FRAME_BELOW]
+    x86_emit_imm32(seg, X86_FRAME_BELOW);
+    X86_EMIT(seg, 0x48, 0x8d, 0x05);  // lea rax, [rip+syscall]
+    size_t lea_syscall = seg->len;
+    x86_emit_imm32(seg, 0);
+    X86_EMIT(seg, 0x48, 0x89, 0x43, (uint8_t)X86_SLOT_SYSCALL);
+    X86_EMIT(seg, 0x48, 0x89, 0x63, (uint8_t)X86_SLOT_HOST_RSP);
+    X86_EMIT(seg, 0x49, 0x89, 0xe5);  // mov r13, rsp
+    X86_EMIT(seg, 0x48, 0x81, 0xec);  // sub rsp, X86_STACK_SIZE
+    x86_emit_imm32(seg, X86_STACK_SIZE);
+    X86_EMIT(seg, 0xe8);  // call main
+    size_t call_main = seg->len;
+    x86_emit_imm32(seg, 0);
+    // main returned; its value is the exit status.
+    X86_EMIT(seg, 0x48, 0x89, 0xf8);  // mov rax, rdi
+
+    // Exits with the status in rax.
+    size_t exit = seg->len;
+    if (ret) {
+        X86_EMIT(seg, 0x48, 0x8b, 0x63, (uint8_t)X86_SLOT_HOST_RSP);
+        X86_EMIT(seg, 0x48, 0x81, 0xc4);  // add rsp, X86_FRAME_SIZE
+        x86_emit_imm32(seg, X86_FRAME_SIZE);
+        // pop r15, r14, r13, r12, rbp, rbx; ret
+        X86_EMIT(seg, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c,
+                 0x5d, 0x5b, 0xc3);
+    } else {
+        X86_EMIT(seg, 0x89, 0xc7);  // mov edi, eax
+        X86_EMIT(seg, 0xb8);        // mov eax, SYS_exit_group
+        x86_emit_imm32(seg, 231);
+        X86_EMIT(seg, 0x0f, 0x05);  // syscall
+    }
+
+    // The system call routine.  The number is in x17 and the result
+    // goes to x10.
+    x86_write_rel32(seg, lea_syscall, seg->len);
+    // mov rax, [rbx+d]
+    X86_EMIT(seg, 0x48, 0x8b, 0x43, (uint8_t)X86_SLOT(REG_A7));
+    X86_EMIT(seg, 0x48, 0x83, 0xf8, 93);                // cmp rax, 93
+    size_t to_exit = x86_jump8(seg, X86_CC_E);
+    X86_EMIT(seg, 0x48, 0x83, 0xf8, 94);
+    size_t to_exit_group = x86_jump8(seg, X86_CC_E);
+    X86_EMIT(seg, 0x48, 0x83, 0xf8, 64);
+    size_t to_write = x86_jump8(seg, X86_CC_E);
+    X86_EMIT(seg, 0x48, 0x83, 0xf8, 63);
+    size_t to_read = x86_jump8(seg, X86_CC_E);
+    X86_EMIT(seg, 0x48, 0xc7, 0xc7);  // mov rdi, -ENOSYS
+    x86_emit_imm32(seg, -ENOSYS);
+    X86_EMIT(seg, 0xc3);
+
+    x86_bind8(seg, to_exit);
+    x86_bind8(seg, to_exit_group);
+    X86_EMIT(seg, 0x48, 0x89, 0xf8);  // mov rax, rdi
+    X86_EMIT(seg, 0xe9);              // jmp exit
+    x86_emit_imm32(seg, 0);
+    x86_write_rel32(seg, seg->len - 4, exit);
+
+    x86_bind8(seg, to_write);
+    X86_EMIT(seg, 0xb8);  // mov eax, SYS_write
+    x86_emit_imm32(seg, 1);
+    size_t to_syscall = x86_jump8(seg, -1);
+    x86_bind8(seg, to_read);
+    X86_EMIT(seg, 0x31, 0xc0);  // xor eax, eax (SYS_read)
+    x86_bind8(seg, to_syscall);
+    // mov rdx, x12
+    int a2 = x86_home(REG_A2);
+    assert(a2 >= 8);
+    X86_EMIT(seg, 0x4c, 0x89, 0xc2 | (a2 & 7) << 3);
+    // syscall overwrites rcx and r11, and r11 is the home of x9.
+    X86_EMIT(seg, 0x41, 0x53);        // push r11
+    X86_EMIT(seg, 0x0f, 0x05);        // syscall
+    X86_EMIT(seg, 0x41, 0x5b);        // pop r11
+    X86_EMIT(seg, 0x48, 0x89, 0xc7);  // mov rdi, rax
+    X86_EMIT(seg, 0xc3);
+    return call_main;
+}
+
+// Maps the text and calls the code at its start, which has to be from
+// x86_write_start.  Returns the exit status of the program.
+static int
+x86_run(const Segment* text) {
+#if defined(__x86_64__)
+    void* p = mmap(NULL, text->len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        abort();
+    }
+    memcpy(p, text->data, text->len);
+    if (mprotect(p, text->len, PROT_READ | PROT_EXEC) != 0) {
+        perror("mprotect");
+        abort();
+    }
+    // The program writes to the file descriptors directly.
+    fflush(NULL);
+    int (*start)(void) = (int (*)(void))p;
+    int status = start() & 0xff;
+    munmap(p, text->len);
+    return status;
+#else
+    fprintf(stderr, "--run needs an x86-64 host\n");
+    return 1;
+#endif
+}